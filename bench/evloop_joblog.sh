@@ -0,0 +1,43 @@
+#!/bin/sh
+# Event loop benchmark: start N background jobs that each write SIZE
+# bytes under 'set -o joblog', so the shell's event loop drains N
+# capturing pipes at once, and report the CPU time the shell itself
+# used with '--evloop epoll' and with '--evloop io_uring'.
+#
+# Usage: bench/evloop_joblog.sh [SIGSHELL] [N] [SIZE]
+#        (defaults: ./sigshell 1000 1000000)
+
+set -e
+shell=${1:-./sigshell}
+n=${2:-1000}
+size=${3:-1000000}
+
+ulimit -n $((n * 2 + 64)) 2>/dev/null || true
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+
+{
+    echo 'set -o joblog'
+    i=0
+    while [ "$i" -lt "$n" ]; do
+        echo "head -c $size /dev/zero &"
+        i=$((i + 1))
+    done
+    # A foreground child waits until it is the shell's last child (the
+    # shell keeps draining and reaping meanwhile), then reads the
+    # shell's own utime and stime (fields 14 and 15) from /proc
+    echo "sh -c 'while [ \$(pgrep -c -P \$PPID) -gt 1 ]; do sleep 0.05; done; echo ticks \$(cut -d\" \" -f14,15 /proc/\$PPID/stat)'"
+} >"$script"
+
+hz=$(getconf CLK_TCK)
+for backend in epoll io_uring; do
+    start=$(date +%s.%N)
+    ticks=$("$shell" --evloop "$backend" <"$script" 2>&1 | sed -n 's/.*ticks \([0-9]*\) \([0-9]*\).*/\1 \2/p')
+    end=$(date +%s.%N)
+    if [ -z "$ticks" ]; then
+        echo "$backend: no result (did the shell fail to start?)" >&2
+        exit 1
+    fi
+    echo "$ticks" | awk -v b="$backend" -v hz="$hz" -v n="$n" -v s="$start" -v e="$end" \
+        '{ printf "%-8s %d jobs: shell user %.2fs sys %.2fs, wall %.2fs\n", b, n, $1 / hz, $2 / hz, e - s }'
+done
@@ -1,186 +1,8087 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE // For getdents64 and other Linux interfaces
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h> // For max_align_t
+#include <stdint.h>
 #include <string.h>
+#include <stdarg.h>
+#include <stdio_ext.h> // For __fpending
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <linux/io_uring.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/time.h> // For timeradd
+#include <time.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <dirent.h> // For the DT_* d_type values
 #include <termios.h> // For tcsetpgrp
 
-#define MAX_CMD_LEN 1024
-#define MAX_ARGS 64
+#define CAPTURE_READ_SIZE 65536
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define POOL_SLAB_OBJECTS 32
+#define MAX_SCRATCH_BUFS 8
+#define MAX_FORKED_SUBST 32
+#define MAX_PROC_SUBST 16 // <(...) and >(...) per command line
+#define MAX_HEREDOCS 8 // Per command line
+#define MAX_PIPELINE_STAGES 32
+#define MAX_PARALLEL 64 // Commands at once in a '#sigshell parallel' block
+#define GETDENTS_BUF_SIZE (256 * 1024)
+#define GLOB_CACHE_BUCKETS 256
+#define HISTORY_TRIGRAM_BITS 16
+#define HISTORY_CHUNK_SIZE 65536
+#define COMPLETION_MAX_LIST 200
+#define SERVE_MAGIC 0x53475348 // "SGSH"
+#define SERVE_MAX_REQUEST (256 * 1024)
+#define PATH_CACHE_BUCKETS 256
+#define ZDB_MAGIC 0x315a4753 // "SGZ1"
+#define ZDB_RECORD_SIZE 10 // rank, last visit, path length
+#define ZDB_MAX_TOTAL 9000 // Ranks are aged once they add up to this
+#define SNAPSHOT_MAGIC 0x50534753 // "SGSP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_NONE UINT32_MAX // String offset of a string that isn't set
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+#define TRACE_RING_SIZE 4096 // Events; must be a power of two
+#define TRACE_MAGIC 0x43525447 // "GTRC"
+#define TRACE_VERSION 1
+#define JOBLOG_RING_SIZE (256 * 1024) // Bytes kept in memory; a power of two
+#define JOBLOG_SPILL_MAX (8 * 1024 * 1024) // Older output kept in the memfd
+#define JOBLOG_PIPE_SIZE (1024 * 1024)
+#define JOBLOG_READS_PER_WAKEUP 8 // So one chatty job can't hog the loop
+#define MAX_FINISHED_JOBLOGS 16
+#define EVLOOP_URING_ENTRIES 4096
+#define EVLOOP_UD_INTERNAL UINT64_MAX // user_data of timeouts and removals
+#define COPY_CHUNK_SIZE (1024 * 1024) // Per copy_file_range/sendfile/splice call
+#define COPY_BUFFER_SIZE (256 * 1024) // When the data has to pass through us
+#define EXEC_ARG_HEADROOM 2048 // Left free of ARG_MAX, as POSIX asks of xargs
+#define EXEC_MAX_ARG_STRLEN (32 * 4096) // Linux's limit on one argv/envp string
+#define MAX_SIGNAL_POLICIES 32
+#define SIGPOLICY_TERM_DELAY_MS 2000 // When 'sigpolicy NAME term' gives none
+
+// Record a trace event. When tracing is off this is one predictable
+// branch on a global.
+#define TRACE(type, pid, arg, name) \
+    do { \
+        if (__builtin_expect(trace_enabled, 0)) { \
+            trace_record((type), (pid), (arg), 0, (name)); \
+        } \
+    } while (0)
 
 // Global variable for terminal's controlling process group ID
 pid_t shell_pgid;
 struct termios shell_tmodes;
 
-// Signal handler for SIGINT (Ctrl+C) in parent shell
-void sigint_handler(int sig) {
-    printf("\n[Shell] Use 'exit' command to quit the shell.\n");
-    printf("sigshell> ");
-    fflush(stdout);
+// Growable byte buffer, always NUL-terminated
+struct strbuf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+// Status lines and notifications waiting to go out with the next prompt
+struct shell_output {
+    struct strbuf pending;
+    struct strbuf note; // latest notification, held back to fold repeats
+    int note_count;
+    unsigned long writes;   // writev calls made for the terminal
+    unsigned long messages; // status lines and notifications sent with them
+};
+
+// Piece of an arena; allocations are carved off the front of data[]
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+};
+
+// Region allocator for objects that all die together (a command line,
+// a job). Released chunks go to a shared free list rather than back to
+// malloc, so once the arenas have grown to fit, allocating is a pointer
+// bump and releasing is a list splice.
+struct arena {
+    struct arena_chunk *head;
+};
+
+// Fixed-size records recycled through a free list. Slabs of
+// POOL_SLAB_OBJECTS are allocated as needed and never returned.
+struct pool {
+    size_t size;
+    void *free_list;
+    unsigned long in_use;
+    unsigned long capacity;
+};
+
+struct alloc_stats {
+    unsigned long chunk_mallocs; // Arena chunks that came from malloc
+    unsigned long chunk_reuses; // ... and those taken from the free list
+    size_t chunk_bytes;
+    unsigned long slab_mallocs;
+};
+
+// NULL-terminated argument vector built by the parser
+struct arglist {
+    char **argv;
+    int argc;
+    int cap;
+    struct arena *arena; // Holds argv and the words if set, else malloc
+};
+
+// Built-in command table entry
+struct builtin {
+    const char *name;
+    int (*fn)(char **args, FILE *out);
+    int pure; // Only writes to 'out', so $(...) may run it in-process
+};
+
+// What Ctrl+C does to a foreground command that has a signal policy
+enum {
+    SIGPOLICY_IGNORE = 1, // Nothing
+    SIGPOLICY_LEADER, // SIGINT to the job's first process only
+    SIGPOLICY_TERM, // SIGTERM to the job after a delay; a second Ctrl+C sends SIGINT
+};
+
+// An entry of the per-command signal translation table ('sigpolicy')
+struct signal_policy {
+    char name[64]; // Matched against argv[0]
+    int action; // SIGPOLICY_*
+    int delay_ms; // For SIGPOLICY_TERM
+};
+
+// The shell's side of a foreground job run under a signal policy. The
+// job doesn't get the terminal: the shell stays in the foreground and
+// takes the terminal's SIGINT, SIGQUIT and SIGTSTP through a signalfd,
+// translating Ctrl+C and passing the other two on to the job.
+struct signal_guard {
+    const struct signal_policy *policy; // NULL while no such job runs
+    pid_t pgid;
+    pid_t leader;
+    int presses; // Ctrl+C so far
+    int sig_fd; // signalfd, created with the first guarded job
+    int timer_fd; // timerfd for SIGPOLICY_TERM's delay
+};
+
+// How to start a child: the shell's usual settings plus whatever a
+// caller (command substitution, the command server) overrides
+struct spawn_options {
+    const struct signal_policy *sigint_policy; // Ctrl+C handled by the shell, or NULL
+    int ignore_tstp; // For children whose output the shell is draining
+    int fds[3]; // Replacement stdin/stdout/stderr, or -1 to inherit
+    const char *cwd; // Directory to run in, or NULL
+    char **env; // "NAME=VALUE" overrides, or NULL
+    pid_t pgid; // Process group to join, or 0 for a new one
+    int no_builtin; // Exec args[0] from $PATH even if it names a builtin
+    const int *pass_fds; // Kept open across exec, for /dev/fd/N arguments
+    int n_pass_fds;
+    int close_fd; // Closed in the child (the shell's end of its pipe), or -1
+};
+
+enum {
+    TRACE_PARSE_START = 1,
+    TRACE_PARSE_END, // arg: argument count
+    TRACE_SPAWN, // name: argv[0]
+    TRACE_EXEC_OK,
+    TRACE_EXEC_FAIL, // arg: errno
+    TRACE_STOP, // arg: signal
+    TRACE_CONTINUE,
+    TRACE_EXIT, // arg: exit status
+    TRACE_RUSAGE // arg: user time, arg2: system time (microseconds)
+};
+
+// Fixed-size binary trace record, written to the file as-is
+struct trace_event {
+    uint64_t ts_ns; // CLOCK_MONOTONIC
+    uint32_t type;
+    int32_t pid;
+    int64_t arg;
+    int64_t arg2;
+    char name[16];
+};
+
+struct trace_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t event_size;
+    int32_t shell_pid;
+};
+
+// Single-producer ring of pending events. 'head' and 'tail' only grow;
+// the slot is the counter modulo TRACE_RING_SIZE.
+struct trace_ring {
+    struct trace_event *ring;
+    uint64_t head;
+    uint64_t tail;
+    int fd;
+};
+
+// Log-linear latency histogram in nanoseconds, HDR style: a fixed
+// relative error (about 3%) over the whole range of values
+struct latency_histogram {
+    const char *name;
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+};
+
+enum { LAT_READ_PARSE, LAT_PARSE_SPAWN, LAT_SPAWN_EXEC, LAT_EXIT_PROMPT, LAT_PROMPT_RENDER, LAT_COUNT };
+
+// Remembered $PATH lookup, like the 'hash' table of other shells
+struct path_cache_entry {
+    char *name;
+    char *path;
+    unsigned long hits;
+    struct path_cache_entry *next;
+};
+
+struct path_cache {
+    char *path_env; // $PATH the entries were resolved against
+    struct path_cache_entry *buckets[PATH_CACHE_BUCKETS];
+};
+
+// What the child reports through the exec status pipe before exiting
+enum { SPAWN_FAIL_CHDIR = 1, SPAWN_FAIL_EXEC };
+
+struct spawn_failure {
+    int stage;
+    int error;
+};
+
+// Everything a child does between fork and exec, worked out by the
+// parent beforehand so the child only makes system calls: no stdio, no
+// malloc, no locks. That keeps the window short and lets the same plan
+// run in a vfork child, which shares the shell's memory until it execs.
+struct spawn_plan {
+    pid_t pgid;
+    struct {
+        int sig;
+        int ignore; // SIG_IGN, else SIG_DFL
+    } signals[8];
+    int n_signals;
+    int close_fd;
+    int fds[3];
+    const int *pass_fds;
+    int n_pass_fds;
+    const char *cwd;
+    const char *file; // Program to exec, or NULL to run 'builtin'
+    char **argv;
+    char **envp;
+    const struct builtin *builtin; // Needs a fork()ed child
+    int status_fd; // Write end of the exec status pipe
+};
+
+// Command substitution counters reported by 'stats'
+struct subst_stats {
+    unsigned long total;
+    unsigned long in_process;
+    unsigned long forked;
+    struct {
+        char *body;
+        unsigned long count;
+    } forked_cmds[MAX_FORKED_SUBST];
+    int n_forked_cmds;
+};
+
+// Named option toggled with 'set -o NAME' / 'set +o NAME'
+struct shell_option {
+    const char *name;
+    int *value;
+    const char *description;
+};
+
+// Record layout returned by the getdents64 system call
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// One directory's entries, as read by a single getdents64 scan
+struct dir_listing {
+    char *path;
+    char *names; // Packed, NUL-terminated entry names
+    uint32_t *offsets;
+    unsigned char *types; // DT_* value per entry
+    size_t count;
+    struct dir_listing *next; // Hash chain in the glob cache
+};
+
+// Compiled glob pattern: one segment per path component
+enum { GLOB_LITERAL, GLOB_ANY, GLOB_STAR, GLOB_CLASS };
+
+struct glob_op {
+    unsigned char type;
+    unsigned char ch;
+    unsigned char set[32]; // Bitmap of accepted bytes for GLOB_CLASS
+};
+
+struct glob_segment {
+    struct glob_op *ops;
+    int n_ops;
+    int is_literal; // No metacharacters, 'literal' holds the unescaped text
+    int is_globstar; // The whole component is '**'
+    char *literal;
+};
+
+struct glob_pattern {
+    struct glob_segment *segs;
+    int n_segs;
+    int absolute;
+    int trailing_slash; // Matches must be directories
+};
+
+// Word being assembled by the parser. 'pattern' mirrors 'text' with
+// quoted glob metacharacters escaped, for pathname expansion.
+struct word_state {
+    struct strbuf text;
+    struct strbuf pattern;
+    int in_word; // Distinguishes an empty quoted word from no word
+    int has_glob;
+};
+
+// A '<<WORD' (or '<<-WORD') whose body follows the command line
+struct heredoc {
+    char *delim; // In line_arena
+    int quoted; // Some of WORD was quoted: the body isn't expanded
+    int strip_tabs; // '<<-': leading tabs are removed from each line
+};
+
+// Here-documents and process substitutions of a command line, handed
+// to the command through spawn_options
+struct command_io {
+    int stdin_fd; // Sealed memfd holding the last here-document, or -1
+    struct heredoc heredocs[MAX_HEREDOCS];
+    int n_heredocs;
+    int subst_fds[MAX_PROC_SUBST]; // The shell's ends, named by /dev/fd/N
+    pid_t subst_pids[MAX_PROC_SUBST]; // 0 if the command didn't start
+    int subst_writes[MAX_PROC_SUBST]; // >(...): the command writes to it
+    int n_subst;
+};
+
+// One command of a pipeline, in line_arena
+struct pipeline_stage {
+    struct arglist args;
+    struct command_io io;
+};
+
+// One history record; file entries point into the mapped file
+struct history_entry {
+    const char *text;
+    uint32_t len;
+};
+
+// Trigram index over HISTORY_CHUNK_SIZE consecutive history entries
+struct history_chunk {
+    uint32_t *start; // Posting list offsets, one per trigram bucket
+    uint16_t *ids; // Entry numbers relative to the chunk's first entry
+};
+
+// Command history: an append-only file mapped at startup, this
+// session's additions, and a lazily built trigram index for search
+struct history {
+    int opened;
+    int fd;
+    char *map;
+    size_t map_len;
+    int loaded;
+    struct history_entry *file_entries;
+    size_t n_file;
+    struct history_entry *session_entries;
+    size_t n_session;
+    size_t session_cap;
+    struct arena session_text; // Never released
+    struct history_chunk *chunks;
+    size_t n_chunks;
+    size_t n_indexed;
+};
+
+// Logical working directory and the pushd/popd stack
+struct dir_state {
+    char *pwd; // As reached through symlinks; kept current by cd
+    char *oldpwd;
+    struct arglist stack; // Top of the stack last
+};
+
+// A directory in the frecency database used by 'z'
+struct zdb_entry {
+    char *path;
+    char *lower; // Lowercased copy for case-insensitive queries
+    uint16_t len;
+    uint16_t base; // Offset of the last component
+    float rank; // Visits, scaled down as the database ages
+    uint32_t last; // Time of the last visit
+};
+
+struct zdb_file_header {
+    uint32_t magic;
+    uint32_t count;
+};
+
+struct zdb {
+    char *file;
+    int loaded;
+    struct timespec mtime; // Of the file when it was last read or written
+    struct zdb_entry *entries;
+    int count;
+    int cap;
+};
+
+// Prompt format and the cached state its segments are drawn from
+struct prompt_state {
+    char *format; // See builtin_prompt for the % escapes
+    struct strbuf rendered;
+    int last_status;
+    uint64_t last_duration_ns;
+    int has_run;
+    int git_searched;
+    struct timespec cwd_mtime; // Of the directory when .git was looked for
+    char *git_dir;
+    struct stat head_st; // Of git_dir/HEAD when 'branch' was read
+    char branch[256];
+    int dirty; // -1 until the background check answers
+    int dirty_wanted;
+    pid_t dirty_pid;
+    int dirty_fd;
+};
+
+// Keys decoded from escape sequences, numbered above the byte range
+enum { KEY_NONE = 256, KEY_UP, KEY_DOWN, KEY_LEFT, KEY_RIGHT, KEY_HOME, KEY_END, KEY_DELETE };
+
+// State of one line being edited. 'shown' is the text currently on
+// screen (prompt included) and 'shown_cursor' the cursor's cell offset
+// within it, which is what refreshes are diffed against.
+struct line_editor {
+    const char *prompt;
+    struct strbuf line;
+    size_t cursor; // Byte offset into 'line'
+    struct strbuf shown;
+    size_t shown_cursor;
+    int cols;
+    size_t history_pos;
+    struct strbuf saved_line; // The unfinished line while browsing history
+    int searching; // In Ctrl+R mode
+    struct strbuf search;
+    long search_match;
+    int last_key;
+};
+
+// Terminal input the editor has read but not used yet. It outlives one
+// line, so lines pasted together or typed ahead while a command runs
+// aren't lost with the line that came first.
+struct editor_input {
+    unsigned char buf[256];
+    size_t len;
+    size_t pos;
+};
+
+// Saved shell state ('snapshot FILE', restored by --restore FILE). The
+// header is followed by sections of fixed-size records, each aligned to
+// 8 bytes, then the NUL-terminated strings the records refer to by
+// offset, so a restored shell can use the mapped file in place. Only
+// the binary that wrote it reads it back, so the layout is native.
+struct snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t exe_size; // Of the sigshell binary that wrote it
+    int64_t exe_mtime_ns;
+    uint32_t prompt; // String offsets, or SNAPSHOT_NONE
+    uint32_t pwd;
+    uint32_t oldpwd;
+    uint32_t path_env; // $PATH the directories, hashed paths and names are from
+    uint32_t options, n_options; // File offset and count of each section
+    uint32_t stack, n_stack; // String offsets, bottom of the stack first
+    uint32_t path_dirs, n_path_dirs;
+    uint32_t hashed, n_hashed;
+    uint32_t names, n_names; // String offsets, sorted
+    uint32_t nodes, n_nodes; // struct trie_node, as in path_index
+    uint32_t strings; // File offset of the string area
+    uint32_t unused;
+    uint64_t size; // Of the whole file
+};
+
+struct snapshot_option {
+    uint32_t name;
+    int32_t value;
+};
+
+// A $PATH directory and its mtime when the snapshot was taken
+struct snapshot_dir {
+    int64_t mtime_ns;
+    uint32_t name;
+};
+
+// A path_cache entry
+struct snapshot_hashed {
+    uint64_t hits;
+    uint32_t name;
+    uint32_t path;
+};
+
+struct snapshot_writer {
+    struct strbuf records;
+    struct strbuf strings;
+};
+
+// Node of the command-name trie. The names sharing this node's prefix
+// are path_index.names.argv[first .. first+count).
+struct trie_node {
+    uint32_t first;
+    uint32_t count;
+    uint32_t child; // Index of the first child; children are contiguous
+    uint32_t depth;
+    uint16_t n_children;
+    unsigned char ch;
+};
+
+// Sorted executables across $PATH plus builtins, for completion. Built
+// incrementally while the editor is idle and rebuilt when $PATH or an
+// inotify-watched directory changes.
+struct path_index {
+    int started;
+    int ready;
+    char *path_env; // $PATH the index was built from
+    struct arglist dirs;
+    int next_dir;
+    struct arglist names;
+    struct trie_node *nodes;
+    size_t n_nodes;
+    int inotify_fd;
+    void *snapshot_map; // Restored: 'names' and 'nodes' point into it
+    size_t snapshot_len;
+    const struct snapshot_dir *snapshot_dirs; // Their mtimes, in the mapping
+    int next_watch; // Restored directories get their watches when idle
+};
+
+typedef void (*event_handler)(int fd, uint32_t events, void *data);
+
+struct event_source {
+    event_handler fn;
+    void *data;
+    uint32_t events;
+    uint32_t gen; // Tells io_uring completions for an earlier use of the fd apart
+    int rearm; // One-shot io_uring poll to submit again after dispatch
+};
+
+// The mapped submission and completion queues of an io_uring
+struct uring_queue {
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned to_submit;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+// Event loop over epoll, or over io_uring poll requests when asked for
+// with --evloop io_uring and the kernel has them. Sources are looked up
+// by fd. 'fd' (the epoll or io_uring instance) is pollable either way,
+// which is how the line editor waits on the loop along with stdin.
+struct event_loop {
+    int fd;
+    int want_uring;
+    int uring;
+    struct uring_queue ring;
+    struct event_source *sources;
+    int n_sources;
+};
+
+// Command server wire format (SOCK_SEQPACKET, one message per request).
+// A request is this header followed by argc argv strings, envc
+// "NAME=VALUE" strings and, if has_cwd, the working directory, each
+// NUL-terminated. Bit i of fd_mask says fd i (stdin/stdout/stderr) is
+// among the SCM_RIGHTS descriptors, which are sent in that order.
+struct serve_request_header {
+    uint32_t magic;
+    uint32_t id; // Chosen by the client, echoed in replies
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t has_cwd;
+    uint32_t fd_mask;
+};
+
+enum { SERVE_STARTED = 1, SERVE_EXITED, SERVE_FAILED };
+
+// Sent once when the command starts (or fails to), and once it exits
+struct serve_reply {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t id;
+    int32_t pid;
+    int32_t status; // Shell exit status encoding
+    int32_t error; // errno for SERVE_FAILED
+    int64_t wall_us;
+    int64_t user_us;
+    int64_t sys_us;
+    int64_t maxrss_kb;
+};
+
+struct serve_client {
+    int fd; // -1 once the connection has closed
+    int refs; // The connection plus each of its unfinished requests
+};
+
+struct serve_request {
+    struct serve_client *client;
+    uint32_t id;
+    struct arglist argv;
+    struct arglist env;
+    char *cwd;
+    int fds[3];
+    pid_t pid;
+    struct timespec started;
+    struct serve_request *next; // In the queue or the running list
+};
+
+struct server {
+    int max_running;
+    int n_running;
+    struct serve_request *running;
+    struct serve_request *queue_head;
+    struct serve_request *queue_tail;
+    char *buf;
+};
+
+enum { JOB_RUNNING, JOB_STOPPED, JOB_DONE };
+
+// Captured output of a background job. The pipe is drained into a ring
+// holding the newest output; what the ring can't hold is moved to a
+// memfd, and beyond JOBLOG_SPILL_MAX only counted. 'head' and 'tail'
+// only grow, as in struct trace_ring.
+struct job_log {
+    int fd; // Read end of the job's stdout/stderr pipe, -1 after EOF
+    char *ring;
+    uint64_t head;
+    uint64_t tail;
+    int spill_fd; // memfd, created on the first spill
+    size_t spilled;
+    uint64_t dropped; // Bytes between the spilled and the ringed output
+};
+
+// A process of a job, as last reported by wait4
+struct job_proc {
+    pid_t pid; // 0 if it couldn't be started
+    int state; // JOB_RUNNING, JOB_STOPPED or JOB_DONE
+    int status; // The wait status that set 'state'
+    struct rusage ru; // Once JOB_DONE
+};
+
+// A command or pipeline started with '&'
+struct job {
+    int id; // The N of %N
+    pid_t pgid; // Also the PID of its first process
+    struct job_proc *procs; // One per pipeline stage, in job->arena
+    int n_procs;
+    char *command;
+    int state;
+    int status; // Wait status once JOB_DONE
+    int notified; // The current state has been reported
+    uint64_t started_ns;
+    uint64_t duration_ns; // Once JOB_DONE
+    struct rusage ru; // Likewise
+    struct job_log *log; // NULL unless 'set -o joblog' was on
+    struct arena arena; // The command and log, released with the job
+    struct job *next;
+};
+
+// A command of a '#sigshell parallel N' block, started without waiting.
+// Its output is held in memfds until the commands before it are done.
+struct parallel_cmd {
+    struct job_proc procs[MAX_PIPELINE_STAGES];
+    int n_procs;
+    int out_fd;
+    int err_fd;
+};
+
+// Commands of a script's current parallel block, a ring in the order
+// they were read. Finished commands waiting behind a slower one keep
+// their place in it, so the script is read at most 'cap' commands
+// ahead of its output.
+struct parallel_block {
+    int limit; // Running at once; 0 outside a block
+    int cap; // Twice that
+    struct parallel_cmd *cmds; // Ring of 'cap'
+    int head;
+    int count;
+    int running;
+    int null_fd; // Their stdin
+};
+
+// Background jobs. Their state changes are collected when SIGCHLD
+// arrives on the signalfd (through the event loop), not by polling.
+struct job_table {
+    struct job *head; // Oldest first
+    int open_logs; // Logs whose pipe is still open
+    int sigchld_fd; // signalfd, set up when the first job starts
+    int changed; // Some job has a state change not yet reported
+    pid_t *strays; // Process substitutions outliving their command
+    int n_strays;
+    int cap_strays;
+};
+
+struct subst_stats subst_stats;
+struct alloc_stats alloc_stats;
+struct arena_chunk *arena_free_chunks;
+struct arena line_arena; // Released at the start of each command line
+struct pool job_pool = {.size = sizeof(struct job)};
+struct strbuf scratch_bufs[MAX_SCRATCH_BUFS]; // Emptied, kept for reuse
+int n_scratch_bufs;
+struct trace_ring trace = {.fd = -1};
+struct path_cache path_cache;
+struct shell_output shell_out;
+struct prompt_state prompt = {.dirty = -1, .dirty_fd = -1};
+struct dir_state dirs;
+struct zdb zdb;
+int last_status; // Of the last builtin or command run
+int pipe_status[MAX_PIPELINE_STAGES]; // Of each stage of the last one ('pipestatus')
+int n_pipe_status;
+struct latency_histogram latency[LAT_COUNT] = {
+    [LAT_READ_PARSE] = {.name = "read -> parse"},
+    [LAT_PARSE_SPAWN] = {.name = "parse -> spawn"},
+    [LAT_SPAWN_EXEC] = {.name = "spawn -> exec"},
+    [LAT_EXIT_PROMPT] = {.name = "exit -> prompt"},
+    [LAT_PROMPT_RENDER] = {.name = "prompt render"},
+};
+// Start points of the measurements that span functions; 0 when none
+uint64_t parse_done_ns = 0;
+uint64_t child_exit_ns = 0;
+int trace_enabled = 0;
+int in_subshell = 0; // A builtin running in a forked child (spawn_plan_run)
+struct event_loop evloop = {.fd = -1};
+struct server server;
+struct path_index path_index = {.inotify_fd = -1};
+struct history history = {.fd = -1};
+struct job_table job_table = {.sigchld_fd = -1};
+struct parallel_block parallel = {.null_fd = -1};
+struct signal_guard signal_guard = {.sig_fd = -1, .timer_fd = -1};
+struct editor_input editor_in;
+struct signal_policy signal_policies[MAX_SIGNAL_POLICIES] = {
+    {"sleep", SIGPOLICY_IGNORE, 0},
+    {"critical", SIGPOLICY_IGNORE, 0},
+};
+int n_signal_policies = 2;
+int exit_requested = 0;
+volatile sig_atomic_t winch_received = 0;
+volatile sig_atomic_t sigint_received = 0; // Polled by long-running builtins
+
+int opt_globcache = 1;
+int opt_history = 0; // Enabled at startup for interactive shells
+int opt_zdb = 0; // Likewise
+int opt_joblog = 0;
+int opt_notify = 0;
+int opt_vfork = 1;
+int opt_pipefail = 0;
+
+const struct shell_option shell_options[] = {
+    {"globcache", &opt_globcache, "Reuse directory listings while expanding one line"},
+    {"history", &opt_history, "Record command lines in the history file"},
+    {"zdb", &opt_zdb, "Record visited directories for 'z'"},
+    {"joblog", &opt_joblog, "Capture background job output for 'joblog'"},
+    {"notify", &opt_notify, "Report finished jobs at once, not at the next prompt (set -b)"},
+    {"vfork", &opt_vfork, "Start external commands with vfork rather than fork"},
+    {"pipefail", &opt_pipefail, "A pipeline fails if any of its commands fails, not just the last"},
+    {NULL, NULL, NULL}
+};
+
+// Directory listings reused within one command line
+struct dir_listing *glob_cache[GLOB_CACHE_BUCKETS];
+
+int parse_command(const char *cmd, struct arglist *args, int *background, struct command_io *io);
+const struct builtin *find_builtin(const char *name);
+uint32_t hash_string(const char *s);
+void trace_record(uint32_t type, pid_t pid, int64_t arg, int64_t arg2, const char *name);
+extern const struct builtin builtins[];
+int handle_builtin(char **args, FILE *out);
+void output_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void output_notify(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void prompt_cancel_dirty_check(void);
+void prompt_cwd_changed(void);
+void jobs_report(void);
+void evloop_run_once(int timeout_ms);
+void jobs_watch_sigchld(void);
+char *read_command_line(const char *prompt);
+int write_all(int fd, const char *buf, size_t len);
+int fg_wait(struct job_proc *procs, int n, pid_t pgid, int any);
+const struct signal_policy *signal_guard_policy(const char *cmd);
+void signal_guard_start(const struct signal_policy *policy, pid_t pgid, pid_t leader);
+void signal_guard_end(void);
+void signal_guard_wait_fd(int fd);
+void job_proc_update(struct job_proc *proc, int status, const struct rusage *ru);
+int pipeline_status(const struct job_proc *procs, int n);
+int job_procs_state(const struct job_proc *procs, int n);
+struct job *job_new(const char *command, pid_t pgid, const struct job_proc *procs, int n);
+int copy_fd(int in, int out, long long limit);
+
+// Signal handler for SIGINT (Ctrl+C) in parent shell. At the prompt the
+// line editor reads Ctrl+C as a key, so this only fires while the shell
+// itself is busy; the editor draws a fresh prompt afterwards.
+void sigint_handler(int sig) {
+    static const char msg[] = "\n[Shell] Use 'exit' command to quit the shell.\n";
+    (void)sig;
+    sigint_received = 1;
+    if (write(STDOUT_FILENO, msg, sizeof(msg) - 1) < 0) {
+        // Nothing useful to do inside a signal handler
+    }
+}
+
+// Terminal resized: the editor redraws on its next wakeup
+void sigwinch_handler(int sig) {
+    (void)sig;
+    winch_received = 1;
+}
+
+// Make room for at least 'extra' more bytes (plus the terminator)
+void strbuf_reserve(struct strbuf *sb, size_t extra) {
+    if (sb->len + extra + 1 <= sb->cap) {
+        return;
+    }
+    size_t cap = sb->cap ? sb->cap : 64;
+    while (cap < sb->len + extra + 1) {
+        cap *= 2;
+    }
+    char *data = realloc(sb->data, cap);
+    if (data == NULL) {
+        perror("realloc failed");
+        exit(1);
+    }
+    sb->data = data;
+    sb->cap = cap;
+}
+
+void strbuf_append(struct strbuf *sb, const char *s, size_t n) {
+    strbuf_reserve(sb, n);
+    memcpy(sb->data + sb->len, s, n);
+    sb->len += n;
+    sb->data[sb->len] = '\0';
+}
+
+void strbuf_putc(struct strbuf *sb, char c) {
+    strbuf_append(sb, &c, 1);
+}
+
+void strbuf_free(struct strbuf *sb) {
+    free(sb->data);
+    sb->data = NULL;
+    sb->len = sb->cap = 0;
+}
+
+// A buffer for short-lived use, reusing the storage of one handed back
+// with scratch_put (parses nest, so there can be several out at once)
+struct strbuf scratch_get(void) {
+    struct strbuf sb = {0};
+
+    if (n_scratch_bufs > 0) {
+        sb = scratch_bufs[--n_scratch_bufs];
+        sb.len = 0;
+        sb.data[0] = '\0';
+    }
+    return sb;
+}
+
+void scratch_put(struct strbuf *sb) {
+    if (sb->data != NULL && n_scratch_bufs < MAX_SCRATCH_BUFS) {
+        scratch_bufs[n_scratch_bufs++] = *sb;
+    } else {
+        free(sb->data);
+    }
+    sb->data = NULL;
+    sb->len = sb->cap = 0;
+}
+
+// Take a chunk with room for 'n' bytes: the smallest free one that
+// fits, or a new one of at least ARENA_CHUNK_SIZE
+struct arena_chunk *arena_chunk_get(size_t n) {
+    struct arena_chunk **best = NULL;
+
+    for (struct arena_chunk **link = &arena_free_chunks; *link != NULL; link = &(*link)->next) {
+        if ((*link)->size >= n && (best == NULL || (*link)->size < (*best)->size)) {
+            best = link;
+        }
+    }
+    if (best != NULL) {
+        struct arena_chunk *c = *best;
+        *best = c->next;
+        c->used = 0;
+        alloc_stats.chunk_reuses++;
+        return c;
+    }
+
+    size_t size = n > ARENA_CHUNK_SIZE ? n : ARENA_CHUNK_SIZE;
+    struct arena_chunk *c = malloc(sizeof(*c) + size);
+    if (c == NULL) {
+        perror("malloc failed");
+        exit(1);
+    }
+    c->size = size;
+    c->used = 0;
+    alloc_stats.chunk_mallocs++;
+    alloc_stats.chunk_bytes += size;
+    return c;
+}
+
+void *arena_alloc(struct arena *a, size_t n) {
+    n = (n + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+    if (a->head == NULL || a->head->size - a->head->used < n) {
+        struct arena_chunk *c = arena_chunk_get(n);
+        c->next = a->head;
+        a->head = c;
+    }
+    void *p = (char *)a->head->data + a->head->used;
+    a->head->used += n;
+    return p;
+}
+
+char *arena_strndup(struct arena *a, const char *s, size_t n) {
+    char *copy = arena_alloc(a, n + 1);
+
+    memcpy(copy, s, n);
+    copy[n] = '\0';
+    return copy;
+}
+
+// Free everything allocated from 'a' at once
+void arena_release(struct arena *a) {
+    while (a->head != NULL) {
+        struct arena_chunk *c = a->head;
+        a->head = c->next;
+        c->next = arena_free_chunks;
+        arena_free_chunks = c;
+    }
+}
+
+// A zeroed record from the pool
+void *pool_get(struct pool *p) {
+    if (p->free_list == NULL) {
+        size_t size = (p->size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+        char *slab = malloc(size * POOL_SLAB_OBJECTS);
+        if (slab == NULL) {
+            perror("malloc failed");
+            exit(1);
+        }
+        for (int i = POOL_SLAB_OBJECTS - 1; i >= 0; i--) {
+            *(void **)(slab + i * size) = p->free_list;
+            p->free_list = slab + i * size;
+        }
+        p->capacity += POOL_SLAB_OBJECTS;
+        alloc_stats.slab_mallocs++;
+    }
+    void *obj = p->free_list;
+    p->free_list = *(void **)obj;
+    p->in_use++;
+    memset(obj, 0, p->size);
+    return obj;
+}
+
+void pool_put(struct pool *p, void *obj) {
+    *(void **)obj = p->free_list;
+    p->free_list = obj;
+    p->in_use--;
+}
+
+void arglist_push(struct arglist *args, const char *s, size_t n) {
+    if (args->argc + 2 > args->cap) {
+        int cap = args->cap ? args->cap * 2 : 16;
+        char **argv;
+        if (args->arena != NULL) {
+            // The old vector stays in the arena until it is released
+            argv = arena_alloc(args->arena, cap * sizeof(char *));
+            if (args->argc > 0) {
+                memcpy(argv, args->argv, (args->argc + 1) * sizeof(char *));
+            }
+        } else {
+            argv = realloc(args->argv, cap * sizeof(char *));
+            if (argv == NULL) {
+                perror("realloc failed");
+                exit(1);
+            }
+        }
+        args->argv = argv;
+        args->cap = cap;
+    }
+    char *word;
+    if (args->arena != NULL) {
+        word = arena_strndup(args->arena, s, n);
+    } else {
+        word = malloc(n + 1);
+        if (word == NULL) {
+            perror("malloc failed");
+            exit(1);
+        }
+        memcpy(word, s, n);
+        word[n] = '\0';
+    }
+    args->argv[args->argc++] = word;
+    args->argv[args->argc] = NULL;
+}
+
+void arglist_free(struct arglist *args) {
+    if (args->arena == NULL) {
+        for (int i = 0; i < args->argc; i++) {
+            free(args->argv[i]);
+        }
+        free(args->argv);
+    }
+    args->argv = NULL;
+    args->argc = args->cap = 0;
+}
+
+int terminal_columns(void) {
+    struct winsize ws;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+        return ws.ws_col;
+    }
+    return 80;
+}
+
+// Put the terminal back in the modes saved by init_shell
+void terminal_restore(void) {
+    if (isatty(STDIN_FILENO)) {
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+}
+
+// Raw mode derived from the saved modes: no echo, no line buffering,
+// and Ctrl+C/Ctrl+Z arrive as bytes instead of signals
+void terminal_raw(void) {
+    struct termios raw = shell_tmodes;
+
+    raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+    raw.c_iflag &= ~(IXON | ICRNL | INLCR);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+}
+
+// Append printf-style text to a buffer
+void strbuf_vprintf(struct strbuf *sb, const char *fmt, va_list ap) {
+    va_list copy;
+    va_copy(copy, ap);
+    int n = vsnprintf(NULL, 0, fmt, copy);
+    va_end(copy);
+    if (n < 0) {
+        return;
+    }
+    strbuf_reserve(sb, n);
+    vsnprintf(sb->data + sb->len, n + 1, fmt, ap);
+    sb->len += n;
+}
+
+// Move the held-back notification into the pending output, noting how
+// many times it repeated
+void output_commit_note(void) {
+    if (shell_out.note_count == 0) {
+        return;
+    }
+    strbuf_append(&shell_out.pending, shell_out.note.data, shell_out.note.len);
+    if (shell_out.note_count > 1) {
+        char more[32];
+        strbuf_append(&shell_out.pending, more, snprintf(more, sizeof(more), " (%d times)", shell_out.note_count));
+    }
+    strbuf_putc(&shell_out.pending, '\n');
+    shell_out.note.len = 0;
+    shell_out.note_count = 0;
+}
+
+// Queue raw bytes (e.g. terminal escapes) for the shell's next write
+void output_queue(const char *data, size_t len) {
+    output_commit_note();
+    strbuf_append(&shell_out.pending, data, len);
+}
+
+// Queue a status line for the shell's next write to the terminal
+void output_printf(const char *fmt, ...) {
+    va_list ap;
+
+    output_commit_note();
+    va_start(ap, fmt);
+    strbuf_vprintf(&shell_out.pending, fmt, ap);
+    va_end(ap);
+    shell_out.messages++;
+}
+
+// Queue a one-line notification (no trailing newline). Back-to-back
+// repeats of the same notification are shown once with a count.
+void output_notify(const char *fmt, ...) {
+    struct strbuf line = {0};
+    va_list ap;
+
+    va_start(ap, fmt);
+    strbuf_vprintf(&line, fmt, ap);
+    va_end(ap);
+
+    if (shell_out.note_count > 0 && line.len == shell_out.note.len &&
+        memcmp(line.data, shell_out.note.data, line.len) == 0) {
+        shell_out.note_count++;
+    } else {
+        output_commit_note();
+        shell_out.note.len = 0;
+        strbuf_append(&shell_out.note, line.data, line.len);
+        shell_out.note_count = 1;
+    }
+    strbuf_free(&line);
+    shell_out.messages++;
+}
+
+// Write the queued output followed by 'data' with a single writev.
+// Anything builtins left in stdio's buffer goes out first.
+void output_write(const char *data, size_t len) {
+    struct iovec iov[2];
+    int n_iov = 0;
+
+    if (__fpending(stdout) > 0) {
+        fflush(stdout);
+    }
+    output_commit_note();
+    if (shell_out.pending.len > 0) {
+        iov[n_iov].iov_base = shell_out.pending.data;
+        iov[n_iov].iov_len = shell_out.pending.len;
+        n_iov++;
+    }
+    if (len > 0) {
+        iov[n_iov].iov_base = (char *)data;
+        iov[n_iov].iov_len = len;
+        n_iov++;
+    }
+
+    int first = 0;
+    while (first < n_iov) {
+        ssize_t n = writev(STDOUT_FILENO, iov + first, n_iov - first);
+        shell_out.writes++;
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            break;
+        }
+        // Skip whatever a short write got out
+        while (first < n_iov && (size_t)n >= iov[first].iov_len) {
+            n -= iov[first].iov_len;
+            first++;
+        }
+        if (first < n_iov) {
+            iov[first].iov_base = (char *)iov[first].iov_base + n;
+            iov[first].iov_len -= n;
+        }
+    }
+    shell_out.pending.len = 0;
+}
+
+// Write out queued status output, e.g. before a child takes over the
+// terminal
+void output_flush(void) {
+    output_write(NULL, 0);
+}
+
+// The signal policy for command 'cmd', or NULL if Ctrl+C should reach
+// it straight from the terminal
+struct signal_policy *signal_policy_find(const char *cmd) {
+    for (int i = 0; i < n_signal_policies; i++) {
+        if (strcmp(cmd, signal_policies[i].name) == 0) {
+            return &signal_policies[i];
+        }
+    }
+    return NULL;
+}
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Bucket for a nanosecond value: exact below 2^HIST_SUB_BITS, then
+// 2^HIST_SUB_BITS linear sub-buckets per power of two
+int histogram_bucket(uint64_t v) {
+    if (v < HIST_SUB_COUNT) {
+        return v;
+    }
+    int e = 63 - __builtin_clzll(v);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB_COUNT + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+}
+
+// Highest value that falls in bucket 'i'
+uint64_t histogram_bucket_max(int i) {
+    if (i < HIST_SUB_COUNT) {
+        return i;
+    }
+    int e = i / HIST_SUB_COUNT + HIST_SUB_BITS - 1;
+    uint64_t sub = i % HIST_SUB_COUNT;
+    uint64_t width = (uint64_t)1 << (e - HIST_SUB_BITS);
+    return ((HIST_SUB_COUNT + sub) << (e - HIST_SUB_BITS)) + width - 1;
+}
+
+void histogram_record(struct latency_histogram *h, uint64_t ns) {
+    h->counts[histogram_bucket(ns)]++;
+    if (h->total == 0 || ns < h->min) {
+        h->min = ns;
+    }
+    if (ns > h->max) {
+        h->max = ns;
+    }
+    h->total++;
+}
+
+// Record the time since 'since' (0 means no measurement is pending)
+void latency_record(int which, uint64_t since) {
+    if (since != 0) {
+        histogram_record(&latency[which], monotonic_ns() - since);
+    }
+}
+
+uint64_t histogram_percentile(const struct latency_histogram *h, double pct) {
+    uint64_t rank = (uint64_t)(h->total * pct / 100.0 + 0.5);
+    uint64_t seen = 0;
+
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t v = histogram_bucket_max(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+// Write out everything between tail and head
+void trace_flush(void) {
+    uint64_t tail = __atomic_load_n(&trace.tail, __ATOMIC_RELAXED);
+    uint64_t head = __atomic_load_n(&trace.head, __ATOMIC_ACQUIRE);
+
+    while (tail != head) {
+        size_t start = tail & (TRACE_RING_SIZE - 1);
+        size_t count = head - tail;
+        if (start + count > TRACE_RING_SIZE) {
+            count = TRACE_RING_SIZE - start; // Up to the end of the ring
+        }
+        if (write(trace.fd, &trace.ring[start], count * sizeof(struct trace_event)) < 0) {
+            perror("trace: write failed");
+        }
+        tail += count;
+    }
+    __atomic_store_n(&trace.tail, tail, __ATOMIC_RELEASE);
+}
+
+// Append an event to the ring, flushing first if it is full. Callers
+// go through TRACE(), which skips this when tracing is off.
+void trace_record(uint32_t type, pid_t pid, int64_t arg, int64_t arg2, const char *name) {
+    uint64_t head = __atomic_load_n(&trace.head, __ATOMIC_RELAXED);
+
+    if (head - __atomic_load_n(&trace.tail, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE) {
+        trace_flush();
+    }
+    struct trace_event *ev = &trace.ring[head & (TRACE_RING_SIZE - 1)];
+    ev->ts_ns = monotonic_ns();
+    ev->type = type;
+    ev->pid = pid;
+    ev->arg = arg;
+    ev->arg2 = arg2;
+    memset(ev->name, 0, sizeof(ev->name));
+    if (name != NULL) {
+        strncpy(ev->name, name, sizeof(ev->name) - 1);
+    }
+    __atomic_store_n(&trace.head, head + 1, __ATOMIC_RELEASE);
+}
+
+int trace_start(const char *path) {
+    if (trace_enabled) {
+        fprintf(stderr, "trace: already recording\n");
+        return 1;
+    }
+    trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace.fd < 0) {
+        perror("trace: open failed");
+        return 1;
+    }
+    if (trace.ring == NULL) {
+        trace.ring = malloc(TRACE_RING_SIZE * sizeof(struct trace_event));
+        if (trace.ring == NULL) {
+            perror("malloc failed");
+            exit(1);
+        }
+    }
+    struct trace_file_header hdr = {TRACE_MAGIC, TRACE_VERSION, sizeof(struct trace_event), getpid()};
+    if (write(trace.fd, &hdr, sizeof(hdr)) < 0) {
+        perror("trace: write failed");
+    }
+    trace.head = trace.tail = 0;
+    trace_enabled = 1;
+    return 0;
+}
+
+void trace_stop(void) {
+    if (!trace_enabled) {
+        return;
+    }
+    trace_enabled = 0;
+    trace_flush();
+    close(trace.fd);
+    trace.fd = -1;
+}
+
+// Convert a binary trace to Chrome trace event JSON (chrome://tracing,
+// Perfetto). Shell-side events go on the shell's thread; each child's
+// lifetime becomes an async span keyed by its PID.
+int trace_export(const char *in_path, const char *out_path) {
+    static const char *names[] = {
+        [TRACE_PARSE_START] = "parse", [TRACE_PARSE_END] = "parse",
+        [TRACE_SPAWN] = "process", [TRACE_EXEC_OK] = "exec",
+        [TRACE_EXEC_FAIL] = "exec failed", [TRACE_STOP] = "stopped",
+        [TRACE_CONTINUE] = "continued", [TRACE_EXIT] = "process",
+        [TRACE_RUSAGE] = "rusage",
+    };
+    struct trace_file_header hdr;
+    struct trace_event ev;
+
+    FILE *in = fopen(in_path, "rb");
+    if (in == NULL) {
+        perror("trace: open failed");
+        return 1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.magic != TRACE_MAGIC ||
+        hdr.version != TRACE_VERSION || hdr.event_size != sizeof(struct trace_event)) {
+        fprintf(stderr, "trace: %s: not a sigshell trace\n", in_path);
+        fclose(in);
+        return 1;
+    }
+    FILE *out = fopen(out_path, "w");
+    if (out == NULL) {
+        perror("trace: open failed");
+        fclose(in);
+        return 1;
+    }
+
+    fprintf(out, "{\"traceEvents\":[\n");
+    const char *sep = "";
+    while (fread(&ev, sizeof(ev), 1, in) == 1) {
+        if (ev.type == 0 || ev.type > TRACE_RUSAGE) {
+            continue;
+        }
+        double us = ev.ts_ns / 1000.0;
+        const char *name = names[ev.type];
+        fprintf(out, "%s{\"name\":\"%s\",\"pid\":%d,\"ts\":%.3f,", sep, name, hdr.shell_pid, us);
+        sep = ",\n";
+        switch (ev.type) {
+        case TRACE_PARSE_START:
+            fprintf(out, "\"ph\":\"B\",\"tid\":%d}", hdr.shell_pid);
+            break;
+        case TRACE_PARSE_END:
+            fprintf(out, "\"ph\":\"E\",\"tid\":%d,\"args\":{\"argc\":%lld}}", hdr.shell_pid, (long long)ev.arg);
+            break;
+        case TRACE_SPAWN:
+            fprintf(out, "\"ph\":\"b\",\"cat\":\"process\",\"id\":%d,\"tid\":%d,\"args\":{\"command\":\"",
+                    ev.pid, hdr.shell_pid);
+            for (const char *c = ev.name; *c != '\0'; c++) {
+                if (*c == '"' || *c == '\\') {
+                    fputc('\\', out);
+                }
+                if ((unsigned char)*c >= 32) {
+                    fputc(*c, out);
+                }
+            }
+            fprintf(out, "\"}}");
+            break;
+        case TRACE_EXIT:
+            fprintf(out, "\"ph\":\"e\",\"cat\":\"process\",\"id\":%d,\"tid\":%d,\"args\":{\"status\":%lld}}",
+                    ev.pid, hdr.shell_pid, (long long)ev.arg);
+            break;
+        case TRACE_RUSAGE:
+            fprintf(out, "\"ph\":\"i\",\"s\":\"t\",\"tid\":%d,\"args\":{\"user_us\":%lld,\"sys_us\":%lld}}",
+                    ev.pid, (long long)ev.arg, (long long)ev.arg2);
+            break;
+        default:
+            fprintf(out, "\"ph\":\"i\",\"s\":\"t\",\"tid\":%d,\"args\":{\"value\":%lld}}",
+                    ev.pid, (long long)ev.arg);
+            break;
+        }
+    }
+    fprintf(out, "\n]}\n");
+
+    fclose(in);
+    fclose(out);
+    return 0;
+}
+
+// Convert a wait status to the usual shell exit status encoding
+int status_to_exit_code(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    if (WIFSTOPPED(status)) {
+        return 128 + WSTOPSIG(status);
+    }
+    return 1;
+}
+
+// Record what a wait reported about a child
+void trace_wait_status(pid_t pid, int status, const struct rusage *ru) {
+    if (!__builtin_expect(trace_enabled, 0)) {
+        return;
+    }
+    if (WIFSTOPPED(status)) {
+        trace_record(TRACE_STOP, pid, WSTOPSIG(status), 0, NULL);
+    } else if (WIFCONTINUED(status)) {
+        trace_record(TRACE_CONTINUE, pid, 0, 0, NULL);
+    } else {
+        trace_record(TRACE_RUSAGE, pid, ru->ru_utime.tv_sec * 1000000LL + ru->ru_utime.tv_usec,
+                     ru->ru_stime.tv_sec * 1000000LL + ru->ru_stime.tv_usec, NULL);
+        trace_record(TRACE_EXIT, pid, status_to_exit_code(status), 0, NULL);
+    }
+}
+
+// Search a PATH-style list for an executable. Returns a malloc'd path,
+// or NULL if none was found.
+char *path_search(const char *name, const char *path_env) {
+    struct strbuf candidate = {0};
+
+    for (const char *p = path_env; p != NULL;) {
+        const char *end = strchr(p, ':');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+
+        candidate.len = 0;
+        strbuf_append(&candidate, len ? p : ".", len ? len : 1);
+        strbuf_putc(&candidate, '/');
+        strbuf_append(&candidate, name, strlen(name));
+
+        struct stat st;
+        if (stat(candidate.data, &st) == 0 && S_ISREG(st.st_mode) && access(candidate.data, X_OK) == 0) {
+            return candidate.data;
+        }
+        p = end ? end + 1 : NULL;
+    }
+    strbuf_free(&candidate);
+    return NULL;
+}
+
+void path_cache_clear(void) {
+    for (int i = 0; i < PATH_CACHE_BUCKETS; i++) {
+        while (path_cache.buckets[i] != NULL) {
+            struct path_cache_entry *e = path_cache.buckets[i];
+            path_cache.buckets[i] = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+    }
+}
+
+// Remember that 'name' resolves to 'path' (taking ownership of 'path')
+struct path_cache_entry *path_cache_add(const char *name, char *path, unsigned long hits) {
+    uint32_t bucket = hash_string(name) % PATH_CACHE_BUCKETS;
+    struct path_cache_entry *e = calloc(1, sizeof(*e));
+
+    if (e == NULL) {
+        perror("calloc failed");
+        exit(1);
+    }
+    e->name = strdup(name);
+    e->path = path;
+    e->hits = hits;
+    e->next = path_cache.buckets[bucket];
+    path_cache.buckets[bucket] = e;
+    return e;
+}
+
+// Resolve a command name to the file to exec, remembering the answer
+// until $PATH changes or an exec of it fails. Names containing '/' are
+// used as given. Returns NULL if the command isn't found. *cached is set
+// if the answer came from an earlier lookup. 'path' is the $PATH to
+// search, or NULL for the shell's own.
+const char *resolve_command(const char *name, const char *path, int *cached) {
+    if (path == NULL) {
+        path = getenv("PATH");
+    }
+
+    *cached = 0;
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+    if (path == NULL) {
+        path = "/usr/local/bin:/usr/bin:/bin";
+    }
+    if (path_cache.path_env == NULL || strcmp(path, path_cache.path_env) != 0) {
+        path_cache_clear();
+        free(path_cache.path_env);
+        path_cache.path_env = strdup(path);
+    }
+
+    uint32_t bucket = hash_string(name) % PATH_CACHE_BUCKETS;
+    for (struct path_cache_entry *e = path_cache.buckets[bucket]; e != NULL; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            e->hits++;
+            *cached = 1;
+            return e->path;
+        }
+    }
+
+    char *found = path_search(name, path);
+    if (found == NULL) {
+        return NULL;
+    }
+    return path_cache_add(name, found, 1)->path;
+}
+
+// Forget a cached resolution that turned out not to be executable
+void path_cache_forget(const char *name) {
+    if (strchr(name, '/') != NULL) {
+        return;
+    }
+    uint32_t bucket = hash_string(name) % PATH_CACHE_BUCKETS;
+    for (struct path_cache_entry **link = &path_cache.buckets[bucket]; *link != NULL; link = &(*link)->next) {
+        if (strcmp((*link)->name, name) == 0) {
+            struct path_cache_entry *e = *link;
+            *link = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            return;
+        }
+    }
+}
+
+// Exit status for a command that couldn't be executed: 127 if it
+// doesn't exist, 126 if it exists but can't be run
+int exec_failure_status(int err) {
+    return err == ENOENT || err == ENOTDIR ? 127 : 126;
+}
+
+// Report an exec failure in the shell, since the child no longer does
+void report_exec_failure(const char *name, int err) {
+    if (err == ENOENT && strchr(name, '/') == NULL) {
+        fprintf(stderr, "sigshell: %s: command not found\n", name);
+    } else {
+        fprintf(stderr, "sigshell: %s: %s\n", name, strerror(err));
+    }
+}
+
+// Bytes execve counts against ARG_MAX for one argv or envp string
+size_t exec_arg_cost(const char *s) {
+    return strlen(s) + 1 + sizeof(char *);
+}
+
+// Room left for argv by the environment a child would get: the
+// shell's, plus 'env' overrides (counted as additions)
+size_t exec_args_limit(char **env) {
+    long arg_max = sysconf(_SC_ARG_MAX);
+    size_t used = EXEC_ARG_HEADROOM + 2 * sizeof(char *); // The NULL terminators
+
+    for (char **e = environ; *e != NULL; e++) {
+        used += exec_arg_cost(*e);
+    }
+    for (int i = 0; env != NULL && env[i] != NULL; i++) {
+        used += exec_arg_cost(env[i]);
+    }
+    return arg_max > 0 && (size_t)arg_max > used ? arg_max - used : 0;
+}
+
+// Whether execve would accept 'args' within 'limit' bytes
+int exec_args_fit(char **args, size_t limit) {
+    size_t size = 0;
+
+    for (int i = 0; args[i] != NULL; i++) {
+        size_t len = strlen(args[i]);
+        if (len >= EXEC_MAX_ARG_STRLEN) {
+            return 0;
+        }
+        size += len + 1 + sizeof(char *);
+    }
+    return size <= limit;
+}
+
+void spawn_options_init(struct spawn_options *opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->fds[0] = opts->fds[1] = opts->fds[2] = -1;
+    opts->close_fd = -1;
+}
+
+// The environment a child gets: the shell's, with 'overrides' replacing
+// or adding "NAME=VALUE" entries. Returns environ itself when there
+// are none, else a malloc'd vector to free after the fork.
+char **spawn_environment(char **overrides) {
+    int n_env = 0;
+    int n_over = 0;
+
+    if (overrides == NULL || overrides[0] == NULL) {
+        return environ;
+    }
+    while (environ[n_env] != NULL) {
+        n_env++;
+    }
+    while (overrides[n_over] != NULL) {
+        n_over++;
+    }
+    char **envp = malloc((n_env + n_over + 1) * sizeof(char *));
+    if (envp == NULL) {
+        perror("malloc failed");
+        exit(1);
+    }
+    int n = 0;
+    for (int i = 0; i < n_env; i++) {
+        size_t name_len = strcspn(environ[i], "=");
+        int replaced = 0;
+        for (int j = 0; j < n_over && !replaced; j++) {
+            replaced = strncmp(overrides[j], environ[i], name_len + 1) == 0;
+        }
+        if (!replaced) {
+            envp[n++] = environ[i];
+        }
+    }
+    memcpy(envp + n, overrides, n_over * sizeof(char *));
+    envp[n + n_over] = NULL;
+    return envp;
+}
+
+void spawn_plan_signal(struct spawn_plan *plan, int sig, int ignore) {
+    plan->signals[plan->n_signals].sig = sig;
+    plan->signals[plan->n_signals].ignore = ignore;
+    plan->n_signals++;
+}
+
+// Work out what the child for 'args' has to do. 'file' is the program
+// to exec, or NULL for a builtin.
+void spawn_plan_init(struct spawn_plan *plan, char **args, const struct spawn_options *opts,
+                     const char *file, int status_fd) {
+    memset(plan, 0, sizeof(*plan));
+    plan->pgid = opts->pgid;
+
+    // A child whose output is being drained by the shell can't be
+    // suspended. The shell's own handlers and ignored dispositions
+    // must not reach the command (ignored ones would survive exec);
+    // one with a signal policy only sees the signals the shell sends.
+    spawn_plan_signal(plan, SIGTSTP, opts->ignore_tstp);
+    spawn_plan_signal(plan, SIGINT, 0);
+    spawn_plan_signal(plan, SIGQUIT, 0);
+    spawn_plan_signal(plan, SIGTTIN, 0);
+    spawn_plan_signal(plan, SIGTTOU, 0);
+    spawn_plan_signal(plan, SIGPIPE, 0);
+    spawn_plan_signal(plan, SIGWINCH, 0);
+
+    plan->close_fd = opts->close_fd;
+    memcpy(plan->fds, opts->fds, sizeof(plan->fds));
+    plan->pass_fds = opts->pass_fds;
+    plan->n_pass_fds = opts->n_pass_fds;
+    plan->cwd = opts->cwd;
+    plan->file = file;
+    plan->argv = args;
+    plan->envp = spawn_environment(opts->env);
+    plan->builtin = file == NULL ? find_builtin(args[0]) : NULL;
+    plan->status_fd = status_fd;
+}
+
+void spawn_report_failure(int fd, int stage, int error) {
+    struct spawn_failure failure = {stage, error};
+
+    if (write(fd, &failure, sizeof(failure)) < 0) {
+        // The parent will see the pipe close without a report
+    }
+}
+
+// The child's side of spawn_command. Async-signal-safe, and touches no
+// memory the parent owns, up to the exec; only a builtin (always in a
+// fork()ed child) goes on to run shell code.
+void spawn_plan_run(const struct spawn_plan *plan) {
+    struct sigaction sa;
+    sigset_t empty;
+
+    // Own process group, or the one its siblings share
+    setpgid(0, plan->pgid);
+
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    for (int i = 0; i < plan->n_signals; i++) {
+        sa.sa_handler = plan->signals[i].ignore ? SIG_IGN : SIG_DFL;
+        sigaction(plan->signals[i].sig, &sa, NULL);
+    }
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+
+    if (plan->close_fd >= 0) {
+        close(plan->close_fd);
+    }
+    for (int i = 0; i < 3; i++) {
+        if (plan->fds[i] >= 0 && plan->fds[i] != i) {
+            dup2(plan->fds[i], i);
+        }
+    }
+    for (int i = 0; i < plan->n_pass_fds; i++) {
+        fcntl(plan->pass_fds[i], F_SETFD, 0);
+    }
+    if (plan->cwd != NULL && chdir(plan->cwd) != 0) {
+        spawn_report_failure(plan->status_fd, SPAWN_FAIL_CHDIR, errno);
+        _exit(126);
+    }
+
+    // Builtins that can't run in-process (e.g. 'cd' inside $(...))
+    // run here, in the forked subshell. The parent takes the closed
+    // status pipe as a successful start, so it doesn't wait for the
+    // builtin to finish (it may be writing to a pipe the parent is
+    // yet to read).
+    if (plan->builtin != NULL) {
+        close(plan->status_fd);
+        trace_enabled = 0; // The ring's unflushed events belong to the shell
+        in_subshell = 1;
+        environ = plan->envp;
+        int status = plan->builtin->fn(plan->argv, stdout);
+        fflush(stdout);
+        _exit(status);
+    }
+
+    execve(plan->file, plan->argv, plan->envp);
+    if (errno == ENOEXEC) {
+        // No #! line: run it as a shell script, like execvp does
+        int n = 0;
+        while (plan->argv[n] != NULL) {
+            n++;
+        }
+        char *sh_args[n + 2];
+        sh_args[0] = "sh";
+        sh_args[1] = (char *)plan->file;
+        memcpy(sh_args + 2, plan->argv + 1, n * sizeof(char *));
+        execve("/bin/sh", sh_args, plan->envp);
+        errno = ENOEXEC;
+    }
+    int error = errno;
+    spawn_report_failure(plan->status_fd, SPAWN_FAIL_EXEC, error);
+    _exit(exec_failure_status(error));
+}
+
+// Fork a child in its own process group and exec 'args' in it, applying
+// 'opts'. Returns the child's PID, or -1 if the fork failed. If the
+// command could not be executed, *exec_error is set to the errno and
+// the child has already been reaped (the PID is still returned if one
+// was forked). Shared by execute_command and the command server.
+pid_t spawn_command(char **args, const struct spawn_options *opts, int *exec_error) {
+    pid_t pid;
+    int exec_pipe[2];
+    const char *file = NULL;
+    int cached = 0;
+
+    *exec_error = 0;
+    if (opts->no_builtin || find_builtin(args[0]) == NULL) {
+        // The child must search the $PATH it will run with
+        const char *path = NULL;
+        for (int i = 0; opts->env != NULL && opts->env[i] != NULL; i++) {
+            if (strncmp(opts->env[i], "PATH=", 5) == 0) {
+                path = opts->env[i] + 5;
+            }
+        }
+        file = resolve_command(args[0], path, &cached);
+        if (file == NULL) {
+            *exec_error = ENOENT;
+            return -1;
+        }
+        // Known to fail with E2BIG; don't fork just to find out
+        if (!exec_args_fit(args, exec_args_limit(opts->env))) {
+            *exec_error = E2BIG;
+            return -1;
+        }
+    }
+
+    // Closed by a successful exec; otherwise the child reports why not
+    if (pipe2(exec_pipe, O_CLOEXEC) < 0) {
+        perror("pipe failed");
+        return -1;
+    }
+
+    struct spawn_plan plan;
+    spawn_plan_init(&plan, args, opts, file, exec_pipe[1]);
+
+    // A vfork child borrows the shell's memory and stack until it execs,
+    // so no handler of the shell's may run in it: everything stays
+    // blocked until the plan has reset the dispositions. Builtins need
+    // a child of their own.
+    sigset_t all, saved;
+    sigfillset(&all);
+    sigprocmask(SIG_BLOCK, &all, &saved);
+    output_flush();
+    pid = opt_vfork && plan.builtin == NULL ? vfork() : fork();
+    if (pid == 0) {
+        spawn_plan_run(&plan);
+    }
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    if (plan.envp != environ) {
+        free(plan.envp);
+    }
+
+    if (pid < 0) {
+        perror("fork failed");
+        close(exec_pipe[0]);
+        close(exec_pipe[1]);
+        return -1;
+    }
+
+    // Also set the group from the parent, so it exists before anything
+    // (like tcsetpgrp) refers to it, whichever process runs first
+    setpgid(pid, opts->pgid ? opts->pgid : pid);
+    uint64_t spawned_ns = monotonic_ns();
+    latency_record(LAT_PARSE_SPAWN, parse_done_ns);
+    parse_done_ns = 0;
+    TRACE(TRACE_SPAWN, pid, 0, args[0]);
+
+    // Wait for the exec (or its failure) to be reported
+    struct spawn_failure failure;
+    ssize_t n;
+    close(exec_pipe[1]);
+    do {
+        n = read(exec_pipe[0], &failure, sizeof(failure));
+    } while (n < 0 && errno == EINTR);
+    close(exec_pipe[0]);
+    if (n == sizeof(failure)) {
+        TRACE(TRACE_EXEC_FAIL, pid, failure.error, NULL);
+        if (failure.stage == SPAWN_FAIL_EXEC) {
+            path_cache_forget(args[0]);
+        }
+        *exec_error = failure.error;
+        while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
+            // The child exits right after reporting
+        }
+        if (cached && failure.stage == SPAWN_FAIL_EXEC && failure.error == ENOENT) {
+            // The remembered path went away; search $PATH afresh
+            return spawn_command(args, opts, exec_error);
+        }
+    } else {
+        latency_record(LAT_SPAWN_EXEC, spawned_ns);
+        TRACE(TRACE_EXEC_OK, pid, 0, NULL);
+    }
+    return pid;
+}
+
+// Run a command in the foreground with the given spawn options. When
+// 'capture' is non-NULL the child's stdout is read back through a pipe
+// into it (used by command substitution). Returns the exit status in
+// the usual shell encoding.
+int execute_spawn(char **args, struct spawn_options *opts, struct strbuf *capture) {
+    pid_t pid;
+    int pipefd[2] = {-1, -1};
+    const struct signal_policy *policy = opts->sigint_policy;
+
+    if (capture != NULL) {
+        if (pipe(pipefd) < 0) {
+            perror("pipe failed");
+            return 1;
+        }
+        fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+        fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+        opts->fds[STDOUT_FILENO] = pipefd[1];
+        opts->ignore_tstp = 1;
+    }
+
+    int exec_error;
+    pid = spawn_command(args, opts, &exec_error);
+    if (pid < 0 || exec_error != 0) {
+        if (capture != NULL) {
+            close(pipefd[0]);
+            close(pipefd[1]);
+        }
+        if (exec_error != 0) {
+            report_exec_failure(args[0], exec_error);
+            return exec_failure_status(exec_error);
+        }
+        return 1;
+    }
+
+    // Parent process (Shell)
+    int status;
+    int exit_code = 0;
+    pid_t child_pgid = opts->pgid ? opts->pgid : pid; // For tcsetpgrp and waiting
+
+    // 1. Give the child's process group control of the terminal, in
+    // the shell's saved modes rather than the line editor's raw mode.
+    // Under a signal policy the shell keeps it, to act on Ctrl+C.
+    if (isatty(STDIN_FILENO)) {
+        terminal_restore();
+        if (policy == NULL) {
+            tcsetpgrp(STDIN_FILENO, child_pgid);
+        }
+    }
+    if (policy != NULL) {
+        signal_guard_start(policy, child_pgid, pid);
+    }
+
+    // Drain captured output before waiting, so a child writing more
+    // than a pipe's worth of data can't block forever
+    if (capture != NULL) {
+        close(pipefd[1]);
+        for (;;) {
+            if (policy != NULL) {
+                signal_guard_wait_fd(pipefd[0]);
+            }
+            strbuf_reserve(capture, CAPTURE_READ_SIZE);
+            ssize_t n = read(pipefd[0], capture->data + capture->len, CAPTURE_READ_SIZE);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            capture->len += n;
+            capture->data[capture->len] = '\0';
+        }
+        close(pipefd[0]);
+    }
+
+    // 2. Wait for child to complete, allowing it to be stopped
+    struct job_proc proc = {.pid = pid, .state = JOB_RUNNING};
+    int result = fg_wait(&proc, 1, child_pgid, 0);
+    child_exit_ns = monotonic_ns();
+    signal_guard_end();
+
+    if (result == 0) {
+        status = proc.status;
+        exit_code = status_to_exit_code(status);
+        if (WIFSTOPPED(status)) {
+            // Process was stopped by SIGTSTP
+            output_printf("\n[Shell] Process %d suspended.\n", pid);
+            output_printf("[Shell] Use 'kill -CONT %d' to resume it (or a job control command in a real shell).\n", pid);
+        } else if (WIFEXITED(status)) {
+            if (exit_code != 0) {
+                output_printf("[Shell] Process exited with status %d\n", exit_code);
+            }
+        } else if (WIFSIGNALED(status)) {
+            output_printf("[Shell] Process terminated by signal %d\n", WTERMSIG(status));
+        }
+    } else {
+        perror("waitpid failed");
+        exit_code = 1;
+    }
+
+    // 3. Reclaim terminal control, undoing any mode changes the child
+    // left behind
+    if (isatty(STDIN_FILENO)) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        terminal_restore();
+    }
+    return exit_code;
+}
+
+// Execute a command with the shell's usual settings, Ctrl+C acting per
+// 'policy' if not NULL
+int execute_command(char **args, const struct signal_policy *policy, struct strbuf *capture) {
+    struct spawn_options opts;
+
+    spawn_options_init(&opts);
+    opts.sigint_policy = policy;
+    return execute_spawn(args, &opts, capture);
+}
+
+// Number of leading arguments (the command, its options and any fixed
+// operands) to repeat in every batch when a command's file arguments
+// are split. Returns -1 for commands not known to be safe to split,
+// unless 'any' is set.
+int batch_fixed_args(char **args, int any) {
+    static const struct {
+        const char *name;
+        int operands; // Fixed operands after the options, e.g. chmod's mode
+    } batchable[] = {
+        {"rm", 0}, {"touch", 0}, {"mkdir", 0}, {"rmdir", 0}, {"shred", 0},
+        {"chmod", 1}, {"chown", 1}, {"chgrp", 1}, {NULL, 0}
+    };
+    int operands = -1;
+
+    for (int i = 0; batchable[i].name != NULL; i++) {
+        if (strcmp(args[0], batchable[i].name) == 0) {
+            operands = batchable[i].operands;
+        }
+    }
+    if (operands < 0 && !any) {
+        return -1;
+    }
+    int n = 1;
+    while (args[n] != NULL && args[n][0] == '-' && args[n][1] != '\0') {
+        if (strcmp(args[n++], "--") == 0) {
+            break;
+        }
+    }
+    for (int i = 0; i < operands && args[n] != NULL; i++) {
+        n++;
+    }
+    return n;
+}
+
+// Run 'args' as often as needed to pass every argument after the first
+// 'fixed' ones, each run taking as many as fit in ARG_MAX (and at most
+// 'max_items' if non-zero). Up to 'parallel' runs go at once, all in one
+// process group in the foreground. Returns 0 if every run succeeded,
+// 123 if any exited non-zero, as xargs does, or the status of the run
+// that was killed, suspended or couldn't be executed (which stops
+// further runs).
+int batch_run(char **args, int fixed, int parallel, int max_items) {
+    size_t limit = exec_args_limit(NULL);
+    size_t fixed_size = 0;
+    int n_args = 0;
+    int result = 0;
+    int running = 0;
+    int stop = 0;
+    int suspended = 0;
+    int took_terminal = 0;
+    pid_t pgid = 0;
+    struct spawn_options opts;
+
+    while (args[n_args] != NULL) {
+        n_args++;
+    }
+    for (int i = 0; i < fixed; i++) {
+        fixed_size += exec_arg_cost(args[i]);
+    }
+    char **chunk = malloc((n_args + 1) * sizeof(char *));
+    struct job_proc *procs = malloc(parallel * sizeof(struct job_proc)); // pid 0: free
+    if (chunk == NULL || procs == NULL) {
+        perror("malloc failed");
+        exit(1);
+    }
+    memcpy(chunk, args, fixed * sizeof(char *));
+    for (int i = 0; i < parallel; i++) {
+        procs[i].pid = 0;
+        procs[i].state = JOB_DONE;
+    }
+    spawn_options_init(&opts);
+
+    int next = fixed;
+    while (!stop && (next < n_args || running > 0)) {
+        while (!stop && next < n_args && running < parallel) {
+            // Take the longest run of items that still fits
+            size_t size = fixed_size;
+            int n = fixed;
+            while (next < n_args && (max_items == 0 || n - fixed < max_items)) {
+                size_t cost = exec_arg_cost(args[next]);
+                if (n > fixed && size + cost > limit) {
+                    break;
+                }
+                size += cost;
+                chunk[n++] = args[next++];
+            }
+            chunk[n] = NULL;
+
+            int exec_error;
+            opts.pgid = pgid;
+            pid_t pid = spawn_command(chunk, &opts, &exec_error);
+            if (pid < 0 || exec_error != 0) {
+                if (exec_error != 0) {
+                    report_exec_failure(chunk[0], exec_error);
+                }
+                result = exec_error != 0 ? exec_failure_status(exec_error) : 1;
+                stop = 1;
+                break;
+            }
+            if (pgid == 0) {
+                pgid = pid;
+                if (isatty(STDIN_FILENO)) {
+                    terminal_restore();
+                    tcsetpgrp(STDIN_FILENO, pgid);
+                    took_terminal = 1;
+                }
+            }
+            int slot = 0;
+            while (procs[slot].pid != 0) {
+                slot++;
+            }
+            procs[slot].pid = pid;
+            procs[slot].state = JOB_RUNNING;
+            running++;
+        }
+        if (running == 0) {
+            break;
+        }
+
+        if (fg_wait(procs, parallel, pgid, 1) < 0) {
+            perror("waitpid failed");
+            result = 1;
+            break;
+        }
+        child_exit_ns = monotonic_ns();
+        for (int i = 0; i < parallel; i++) {
+            int status = procs[i].status;
+            if (procs[i].pid == 0) {
+                continue;
+            }
+            if (procs[i].state == JOB_STOPPED) {
+                result = status_to_exit_code(status);
+                suspended = 1;
+                continue;
+            }
+            if (procs[i].state != JOB_DONE) {
+                continue;
+            }
+            procs[i].pid = 0;
+            running--;
+            if (WIFSIGNALED(status)) {
+                output_printf("[Shell] Process terminated by signal %d\n", WTERMSIG(status));
+                result = status_to_exit_code(status);
+                stop = 1;
+            } else if (WEXITSTATUS(status) != 0 && result == 0) {
+                result = 123;
+            }
+        }
+        if (suspended) {
+            output_printf("\n[Shell] Process group %d suspended.\n", pgid);
+            break;
+        }
+        if (running == 0) {
+            pgid = 0; // The group is gone; the next run starts a new one
+        }
+    }
+
+    // Let runs already started finish
+    if (running > 0 && !suspended && fg_wait(procs, parallel, pgid, 0) == 0) {
+        for (int i = 0; i < parallel; i++) {
+            if (procs[i].pid != 0 && procs[i].state == JOB_STOPPED) {
+                output_printf("\n[Shell] Process group %d suspended.\n", pgid);
+                break;
+            }
+        }
+    }
+
+    if (took_terminal) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        terminal_restore();
+    }
+    free(procs);
+    free(chunk);
+    return result;
+}
+
+uint32_t hash_string(const char *s) {
+    uint32_t h = 2166136261u; // FNV-1a
+
+    while (*s != '\0') {
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    return h;
+}
+
+void dir_listing_free(struct dir_listing *dl) {
+    free(dl->path);
+    free(dl->names);
+    free(dl->offsets);
+    free(dl->types);
+    free(dl);
+}
+
+// Read a whole directory with getdents64. d_type comes straight from
+// the kernel; only filesystems reporting DT_UNKNOWN cost an fstatat.
+struct dir_listing *dir_listing_read(const char *path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    char *buf = malloc(GETDENTS_BUF_SIZE);
+    struct dir_listing *dl = calloc(1, sizeof(*dl));
+    struct strbuf names = {0};
+    size_t cap = 0;
+    if (buf == NULL || dl == NULL) {
+        perror("malloc failed");
+        exit(1);
+    }
+    dl->path = strdup(path);
+
+    for (;;) {
+        long n = syscall(SYS_getdents64, fd, buf, GETDENTS_BUF_SIZE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        for (long off = 0; off < n;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + off);
+            off += d->d_reclen;
+
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            unsigned char type = d->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                    type = IFTODT(st.st_mode);
+                }
+            }
+
+            if (dl->count == cap) {
+                cap = cap ? cap * 2 : 256;
+                dl->offsets = realloc(dl->offsets, cap * sizeof(uint32_t));
+                dl->types = realloc(dl->types, cap);
+                if (dl->offsets == NULL || dl->types == NULL) {
+                    perror("realloc failed");
+                    exit(1);
+                }
+            }
+            dl->offsets[dl->count] = names.len;
+            dl->types[dl->count] = type;
+            dl->count++;
+            strbuf_append(&names, name, strlen(name) + 1);
+        }
+    }
+
+    close(fd);
+    free(buf);
+    dl->names = names.data;
+    return dl;
+}
+
+// Drop all cached listings. Called once per command line, and whenever
+// the working directory changes.
+void glob_cache_clear(void) {
+    for (int i = 0; i < GLOB_CACHE_BUCKETS; i++) {
+        while (glob_cache[i] != NULL) {
+            struct dir_listing *dl = glob_cache[i];
+            glob_cache[i] = dl->next;
+            dir_listing_free(dl);
+        }
+    }
+}
+
+// Get a listing, from the cache if 'globcache' is on. The caller must
+// release it with dir_listing_release().
+struct dir_listing *dir_listing_get(const char *path) {
+    if (!opt_globcache) {
+        return dir_listing_read(path);
+    }
+
+    uint32_t bucket = hash_string(path) % GLOB_CACHE_BUCKETS;
+    for (struct dir_listing *dl = glob_cache[bucket]; dl != NULL; dl = dl->next) {
+        if (strcmp(dl->path, path) == 0) {
+            return dl;
+        }
+    }
+
+    struct dir_listing *dl = dir_listing_read(path);
+    if (dl != NULL) {
+        dl->next = glob_cache[bucket];
+        glob_cache[bucket] = dl;
+    }
+    return dl;
+}
+
+void dir_listing_release(struct dir_listing *dl) {
+    if (dl != NULL && !opt_globcache) {
+        dir_listing_free(dl);
+    }
+}
+
+// Compile one path component of a pattern. Backslash quotes the next
+// character; an unterminated '[' is taken literally.
+void glob_compile_segment(const char *s, size_t len, struct glob_segment *seg) {
+    struct strbuf lit = {0};
+
+    memset(seg, 0, sizeof(*seg));
+    seg->ops = calloc(len + 1, sizeof(struct glob_op));
+    if (seg->ops == NULL) {
+        perror("calloc failed");
+        exit(1);
+    }
+    seg->is_literal = 1;
+    seg->is_globstar = (len == 2 && s[0] == '*' && s[1] == '*');
+
+    for (size_t i = 0; i < len; i++) {
+        struct glob_op *op = &seg->ops[seg->n_ops];
+        char c = s[i];
+
+        if (c == '\\' && i + 1 < len) {
+            op->type = GLOB_LITERAL;
+            op->ch = s[++i];
+        } else if (c == '*') {
+            // Consecutive stars are equivalent to one
+            if (seg->n_ops > 0 && seg->ops[seg->n_ops - 1].type == GLOB_STAR) {
+                continue;
+            }
+            op->type = GLOB_STAR;
+        } else if (c == '?') {
+            op->type = GLOB_ANY;
+        } else if (c == '[') {
+            size_t j = i + 1;
+            int negate = 0;
+            if (j < len && (s[j] == '!' || s[j] == '^')) {
+                negate = 1;
+                j++;
+            }
+            size_t first = j;
+            while (j < len && (s[j] != ']' || j == first)) {
+                if (s[j] == '\\' && j + 1 < len) {
+                    j++;
+                }
+                j++;
+            }
+            if (j >= len) {
+                op->type = GLOB_LITERAL;
+                op->ch = c;
+            } else {
+                op->type = GLOB_CLASS;
+                for (size_t k = first; k < j; k++) {
+                    unsigned char lo = s[k];
+                    if (lo == '\\' && k + 1 < j) {
+                        lo = s[++k];
+                    }
+                    unsigned char hi = lo;
+                    if (k + 2 < j && s[k + 1] == '-') {
+                        hi = s[k + 2];
+                        k += 2;
+                    }
+                    for (unsigned ch = lo; ch <= hi; ch++) {
+                        op->set[ch >> 3] |= 1 << (ch & 7);
+                    }
+                }
+                if (negate) {
+                    for (int k = 0; k < 32; k++) {
+                        op->set[k] = ~op->set[k];
+                    }
+                }
+                i = j;
+            }
+        } else {
+            op->type = GLOB_LITERAL;
+            op->ch = c;
+        }
+
+        if (op->type == GLOB_LITERAL) {
+            strbuf_putc(&lit, op->ch);
+        } else {
+            seg->is_literal = 0;
+        }
+        seg->n_ops++;
+    }
+
+    seg->literal = lit.data ? lit.data : strdup("");
+}
+
+void glob_compile(const char *pattern, struct glob_pattern *gp) {
+    const char *p = pattern;
+    int cap = 0;
+
+    memset(gp, 0, sizeof(*gp));
+    gp->absolute = (*p == '/');
+    while (*p != '\0') {
+        while (*p == '/') {
+            p++;
+        }
+        if (*p == '\0') {
+            gp->trailing_slash = 1;
+            break;
+        }
+        const char *end = strchr(p, '/');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (gp->n_segs == cap) {
+            cap = cap ? cap * 2 : 8;
+            gp->segs = realloc(gp->segs, cap * sizeof(struct glob_segment));
+            if (gp->segs == NULL) {
+                perror("realloc failed");
+                exit(1);
+            }
+        }
+        glob_compile_segment(p, len, &gp->segs[gp->n_segs++]);
+        p += len;
+    }
+}
+
+void glob_free(struct glob_pattern *gp) {
+    for (int i = 0; i < gp->n_segs; i++) {
+        free(gp->segs[i].ops);
+        free(gp->segs[i].literal);
+    }
+    free(gp->segs);
+}
+
+// Match a name against a compiled segment. Backtracks only to the most
+// recent '*', which keeps matching linear for typical patterns.
+int glob_match(const struct glob_segment *seg, const char *name) {
+    const struct glob_op *ops = seg->ops;
+    int n = seg->n_ops;
+    int oi = 0;
+    int star_op = -1;
+    const char *star_name = NULL;
+
+    // Leading dots must be matched explicitly
+    if (name[0] == '.' && (n == 0 || ops[0].type != GLOB_LITERAL || ops[0].ch != '.')) {
+        return 0;
+    }
+
+    while (*name != '\0') {
+        if (oi < n) {
+            const struct glob_op *op = &ops[oi];
+            unsigned char c = *name;
+            if (op->type == GLOB_STAR) {
+                star_op = oi++;
+                star_name = name;
+                continue;
+            }
+            if ((op->type == GLOB_LITERAL && op->ch == c) || op->type == GLOB_ANY ||
+                (op->type == GLOB_CLASS && (op->set[c >> 3] & (1 << (c & 7))))) {
+                oi++;
+                name++;
+                continue;
+            }
+        }
+        if (star_op < 0) {
+            return 0;
+        }
+        oi = star_op + 1;
+        name = ++star_name;
+    }
+    while (oi < n && ops[oi].type == GLOB_STAR) {
+        oi++;
+    }
+    return oi == n;
+}
+
+int path_is_dir(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+void glob_add_match(const struct glob_pattern *gp, struct strbuf *path,
+                    unsigned char type, struct arglist *out) {
+    if (gp->trailing_slash) {
+        if (type != DT_DIR && !(type == DT_LNK && path_is_dir(path->data))) {
+            return;
+        }
+        strbuf_putc(path, '/');
+        arglist_push(out, path->data, path->len);
+        path->data[--path->len] = '\0';
+        return;
+    }
+    arglist_push(out, path->data, path->len);
+}
+
+void glob_walk(const struct glob_pattern *gp, int si, struct strbuf *path, struct arglist *out);
+
+// Append "/name" (or just "name" at the start of a relative pattern),
+// recurse, then restore 'path'
+void glob_descend(const struct glob_pattern *gp, int si, struct strbuf *path,
+                  const char *name, unsigned char type, int is_last, struct arglist *out) {
+    size_t saved = path->len;
+
+    if (path->len > 0 && path->data[path->len - 1] != '/') {
+        strbuf_putc(path, '/');
+    }
+    strbuf_append(path, name, strlen(name));
+    if (is_last) {
+        glob_add_match(gp, path, type, out);
+    } else {
+        glob_walk(gp, si, path, out);
+    }
+    path->len = saved;
+    path->data[saved] = '\0';
+}
+
+// Expand segment 'si' onwards below 'path'
+void glob_walk(const struct glob_pattern *gp, int si, struct strbuf *path, struct arglist *out) {
+    const struct glob_segment *seg = &gp->segs[si];
+    int is_last = (si == gp->n_segs - 1);
+    const char *dir = path->len > 0 ? path->data : ".";
+
+    if (seg->is_literal) {
+        // No directory scan needed, just check the final component exists
+        if (is_last) {
+            size_t saved = path->len;
+            struct stat st;
+            if (path->len > 0 && path->data[path->len - 1] != '/') {
+                strbuf_putc(path, '/');
+            }
+            strbuf_append(path, seg->literal, strlen(seg->literal));
+            if (lstat(path->data, &st) == 0) {
+                glob_add_match(gp, path, IFTODT(st.st_mode), out);
+            }
+            path->len = saved;
+            path->data[saved] = '\0';
+        } else {
+            glob_descend(gp, si + 1, path, seg->literal, DT_DIR, 0, out);
+        }
+        return;
+    }
+
+    struct dir_listing *dl = dir_listing_get(dir);
+    if (dl == NULL) {
+        return;
+    }
+
+    if (seg->is_globstar) {
+        // '**' matches zero or more directories
+        if (!is_last) {
+            glob_walk(gp, si + 1, path, out);
+        }
+        for (size_t i = 0; i < dl->count; i++) {
+            const char *name = dl->names + dl->offsets[i];
+            if (name[0] == '.') {
+                continue;
+            }
+            if (is_last) {
+                glob_descend(gp, si, path, name, dl->types[i], 1, out);
+            }
+            if (dl->types[i] == DT_DIR) {
+                glob_descend(gp, si, path, name, DT_DIR, 0, out);
+            }
+        }
+    } else {
+        for (size_t i = 0; i < dl->count; i++) {
+            const char *name = dl->names + dl->offsets[i];
+            unsigned char type = dl->types[i];
+            if (!glob_match(seg, name)) {
+                continue;
+            }
+            if (!is_last && type != DT_DIR && type != DT_LNK) {
+                continue;
+            }
+            glob_descend(gp, si + 1, path, name, type, is_last, out);
+        }
+    }
+    dir_listing_release(dl);
+}
+
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Expand a pattern into sorted pathnames appended to 'args'. The
+// pattern is compiled once and shared by every directory visited.
+// Returns the number of matches.
+int glob_expand(const char *pattern, struct arglist *args) {
+    struct glob_pattern gp;
+    struct strbuf path = {0};
+    struct arglist matches = {0};
+
+    glob_compile(pattern, &gp);
+    strbuf_reserve(&path, 256);
+    path.data[0] = '\0';
+    if (gp.absolute) {
+        strbuf_putc(&path, '/');
+    }
+    if (gp.n_segs > 0) {
+        glob_walk(&gp, 0, &path, &matches);
+    }
+
+    if (matches.argc > 1) {
+        qsort(matches.argv, matches.argc, sizeof(char *), compare_strings);
+    }
+    for (int i = 0; i < matches.argc; i++) {
+        arglist_push(args, matches.argv[i], strlen(matches.argv[i]));
+    }
+
+    int n = matches.argc;
+    arglist_free(&matches);
+    strbuf_free(&path);
+    glob_free(&gp);
+    return n;
+}
+
+// Remember a forked substitution body for 'stats'
+void record_forked_subst(const char *body) {
+    for (int i = 0; i < subst_stats.n_forked_cmds; i++) {
+        if (strcmp(subst_stats.forked_cmds[i].body, body) == 0) {
+            subst_stats.forked_cmds[i].count++;
+            return;
+        }
+    }
+    if (subst_stats.n_forked_cmds < MAX_FORKED_SUBST) {
+        int i = subst_stats.n_forked_cmds++;
+        subst_stats.forked_cmds[i].body = strdup(body);
+        subst_stats.forked_cmds[i].count = 1;
+    }
+}
+
+// Run the body of $(...) or `...` and append its output to 'out'.
+// Pure builtins run in-process with stdout captured into a memory
+// stream (one, rewound for each use, since pure builtins don't nest);
+// anything else is forked through execute_command.
+void command_substitution(const char *body, struct strbuf *out) {
+    static FILE *stream = NULL;
+    static char *buf = NULL;
+    static size_t size = 0;
+    struct arglist args = {.arena = &line_arena};
+
+    subst_stats.total++;
+    if (parse_command(body, &args, NULL, NULL) <= 0) {
+        arglist_free(&args);
+        return;
+    }
+
+    const struct builtin *b = find_builtin(args.argv[0]);
+    if (b != NULL && b->pure) {
+        if (stream == NULL) {
+            stream = open_memstream(&buf, &size);
+        } else {
+            rewind(stream);
+        }
+        if (stream != NULL) {
+            b->fn(args.argv, stream);
+            fflush(stream); // Sets 'size' to the position written to
+            strbuf_append(out, buf, size);
+            subst_stats.in_process++;
+            arglist_free(&args);
+            return;
+        }
+    }
+
+    subst_stats.forked++;
+    record_forked_subst(body);
+    execute_command(args.argv, signal_guard_policy(args.argv[0]), out);
+    arglist_free(&args);
+}
+
+// Find the ')' closing a '$(' whose body starts at 'p', skipping quotes
+// and nested substitutions. Returns NULL if unterminated.
+const char *find_subst_end(const char *p) {
+    int depth = 1;
+
+    while (*p != '\0') {
+        if (*p == '\\' && p[1] != '\0') {
+            p += 2;
+            continue;
+        }
+        if (*p == '\'') {
+            const char *q = strchr(p + 1, '\'');
+            if (q == NULL) {
+                return NULL;
+            }
+            p = q + 1;
+            continue;
+        }
+        if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+// Read a substitution starting at '$(' or '`' and run it. Returns the
+// position after it, or NULL on a syntax error.
+const char *expand_substitution(const char *p, struct strbuf *out) {
+    struct strbuf body = scratch_get();
+    const char *end;
+
+    if (*p == '`') {
+        // Inside backquotes a backslash only escapes '$', '`' and '\'
+        for (end = p + 1; *end != '`'; end++) {
+            if (*end == '\0') {
+                scratch_put(&body);
+                return NULL;
+            }
+            if (*end == '\\' && (end[1] == '$' || end[1] == '`' || end[1] == '\\')) {
+                end++;
+            }
+            strbuf_putc(&body, *end);
+        }
+    } else {
+        end = find_subst_end(p + 2);
+        if (end == NULL) {
+            scratch_put(&body);
+            return NULL;
+        }
+        strbuf_append(&body, p + 2, end - (p + 2));
+    }
+
+    size_t start = out->len;
+    command_substitution(body.data ? body.data : "", out);
+    scratch_put(&body);
+
+    // Trailing newlines are removed from the result
+    while (out->len > start && out->data[out->len - 1] == '\n') {
+        out->data[--out->len] = '\0';
+    }
+    return end + 1;
+}
+
+// Expand the $(...) and `...` substitutions in a line of an unquoted
+// here-document. A backslash only escapes '$', '`' and '\', as inside
+// double quotes.
+void heredoc_expand(const char *p, struct strbuf *out) {
+    while (*p != '\0') {
+        if (*p == '\\' && p[1] != '\0' && strchr("$`\\", p[1]) != NULL) {
+            strbuf_putc(out, p[1]);
+            p += 2;
+        } else if (*p == '`' || (*p == '$' && p[1] == '(')) {
+            const char *end = expand_substitution(p, out);
+            if (end == NULL) {
+                // Unterminated: keep the rest as it was typed
+                strbuf_append(out, p, strlen(p));
+                return;
+            }
+            p = end;
+        } else {
+            strbuf_putc(out, *p++);
+        }
+    }
+}
+
+// Read the WORD after '<<' or '<<-' into 'hd'. Quoting any part of it
+// means the body is taken literally. Returns the position after it, or
+// NULL if it is missing or unterminated.
+const char *parse_heredoc_word(const char *p, struct heredoc *hd) {
+    struct strbuf word = scratch_get();
+
+    p += strspn(p, " \t");
+    while (*p != '\0' && strchr(" \t\n;&|<>()", *p) == NULL) {
+        if (*p == '\'' || *p == '"') {
+            const char *q = strchr(p + 1, *p);
+            if (q == NULL) {
+                scratch_put(&word);
+                return NULL;
+            }
+            strbuf_append(&word, p + 1, q - (p + 1));
+            hd->quoted = 1;
+            p = q + 1;
+        } else if (*p == '\\' && p[1] != '\0') {
+            strbuf_putc(&word, p[1]);
+            hd->quoted = 1;
+            p += 2;
+        } else {
+            strbuf_putc(&word, *p++);
+        }
+    }
+    if (word.len == 0 && !hd->quoted) {
+        scratch_put(&word);
+        return NULL;
+    }
+    hd->delim = arena_strndup(&line_arena, word.data ? word.data : "", word.len);
+    scratch_put(&word);
+    return p;
+}
+
+// Start the body of <(...) (or >(...) when 'writes' is set) with one
+// end of a pipe as its stdout (stdin). The command runs alongside the
+// one given the /dev/fd/N name of the shell's end, in its own process
+// group. Returns the shell's end, or -1 on failure.
+int process_substitution(const char *body, int writes, struct command_io *io) {
+    struct arglist args = {.arena = &line_arena};
+    struct spawn_options opts;
+    int pipefd[2];
+
+    if (io->n_subst == MAX_PROC_SUBST) {
+        fprintf(stderr, "sigshell: too many process substitutions\n");
+        return -1;
+    }
+    if (parse_command(body, &args, NULL, NULL) <= 0) {
+        arglist_free(&args);
+        return -1;
+    }
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        perror("pipe failed");
+        arglist_free(&args);
+        return -1;
+    }
+
+    int shell_end = writes ? pipefd[1] : pipefd[0];
+    int child_end = writes ? pipefd[0] : pipefd[1];
+    spawn_options_init(&opts);
+    opts.fds[writes ? STDIN_FILENO : STDOUT_FILENO] = child_end;
+    opts.close_fd = shell_end;
+    opts.ignore_tstp = 1; // It isn't in the foreground group
+
+    int exec_error;
+    pid_t pid = spawn_command(args.argv, &opts, &exec_error);
+    close(child_end);
+    if (exec_error != 0) {
+        // The name still works; it just reads as empty (or EPIPE)
+        report_exec_failure(args.argv[0], exec_error);
+    }
+    arglist_free(&args);
+
+    int i = io->n_subst++;
+    io->subst_fds[i] = shell_end;
+    io->subst_pids[i] = pid > 0 && exec_error == 0 ? pid : 0;
+    io->subst_writes[i] = writes;
+    return shell_end;
+}
+
+void command_io_init(struct command_io *io) {
+    memset(io, 0, sizeof(*io));
+    io->stdin_fd = -1;
+}
+
+// Give the command its here-document and process substitution fds
+void command_io_apply(const struct command_io *io, struct spawn_options *opts) {
+    if (io->stdin_fd >= 0) {
+        opts->fds[STDIN_FILENO] = io->stdin_fd;
+    }
+    opts->pass_fds = io->subst_fds;
+    opts->n_pass_fds = io->n_subst;
+}
+
+// Create an anonymous file: a memfd, or on kernels without memfd an
+// unlinked O_TMPFILE file, which can't be sealed. Returns the fd, or -1.
+int anon_file(const char *name, int *sealable) {
+    int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    *sealable = fd >= 0;
+    if (fd < 0) {
+        const char *tmpdir = getenv("TMPDIR");
+        fd = open(tmpdir != NULL ? tmpdir : "/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    }
+    return fd;
+}
+
+// Store a here-document in a memfd sealed against changes and rewound,
+// so the command reads it as a seekable file with nothing on disk to
+// clean up. Without memfd support, an unlinked O_TMPFILE file is used.
+// Returns the fd, or -1.
+int heredoc_store(const struct strbuf *body) {
+    int sealable;
+    int fd = anon_file("sigshell-heredoc", &sealable);
+
+    if (fd < 0) {
+        perror("sigshell: here-document");
+        return -1;
+    }
+    if (write_all(fd, body->data, body->len) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+        perror("sigshell: here-document");
+        close(fd);
+        return -1;
+    }
+    if (sealable) {
+        fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL);
+    }
+    return fd;
+}
+
+// Read the bodies of the line's here-documents, up to each delimiter
+// line, prompting with "> " like the shell's own prompt. The last one
+// becomes the command's stdin. Returns -1 if it couldn't be stored.
+int command_io_read_heredocs(struct command_io *io) {
+    for (int i = 0; i < io->n_heredocs; i++) {
+        struct heredoc *hd = &io->heredocs[i];
+        struct strbuf body = scratch_get();
+
+        for (;;) {
+            char *line = read_command_line("> ");
+            if (line == NULL) {
+                fprintf(stderr, "sigshell: here-document ended by end of file (wanted '%s')\n", hd->delim);
+                break;
+            }
+            const char *text = hd->strip_tabs ? line + strspn(line, "\t") : line;
+            if (strcmp(text, hd->delim) == 0) {
+                break;
+            }
+            if (hd->quoted) {
+                strbuf_append(&body, text, strlen(text));
+            } else {
+                heredoc_expand(text, &body);
+            }
+            strbuf_putc(&body, '\n');
+        }
+
+        if (i == io->n_heredocs - 1) {
+            io->stdin_fd = heredoc_store(&body);
+        }
+        scratch_put(&body);
+        if (i == io->n_heredocs - 1 && io->stdin_fd < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Release what the command line set up once its command has started
+// (or failed to). Closing the shell's ends lets >(...) commands see
+// EOF; with 'wait' set they are waited for, so their output comes
+// before the next prompt. <(...) commands and those of background jobs
+// may run on (one whose reader gave up gets SIGPIPE); they are reaped
+// with the jobs.
+void command_io_done(struct command_io *io, int wait) {
+    if (io->stdin_fd >= 0) {
+        close(io->stdin_fd);
+    }
+    for (int i = 0; i < io->n_subst; i++) {
+        close(io->subst_fds[i]);
+    }
+    for (int i = 0; i < io->n_subst; i++) {
+        pid_t pid = io->subst_pids[i];
+        if (pid == 0) {
+            continue;
+        }
+        if (wait && io->subst_writes[i]) {
+            while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
+                // Interrupted by a signal; keep waiting
+            }
+            continue;
+        }
+        if (waitpid(pid, NULL, WNOHANG) != 0) {
+            continue;
+        }
+        if (job_table.n_strays == job_table.cap_strays) {
+            job_table.cap_strays = job_table.cap_strays ? job_table.cap_strays * 2 : 16;
+            job_table.strays = realloc(job_table.strays, job_table.cap_strays * sizeof(pid_t));
+            if (job_table.strays == NULL) {
+                perror("realloc failed");
+                exit(1);
+            }
+        }
+        job_table.strays[job_table.n_strays++] = pid;
+        jobs_watch_sigchld();
+    }
+    command_io_init(io);
+}
+
+// Add one character to the word being built. Quoted glob
+// metacharacters are escaped in the pattern so they match literally.
+void word_add(struct word_state *ws, char c, int quoted) {
+    strbuf_putc(&ws->text, c);
+    if (quoted && strchr("*?[]\\", c) != NULL) {
+        strbuf_putc(&ws->pattern, '\\');
+    } else if (!quoted && (c == '*' || c == '?' || c == '[')) {
+        ws->has_glob = 1;
+    }
+    strbuf_putc(&ws->pattern, c);
+    ws->in_word = 1;
+}
+
+// Finish the current word, expanding it as a pathname pattern when it
+// contains unquoted metacharacters. A pattern without matches is kept
+// as the literal word.
+void word_end(struct word_state *ws, struct arglist *args) {
+    if (!ws->in_word) {
+        return;
+    }
+    if (!ws->has_glob || glob_expand(ws->pattern.data, args) == 0) {
+        arglist_push(args, ws->text.data ? ws->text.data : "", ws->text.len);
+    }
+    ws->text.len = 0;
+    ws->pattern.len = 0;
+    ws->in_word = 0;
+    ws->has_glob = 0;
+}
+
+// Parse command line into arguments, honouring quotes, expanding
+// command substitutions and pathname patterns. Unquoted substitution
+// results are split on whitespace. If 'background' is non-NULL, an
+// unquoted '&' ending the line sets it instead of becoming a word.
+// With 'io', '<<WORD' here-documents are noted for
+// command_io_read_heredocs and <(...) and >(...) are started and
+// replaced by /dev/fd/N names. Returns the argument count, or -1 on a
+// syntax error.
+int parse_command(const char *cmd, struct arglist *args, int *background, struct command_io *io) {
+    struct word_state ws = {.text = scratch_get(), .pattern = scratch_get()};
+    const char *p = cmd;
+
+    if (background != NULL) {
+        *background = 0;
+    }
+    while (*p != '\0') {
+        char c = *p;
+
+        if (c == ' ' || c == '\t' || c == '\n') {
+            word_end(&ws, args);
+            p++;
+        } else if (c == '&' && background != NULL && p[strspn(p + 1, " \t\n") + 1] == '\0') {
+            word_end(&ws, args);
+            *background = 1;
+            break;
+        } else if (c == '\\') {
+            if (p[1] != '\0') {
+                word_add(&ws, p[1], 1);
+                p += 2;
+            } else {
+                p++;
+            }
+        } else if (c == '\'') {
+            const char *q = strchr(p + 1, '\'');
+            if (q == NULL) {
+                goto syntax_error;
+            }
+            for (p++; p < q; p++) {
+                word_add(&ws, *p, 1);
+            }
+            ws.in_word = 1;
+            p = q + 1;
+        } else if (c == '"') {
+            // Double quotes keep substitution output as a single word
+            p++;
+            while (*p != '"') {
+                if (*p == '\0') {
+                    goto syntax_error;
+                }
+                if (*p == '\\' && strchr("$`\"\\", p[1]) != NULL && p[1] != '\0') {
+                    word_add(&ws, p[1], 1);
+                    p += 2;
+                } else if (*p == '`' || (*p == '$' && p[1] == '(')) {
+                    struct strbuf result = scratch_get();
+                    p = expand_substitution(p, &result);
+                    for (size_t i = 0; i < result.len; i++) {
+                        word_add(&ws, result.data[i], 1);
+                    }
+                    scratch_put(&result);
+                    if (p == NULL) {
+                        goto syntax_error;
+                    }
+                } else {
+                    word_add(&ws, *p++, 1);
+                }
+            }
+            ws.in_word = 1;
+            p++;
+        } else if (c == '`' || (c == '$' && p[1] == '(')) {
+            struct strbuf result = scratch_get();
+            p = expand_substitution(p, &result);
+            if (p == NULL) {
+                scratch_put(&result);
+                goto syntax_error;
+            }
+            // Field splitting of the unquoted result
+            for (size_t i = 0; i < result.len; i++) {
+                char r = result.data[i];
+                if (r == ' ' || r == '\t' || r == '\n') {
+                    word_end(&ws, args);
+                } else {
+                    word_add(&ws, r, 0);
+                }
+            }
+            scratch_put(&result);
+        } else if (c == '<' && p[1] == '<' && io != NULL) {
+            word_end(&ws, args);
+            if (io->n_heredocs == MAX_HEREDOCS) {
+                fprintf(stderr, "sigshell: too many here-documents\n");
+                goto fail;
+            }
+            struct heredoc *hd = &io->heredocs[io->n_heredocs];
+            memset(hd, 0, sizeof(*hd));
+            p += 2;
+            if (*p == '-') {
+                hd->strip_tabs = 1;
+                p++;
+            }
+            p = parse_heredoc_word(p, hd);
+            if (p == NULL) {
+                fprintf(stderr, "sigshell: syntax error: missing here-document delimiter\n");
+                goto fail;
+            }
+            io->n_heredocs++;
+        } else if ((c == '<' || c == '>') && p[1] == '(' && io != NULL) {
+            const char *end = find_subst_end(p + 2);
+            if (end == NULL) {
+                goto syntax_error;
+            }
+            char *body = arena_strndup(&line_arena, p + 2, end - (p + 2));
+            int fd = process_substitution(body, c == '>', io);
+            if (fd < 0) {
+                goto fail;
+            }
+            char path[32];
+            snprintf(path, sizeof(path), "/dev/fd/%d", fd);
+            for (char *q = path; *q != '\0'; q++) {
+                word_add(&ws, *q, 1);
+            }
+            p = end + 1;
+        } else {
+            word_add(&ws, c, 0);
+            p++;
+        }
+    }
+
+    word_end(&ws, args);
+    scratch_put(&ws.text);
+    scratch_put(&ws.pattern);
+    return args->argc;
+
+syntax_error:
+    fprintf(stderr, "sigshell: syntax error: unterminated quote or substitution\n");
+fail:
+    scratch_put(&ws.text);
+    scratch_put(&ws.pattern);
+    return -1;
+}
+
+// Split a command line at each '|' outside quotes and substitutions
+// into the texts of its stages, copied to line_arena. Returns the
+// number of stages, or -1 (reported) if one is empty or there are more
+// than MAX_PIPELINE_STAGES. Unterminated quotes are left for
+// parse_command to report.
+int split_pipeline(const char *cmd, char **stages) {
+    const char *start = cmd;
+    const char *p = cmd;
+    int n = 0;
+
+    for (;;) {
+        if (*p == '\\' && p[1] != '\0') {
+            p += 2;
+        } else if (*p == '\'' || *p == '`') {
+            const char *q = strchr(p + 1, *p);
+            p = q != NULL ? q + 1 : p + strlen(p);
+        } else if (*p == '"') {
+            for (p++; *p != '"' && *p != '\0'; p++) {
+                if (*p == '\\' && p[1] != '\0') {
+                    p++;
+                } else if (*p == '$' && p[1] == '(') {
+                    const char *end = find_subst_end(p + 2);
+                    p = end != NULL ? end : p + strlen(p) - 1;
+                }
+            }
+            if (*p == '"') {
+                p++;
+            }
+        } else if ((*p == '$' || *p == '<' || *p == '>') && p[1] == '(') {
+            const char *end = find_subst_end(p + 2);
+            p = end != NULL ? end + 1 : p + strlen(p);
+        } else if (*p == '|' || *p == '\0') {
+            size_t len = p - start;
+            if (strspn(start, " \t\n") >= len && (n > 0 || *p == '|')) {
+                fprintf(stderr, "sigshell: syntax error near '|'\n");
+                return -1;
+            }
+            if (n == MAX_PIPELINE_STAGES) {
+                fprintf(stderr, "sigshell: pipeline too long (at most %d commands)\n", MAX_PIPELINE_STAGES);
+                return -1;
+            }
+            stages[n++] = arena_strndup(&line_arena, start, len);
+            if (*p == '\0') {
+                return n;
+            }
+            start = ++p;
+        } else {
+            p++;
+        }
+    }
+}
+
+// Parse a command line into its pipeline stages and read their
+// here-documents, in order. If 'background' is set the line ended in
+// '&'. Returns the number of stages with *stagesp set, 0 for an empty
+// line, or -1 on an error, with whatever was set up released.
+int parse_pipeline(const char *cmd, struct pipeline_stage **stagesp, int *background) {
+    char *texts[MAX_PIPELINE_STAGES];
+    int n = split_pipeline(cmd, texts);
+    int parsed = 0;
+    int argc = -1;
+
+    *background = 0;
+    if (n < 0) {
+        return -1;
+    }
+    struct pipeline_stage *stages = arena_alloc(&line_arena, n * sizeof(*stages));
+    while (parsed < n) {
+        struct pipeline_stage *stage = &stages[parsed++];
+        stage->args = (struct arglist){.arena = &line_arena};
+        command_io_init(&stage->io);
+        argc = parse_command(texts[parsed - 1], &stage->args, parsed == n ? background : NULL, &stage->io);
+        if (argc == 0 && n > 1) {
+            fprintf(stderr, "sigshell: syntax error near '|'\n");
+            argc = -1;
+        }
+        if (argc <= 0) {
+            break;
+        }
+    }
+    for (int i = 0; i < n && argc > 0; i++) {
+        if (command_io_read_heredocs(&stages[i].io) < 0) {
+            argc = -1;
+        }
+    }
+    if (argc <= 0) {
+        for (int i = 0; i < parsed; i++) {
+            command_io_done(&stages[i].io, 0);
+        }
+        return argc;
+    }
+    *stagesp = stages;
+    return n;
+}
+
+// Release the here-documents and process substitutions of every stage
+void pipeline_done(struct pipeline_stage *stages, int n, int wait) {
+    for (int i = 0; i < n; i++) {
+        command_io_done(&stages[i].io, wait);
+    }
+}
+
+// Start the stages of a pipeline in one process group, each reading the
+// previous one's stdout through a pipe, recording them in 'procs'. A
+// stage that can't be started is reported and marked done with the
+// status it would have exited with; the others run anyway and see EOF
+// or EPIPE in its place. 'fds' not -1 replace the first stage's stdin,
+// the last stage's stdout and every stage's stderr. With
+// 'take_terminal' the group gets the terminal as soon as it exists.
+// Returns the process group, or 0 if nothing was started.
+pid_t pipeline_spawn(struct pipeline_stage *stages, int n, int take_terminal, const int fds[3],
+                     struct job_proc *procs) {
+    pid_t pgid = 0;
+    int prev_read = fds[STDIN_FILENO] >= 0 ? fcntl(fds[STDIN_FILENO], F_DUPFD_CLOEXEC, 3) : -1;
+
+    for (int i = 0; i < n; i++) {
+        char **argv = stages[i].args.argv;
+        struct spawn_options opts;
+        int pipefd[2] = {-1, -1};
+        int exec_error;
+
+        memset(&procs[i], 0, sizeof(procs[i]));
+        procs[i].state = JOB_DONE;
+        if (i < n - 1 && pipe2(pipefd, O_CLOEXEC) < 0) {
+            perror("pipe failed");
+            if (prev_read >= 0) {
+                close(prev_read);
+            }
+            for (; i < n; i++) {
+                memset(&procs[i], 0, sizeof(procs[i]));
+                procs[i].state = JOB_DONE;
+                procs[i].status = W_EXITCODE(1, 0);
+            }
+            break;
+        }
+
+        spawn_options_init(&opts);
+        opts.pgid = pgid;
+        opts.fds[STDIN_FILENO] = prev_read;
+        opts.fds[STDOUT_FILENO] = fds[STDOUT_FILENO];
+        opts.fds[STDERR_FILENO] = fds[STDERR_FILENO];
+        if (pipefd[1] >= 0) {
+            opts.fds[STDOUT_FILENO] = pipefd[1];
+            opts.close_fd = pipefd[0]; // A builtin's child doesn't exec
+        }
+        command_io_apply(&stages[i].io, &opts); // A here-document beats the pipe
+
+        pid_t pid = spawn_command(argv, &opts, &exec_error);
+        if (prev_read >= 0) {
+            close(prev_read);
+        }
+        if (pipefd[1] >= 0) {
+            close(pipefd[1]);
+        }
+        prev_read = pipefd[0];
+
+        if (exec_error != 0) {
+            report_exec_failure(argv[0], exec_error);
+            procs[i].status = W_EXITCODE(exec_failure_status(exec_error), 0);
+            continue;
+        }
+        if (pid < 0) {
+            procs[i].status = W_EXITCODE(1, 0);
+            continue;
+        }
+        procs[i].pid = pid;
+        procs[i].state = JOB_RUNNING;
+        if (pgid == 0) {
+            pgid = pid;
+            if (take_terminal && isatty(STDIN_FILENO)) {
+                terminal_restore();
+                tcsetpgrp(STDIN_FILENO, pgid);
+            }
+        }
+    }
+    return pgid;
+}
+
+// Run a pipeline's last stage, a pure builtin, in the shell itself with
+// 'fd' (the previous stage's pipe) as its stdin, unless a here-document
+// beats it. Returns its exit status.
+int pipeline_run_last(struct pipeline_stage *stage, int fd) {
+    int saved_stdin = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3);
+
+    dup2(stage->io.stdin_fd >= 0 ? stage->io.stdin_fd : fd, STDIN_FILENO);
+    handle_builtin(stage->args.argv, stdout);
+    if (saved_stdin >= 0) {
+        dup2(saved_stdin, STDIN_FILENO);
+        close(saved_stdin);
+    } else {
+        close(STDIN_FILENO);
+    }
+    return last_status;
+}
+
+// Run a pipeline in the foreground, waiting for all its stages at once
+// (whichever exits first is reaped first). Their exit statuses go to
+// 'pipestatus'. Returns the pipeline's exit status; if it was
+// suspended, it becomes a stopped job. The first stage with a signal
+// policy sets how Ctrl+C acts on the whole pipeline. Without a terminal
+// a pure builtin at the end (cat, head, tee, cp, ...) runs in the shell
+// rather than a child, like bash's lastpipe; with one it still gets a
+// child, since Ctrl+Z has to be able to stop the whole pipeline and the
+// shell can't stop with it.
+int execute_pipeline(struct pipeline_stage *stages, int n, const char *command) {
+    struct job_proc procs[MAX_PIPELINE_STAGES];
+    int fds[3] = {-1, -1, -1};
+    int last_pipe[2] = {-1, -1};
+    int forked = n; // Stages started in children
+    const struct signal_policy *policy = NULL;
+    int exit_code;
+
+    const struct builtin *b = find_builtin(stages[n - 1].args.argv[0]);
+    if (b != NULL && b->pure && !isatty(STDIN_FILENO) && pipe2(last_pipe, O_CLOEXEC) == 0) {
+        forked = n - 1;
+        fds[STDOUT_FILENO] = last_pipe[1];
+    }
+    for (int i = 0; i < forked && policy == NULL; i++) {
+        policy = signal_guard_policy(stages[i].args.argv[0]);
+    }
+    pid_t pgid = pipeline_spawn(stages, forked, policy == NULL, fds, procs);
+    uint64_t started_ns = monotonic_ns();
+    if (pgid != 0 && policy != NULL) {
+        signal_guard_start(policy, pgid, pgid);
+    }
+
+    output_flush();
+    if (forked < n) {
+        // Closing the read end once the builtin is done gives stages
+        // still writing EPIPE, as a child's exit would
+        close(last_pipe[1]);
+        int status = pipeline_run_last(&stages[n - 1], last_pipe[0]);
+        close(last_pipe[0]);
+        procs[n - 1] = (struct job_proc){.state = JOB_DONE, .status = W_EXITCODE(status & 0xff, 0)};
+    }
+    if (pgid != 0 && fg_wait(procs, n, pgid, 0) < 0) {
+        perror("waitpid failed");
+        for (int i = 0; i < n; i++) {
+            if (procs[i].state == JOB_RUNNING) {
+                procs[i].state = JOB_DONE;
+                procs[i].status = W_EXITCODE(1, 0);
+            }
+        }
+    }
+    child_exit_ns = monotonic_ns();
+    signal_guard_end();
+
+    if (job_procs_state(procs, n) == JOB_STOPPED) {
+        struct job *job = job_new(command, pgid, procs, n);
+        job->state = JOB_STOPPED;
+        job->started_ns = started_ns;
+        job->notified = 1;
+        output_printf("\n[Shell] Pipeline suspended as job [%d] (process group %d).\n", job->id, pgid);
+        output_printf("[Shell] Use 'kill -CONT -- -%d' to resume it in the background.\n", pgid);
+        exit_code = 128 + SIGTSTP;
+    } else {
+        int status = pipeline_status(procs, n);
+        exit_code = status_to_exit_code(status);
+        if (WIFSIGNALED(status)) {
+            output_printf("[Shell] Process terminated by signal %d\n", WTERMSIG(status));
+        } else if (exit_code != 0) {
+            output_printf("[Shell] Process exited with status %d\n", exit_code);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        pipe_status[i] = status_to_exit_code(procs[i].status);
+    }
+    n_pipe_status = n;
+
+    if (isatty(STDIN_FILENO)) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        terminal_restore();
+    }
+    return exit_code;
+}
+
+// Collect the exits of the block's running commands. Each process is
+// waited for by PID, like the jobs' (see job_sigchld).
+void parallel_reap(void) {
+    parallel.running = 0;
+    for (int i = 0; i < parallel.count; i++) {
+        struct parallel_cmd *pc = &parallel.cmds[(parallel.head + i) % parallel.cap];
+        for (int j = 0; j < pc->n_procs; j++) {
+            struct job_proc *proc = &pc->procs[j];
+            int status;
+            struct rusage ru;
+            if (proc->state != JOB_DONE && wait4(proc->pid, &status, WNOHANG, &ru) == proc->pid) {
+                job_proc_update(proc, status, &ru);
+            }
+        }
+        parallel.running += job_procs_state(pc->procs, pc->n_procs) != JOB_DONE;
+    }
+}
+
+// Write out the output of the finished commands at the head of the
+// ring, in the order they were read, each followed by its status line
+void parallel_emit(void) {
+    while (parallel.count > 0) {
+        struct parallel_cmd *pc = &parallel.cmds[parallel.head];
+        if (job_procs_state(pc->procs, pc->n_procs) != JOB_DONE) {
+            break;
+        }
+        output_flush();
+        lseek(pc->out_fd, 0, SEEK_SET);
+        copy_fd(pc->out_fd, STDOUT_FILENO, -1);
+        lseek(pc->err_fd, 0, SEEK_SET);
+        copy_fd(pc->err_fd, STDERR_FILENO, -1);
+        close(pc->out_fd);
+        close(pc->err_fd);
+
+        int status = pipeline_status(pc->procs, pc->n_procs);
+        last_status = status_to_exit_code(status);
+        for (int i = 0; i < pc->n_procs; i++) {
+            pipe_status[i] = status_to_exit_code(pc->procs[i].status);
+        }
+        n_pipe_status = pc->n_procs;
+        if (WIFSIGNALED(status)) {
+            output_printf("[Shell] Process terminated by signal %d\n", WTERMSIG(status));
+        } else if (last_status != 0) {
+            output_printf("[Shell] Process exited with status %d\n", last_status);
+        }
+        output_flush();
+        parallel.head = (parallel.head + 1) % parallel.cap;
+        parallel.count--;
+    }
+}
+
+// Wait, through the event loop, until another command of the block can
+// start, or with 'all' until all are done and written out
+void parallel_wait(int all) {
+    for (;;) {
+        parallel_reap();
+        parallel_emit();
+        if (parallel.count == 0 ||
+            (!all && parallel.running < parallel.limit && parallel.count < parallel.cap)) {
+            return;
+        }
+        evloop_run_once(-1); // Woken by SIGCHLD through job_sigchld
+    }
+}
+
+// Start a command of a '#sigshell parallel' block without waiting for
+// it, once there is room. Its stdin is /dev/null (the script is being
+// read ahead of it) and its stdout and stderr go to memfds that are
+// written out when the commands read before it are done. Exec failures
+// are reported into its stderr buffer too, so they keep their place.
+void parallel_submit(struct pipeline_stage *stages, int n) {
+    parallel_wait(0);
+
+    struct parallel_cmd *pc = &parallel.cmds[(parallel.head + parallel.count) % parallel.cap];
+    int sealable;
+    pc->out_fd = anon_file("sigshell-output", &sealable);
+    pc->err_fd = anon_file("sigshell-output", &sealable);
+    pc->n_procs = n;
+    if (pc->out_fd < 0 || pc->err_fd < 0) {
+        perror("sigshell: output buffer");
+        for (int i = 0; i < n; i++) {
+            pc->procs[i] = (struct job_proc){.state = JOB_DONE, .status = W_EXITCODE(1, 0)};
+        }
+    } else {
+        const int fds[3] = {parallel.null_fd, pc->out_fd, pc->err_fd};
+        int saved_stderr = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+        dup2(pc->err_fd, STDERR_FILENO);
+        pipeline_spawn(stages, n, 0, fds, pc->procs);
+        dup2(saved_stderr, STDERR_FILENO);
+        close(saved_stderr);
+    }
+    parallel.count++;
+}
+
+// Handle a '#sigshell' directive line of a script: 'parallel N' lets up
+// to N commands run at once from here on, 'serial' goes back to one at
+// a time. Either waits for the commands of the current block first.
+void parallel_directive(const char *line) {
+    struct arglist args = {.arena = &line_arena};
+    int limit = -1;
+
+    if (parse_command(line, &args, NULL, NULL) < 0) {
+        return;
+    }
+    if (args.argc == 1 && strcmp(args.argv[0], "serial") == 0) {
+        limit = 0;
+    } else if (args.argc == 2 && strcmp(args.argv[0], "parallel") == 0) {
+        char *end;
+        long n = strtol(args.argv[1], &end, 10);
+        if (*end == '\0' && n >= 1 && n <= MAX_PARALLEL) {
+            limit = n > 1 ? n : 0;
+        }
+    }
+    if (limit < 0) {
+        fprintf(stderr, "sigshell: #sigshell: expected 'parallel N' (1 to %d) or 'serial'\n", MAX_PARALLEL);
+        return;
+    }
+
+    parallel_wait(1);
+    free(parallel.cmds);
+    parallel.cmds = NULL;
+    parallel.head = 0;
+    parallel.limit = limit;
+    parallel.cap = 2 * limit;
+    if (limit > 0) {
+        parallel.cmds = calloc(parallel.cap, sizeof(struct parallel_cmd));
+        if (parallel.cmds == NULL) {
+            perror("calloc failed");
+            exit(1);
+        }
+        if (parallel.null_fd < 0) {
+            parallel.null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        }
+        jobs_watch_sigchld();
+    }
+}
+
+// Open the history file and map its current contents. Entry boundaries
+// are only found on first use, so startup cost doesn't grow with the
+// file.
+void history_open(void) {
+    const char *path = getenv("HISTFILE");
+    char buf[4096];
+
+    if (history.opened) {
+        return;
+    }
+    history.opened = 1;
+
+    if (path == NULL) {
+        const char *home = getenv("HOME");
+        if (home == NULL) {
+            return;
+        }
+        snprintf(buf, sizeof(buf), "%s/.sigshell_history", home);
+        path = buf;
+    }
+
+    history.fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (history.fd < 0) {
+        perror("history: open failed");
+        return;
+    }
+
+    struct stat st;
+    if (fstat(history.fd, &st) == 0 && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, history.fd, 0);
+        if (map != MAP_FAILED) {
+            history.map = map;
+            history.map_len = st.st_size;
+        }
+    }
+}
+
+// Split the mapped file into entries (one record per line)
+void history_load(void) {
+    if (history.loaded) {
+        return;
+    }
+    history_open();
+    history.loaded = 1;
+
+    const char *p = history.map;
+    const char *end = history.map + history.map_len;
+    size_t cap = 0;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *stop = nl ? nl : end;
+        if (stop > p) {
+            if (history.n_file == cap) {
+                cap = cap ? cap * 2 : 1024;
+                history.file_entries = realloc(history.file_entries, cap * sizeof(struct history_entry));
+                if (history.file_entries == NULL) {
+                    perror("realloc failed");
+                    exit(1);
+                }
+            }
+            history.file_entries[history.n_file].text = p;
+            history.file_entries[history.n_file].len = stop - p;
+            history.n_file++;
+        }
+        p = stop + 1;
+    }
+}
+
+size_t history_count(void) {
+    history_load();
+    return history.n_file + history.n_session;
+}
+
+// Entry 'i', oldest first; file entries come before this session's
+const struct history_entry *history_get(size_t i) {
+    history_load();
+    if (i < history.n_file) {
+        return &history.file_entries[i];
+    }
+    return &history.session_entries[i - history.n_file];
+}
+
+// Append a line with a single O_APPEND write, so records from shells
+// sharing the file never interleave
+void history_add(const char *line) {
+    size_t len = strlen(line);
+
+    if (!opt_history || len == 0) {
+        return;
+    }
+    history_open();
+
+    // Skip immediate repeats without forcing the file to be indexed
+    const char *last = NULL;
+    size_t last_len = 0;
+    if (history.n_session > 0) {
+        last = history.session_entries[history.n_session - 1].text;
+        last_len = history.session_entries[history.n_session - 1].len;
+    } else if (history.map_len > 0) {
+        const char *end = history.map + history.map_len;
+        if (end[-1] == '\n') {
+            end--;
+        }
+        const char *start = end;
+        while (start > history.map && start[-1] != '\n') {
+            start--;
+        }
+        last = start;
+        last_len = end - start;
+    }
+    if (last != NULL && last_len == len && memcmp(last, line, len) == 0) {
+        return;
+    }
+
+    if (history.n_session == history.session_cap) {
+        history.session_cap = history.session_cap ? history.session_cap * 2 : 64;
+        history.session_entries = realloc(history.session_entries,
+                                          history.session_cap * sizeof(struct history_entry));
+        if (history.session_entries == NULL) {
+            perror("realloc failed");
+            exit(1);
+        }
+    }
+    char *copy = arena_alloc(&history.session_text, len + 1);
+    memcpy(copy, line, len);
+    copy[len] = '\n';
+    history.session_entries[history.n_session].text = copy;
+    history.session_entries[history.n_session].len = len;
+    history.n_session++;
+
+    if (history.fd >= 0 && write(history.fd, copy, len + 1) < 0) {
+        perror("history: write failed");
+    }
+    copy[len] = '\0';
+}
+
+uint32_t trigram_bucket(const char *s) {
+    uint32_t t = ((unsigned char)s[0] << 16) | ((unsigned char)s[1] << 8) | (unsigned char)s[2];
+    return (t * 2654435761u) >> (32 - HISTORY_TRIGRAM_BITS);
+}
+
+// Build the trigram index for one chunk of entries, as posting lists of
+// chunk-relative entry numbers in ascending order
+void history_build_chunk(struct history_chunk *chunk, size_t first, size_t end) {
+    size_t buckets = (size_t)1 << HISTORY_TRIGRAM_BITS;
+    uint32_t *last = malloc(buckets * sizeof(uint32_t));
+    uint32_t *start = calloc(buckets + 1, sizeof(uint32_t));
+    if (last == NULL || start == NULL) {
+        perror("malloc failed");
+        exit(1);
+    }
+
+    // Pass 1 counts each bucket's postings, pass 2 fills them. 'last'
+    // drops repeats of a trigram within one entry.
+    for (int pass = 0; pass < 2; pass++) {
+        memset(last, 0xff, buckets * sizeof(uint32_t));
+        for (size_t id = first; id < end; id++) {
+            const struct history_entry *e = history_get(id);
+            uint32_t rel = id - first;
+            for (uint32_t i = 0; i + 3 <= e->len; i++) {
+                uint32_t b = trigram_bucket(e->text + i);
+                if (last[b] == rel) {
+                    continue;
+                }
+                last[b] = rel;
+                if (pass == 0) {
+                    start[b + 1]++;
+                } else {
+                    chunk->ids[start[b]++] = rel;
+                }
+            }
+        }
+        if (pass == 0) {
+            for (size_t b = 0; b < buckets; b++) {
+                start[b + 1] += start[b];
+            }
+            chunk->ids = malloc((start[buckets] + 1) * sizeof(uint16_t));
+            if (chunk->ids == NULL) {
+                perror("malloc failed");
+                exit(1);
+            }
+        }
+    }
+    // Pass 2 advanced each start to the next bucket's; shift them back
+    memmove(start + 1, start, buckets * sizeof(uint32_t));
+    start[0] = 0;
+
+    free(last);
+    chunk->start = start;
+}
+
+// Only entries present when the index is first needed are indexed;
+// anything added afterwards is scanned directly
+void history_index_init(void) {
+    if (history.chunks != NULL) {
+        return;
+    }
+    history.n_indexed = history_count();
+    history.n_chunks = (history.n_indexed + HISTORY_CHUNK_SIZE - 1) / HISTORY_CHUNK_SIZE;
+    history.chunks = calloc(history.n_chunks + 1, sizeof(struct history_chunk));
+    if (history.chunks == NULL) {
+        perror("calloc failed");
+        exit(1);
+    }
+}
+
+struct history_chunk *history_chunk_get(size_t k) {
+    struct history_chunk *chunk = &history.chunks[k];
+
+    if (chunk->start == NULL) {
+        size_t first = k * HISTORY_CHUNK_SIZE;
+        size_t end = first + HISTORY_CHUNK_SIZE;
+        history_build_chunk(chunk, first, end < history.n_indexed ? end : history.n_indexed);
+    }
+    return chunk;
+}
+
+// The newest chunk is indexed while the editor waits for input, so the
+// first Ctrl+R over recent history doesn't pay for it
+int history_idle_work_pending(void) {
+    if (!history.opened || history.map_len == 0) {
+        return 0;
+    }
+    return history.chunks == NULL || (history.n_chunks > 0 &&
+                                      history.chunks[history.n_chunks - 1].start == NULL);
+}
+
+void history_idle_work(void) {
+    history_index_init();
+    if (history.n_chunks > 0) {
+        history_chunk_get(history.n_chunks - 1);
+    }
+}
+
+int history_entry_contains(const struct history_entry *e, const char *query, size_t qlen) {
+    return memmem(e->text, e->len, query, qlen) != NULL;
+}
+
+// Find the newest entry before 'before' containing 'query'. Returns its
+// number, or -1. Queries of three or more bytes only verify entries on
+// the shortest posting list among the query's trigrams. The index is
+// built a chunk at a time, newest first, as the search reaches it, so
+// recent matches are found without indexing the whole file.
+long history_search(const char *query, size_t before) {
+    size_t qlen = strlen(query);
+    size_t n = history_count();
+
+    if (before > n) {
+        before = n;
+    }
+    if (qlen < 3) {
+        for (size_t id = before; id-- > 0;) {
+            if (history_entry_contains(history_get(id), query, qlen)) {
+                return id;
+            }
+        }
+        return -1;
+    }
+
+    history_index_init();
+    for (size_t id = before; id-- > history.n_indexed;) {
+        if (history_entry_contains(history_get(id), query, qlen)) {
+            return id;
+        }
+    }
+
+    size_t limit = before < history.n_indexed ? before : history.n_indexed;
+    for (size_t k = (limit + HISTORY_CHUNK_SIZE - 1) / HISTORY_CHUNK_SIZE; k-- > 0;) {
+        struct history_chunk *chunk = history_chunk_get(k);
+        size_t first = k * HISTORY_CHUNK_SIZE;
+
+        uint32_t best = trigram_bucket(query);
+        for (size_t i = 1; i + 3 <= qlen; i++) {
+            uint32_t b = trigram_bucket(query + i);
+            if (chunk->start[b + 1] - chunk->start[b] < chunk->start[best + 1] - chunk->start[best]) {
+                best = b;
+            }
+        }
+
+        // Postings are ascending; walk back from the first one >= 'limit'
+        uint32_t lo = chunk->start[best];
+        uint32_t hi = chunk->start[best + 1];
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (first + chunk->ids[mid] < limit) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        while (lo-- > chunk->start[best]) {
+            size_t id = first + chunk->ids[lo];
+            if (history_entry_contains(history_get(id), query, qlen)) {
+                return id;
+            }
+        }
+    }
+    return -1;
+}
+
+// Append 'path' with a leading $HOME shown as ~
+void append_tilde_path(struct strbuf *out, const char *path) {
+    const char *home = getenv("HOME");
+    size_t home_len = home != NULL ? strlen(home) : 0;
+
+    if (home_len > 1 && strncmp(path, home, home_len) == 0 && (path[home_len] == '/' || path[home_len] == '\0')) {
+        strbuf_putc(out, '~');
+        path += home_len;
+    }
+    strbuf_append(out, path, strlen(path));
+}
+
+// Resolve 'path' against 'base' textually, dropping "." and ".." the
+// way a logical cd does (so ".." leaves a symlink the way it came in).
+// Returns a malloc'd absolute path.
+char *path_canonical(const char *base, const char *path) {
+    struct strbuf out = {0};
+
+    strbuf_reserve(&out, strlen(base) + strlen(path) + 1);
+    if (path[0] != '/') {
+        strbuf_append(&out, base, strlen(base));
+    }
+    while (*path != '\0') {
+        while (*path == '/') {
+            path++;
+        }
+        size_t len = strcspn(path, "/");
+        if (len == 0 || (len == 1 && path[0] == '.')) {
+            // Nothing to add
+        } else if (len == 2 && path[0] == '.' && path[1] == '.') {
+            while (out.len > 0 && out.data[out.len - 1] != '/') {
+                out.len--;
+            }
+            if (out.len > 0) {
+                out.len--;
+            }
+        } else {
+            if (out.len == 0 || out.data[out.len - 1] != '/') {
+                strbuf_putc(&out, '/');
+            }
+            strbuf_append(&out, path, len);
+        }
+        path += len;
+    }
+    if (out.len == 0) {
+        strbuf_putc(&out, '/');
+    }
+    out.data[out.len] = '\0';
+    return out.data;
+}
+
+// Frecency of an entry: visits weighted by how recent the last one was
+double zdb_score(const struct zdb_entry *e, time_t now) {
+    time_t age = now - (time_t)e->last;
+
+    if (age < 3600) {
+        return e->rank * 4;
+    } else if (age < 86400) {
+        return e->rank * 2;
+    } else if (age < 7 * 86400) {
+        return e->rank / 2;
+    }
+    return e->rank / 4;
+}
+
+void zdb_clear(void) {
+    for (int i = 0; i < zdb.count; i++) {
+        free(zdb.entries[i].path);
+    }
+    zdb.count = 0;
+}
+
+void zdb_push(const char *path, size_t len, float rank, uint32_t last) {
+    if (zdb.count == zdb.cap) {
+        int cap = zdb.cap ? zdb.cap * 2 : 64;
+        struct zdb_entry *entries = realloc(zdb.entries, cap * sizeof(*entries));
+        if (entries == NULL) {
+            perror("realloc failed");
+            exit(1);
+        }
+        zdb.entries = entries;
+        zdb.cap = cap;
+    }
+    struct zdb_entry *e = &zdb.entries[zdb.count++];
+    e->path = malloc(2 * (len + 1));
+    if (e->path == NULL) {
+        perror("malloc failed");
+        exit(1);
+    }
+    memcpy(e->path, path, len);
+    e->path[len] = '\0';
+    e->lower = e->path + len + 1;
+    for (size_t i = 0; i <= len; i++) {
+        char c = e->path[i];
+        e->lower[i] = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+    e->len = len;
+    e->base = strrchr(e->path, '/') != NULL ? strrchr(e->path, '/') - e->path + 1 : 0;
+    e->rank = rank;
+    e->last = last;
+}
+
+// (Re)read the database if it is new or another shell has rewritten it
+// since. The file is a header followed by packed records: rank (float),
+// last visit (uint32 seconds), path length (uint16) and the path bytes.
+void zdb_load(void) {
+    if (zdb.file == NULL) {
+        const char *path = getenv("SIGSHELL_Z");
+        const char *home = getenv("HOME");
+        char buf[4096];
+        if (path == NULL) {
+            if (home == NULL) {
+                return;
+            }
+            snprintf(buf, sizeof(buf), "%s/.sigshell_z", home);
+            path = buf;
+        }
+        zdb.file = strdup(path);
+    }
+
+    struct stat st;
+    if (stat(zdb.file, &st) != 0 ||
+        (zdb.loaded && st.st_mtim.tv_sec == zdb.mtime.tv_sec && st.st_mtim.tv_nsec == zdb.mtime.tv_nsec)) {
+        zdb.loaded = 1;
+        return;
+    }
+
+    int fd = open(zdb.file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    char *data = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    zdb_clear();
+    zdb.loaded = 1;
+    zdb.mtime = st.st_mtim;
+    if (data == MAP_FAILED) {
+        return;
+    }
+
+    struct zdb_file_header hdr;
+    size_t pos = sizeof(hdr);
+    if ((size_t)st.st_size >= sizeof(hdr)) {
+        memcpy(&hdr, data, sizeof(hdr));
+    }
+    if ((size_t)st.st_size < sizeof(hdr) || hdr.magic != ZDB_MAGIC) {
+        fprintf(stderr, "z: %s: not a sigshell directory database\n", zdb.file);
+        munmap(data, st.st_size);
+        return;
+    }
+    for (uint32_t i = 0; i < hdr.count && pos + ZDB_RECORD_SIZE <= (size_t)st.st_size; i++) {
+        float rank;
+        uint32_t last;
+        uint16_t len;
+        memcpy(&rank, data + pos, 4);
+        memcpy(&last, data + pos + 4, 4);
+        memcpy(&len, data + pos + 8, 2);
+        pos += ZDB_RECORD_SIZE;
+        if (pos + len > (size_t)st.st_size) {
+            break;
+        }
+        zdb_push(data + pos, len, rank, last);
+        pos += len;
+    }
+    munmap(data, st.st_size);
+}
+
+// Write the database to a temporary file and rename it into place, so
+// other shells never read a partial file
+void zdb_save(void) {
+    struct strbuf out = {0};
+    struct zdb_file_header hdr = {ZDB_MAGIC, zdb.count};
+    char tmp[4096];
+
+    strbuf_append(&out, (char *)&hdr, sizeof(hdr));
+    for (int i = 0; i < zdb.count; i++) {
+        const struct zdb_entry *e = &zdb.entries[i];
+        uint16_t len = e->len;
+        char rec[ZDB_RECORD_SIZE];
+        memcpy(rec, &e->rank, 4);
+        memcpy(rec + 4, &e->last, 4);
+        memcpy(rec + 8, &len, 2);
+        strbuf_append(&out, rec, sizeof(rec));
+        strbuf_append(&out, e->path, len);
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", zdb.file, getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror("z: cannot save database");
+        strbuf_free(&out);
+        return;
+    }
+    ssize_t n = write(fd, out.data, out.len);
+    close(fd);
+    if (n != (ssize_t)out.len || rename(tmp, zdb.file) != 0) {
+        perror("z: cannot save database");
+        unlink(tmp);
+    } else {
+        struct stat st;
+        if (stat(zdb.file, &st) == 0) {
+            zdb.mtime = st.st_mtim;
+        }
+    }
+    strbuf_free(&out);
+}
+
+// Count a visit to 'path'. Once the ranks add up to ZDB_MAX_TOTAL they
+// are all scaled down, and directories that fall below 1 are forgotten.
+void zdb_visit(const char *path) {
+    size_t len = strlen(path);
+    double total = 0;
+    int found = 0;
+
+    if (len > UINT16_MAX || (len == 1 && path[0] == '/')) {
+        return;
+    }
+    zdb_load();
+    if (zdb.file == NULL) {
+        return;
+    }
+    for (int i = 0; i < zdb.count; i++) {
+        struct zdb_entry *e = &zdb.entries[i];
+        if (!found && strcmp(e->path, path) == 0) {
+            e->rank += 1;
+            e->last = time(NULL);
+            found = 1;
+        }
+        total += e->rank;
+    }
+    if (!found) {
+        zdb_push(path, len, 1, time(NULL));
+        total += 1;
+    }
+
+    if (total > ZDB_MAX_TOTAL) {
+        int kept = 0;
+        for (int i = 0; i < zdb.count; i++) {
+            zdb.entries[i].rank *= 0.99f;
+            if (zdb.entries[i].rank >= 1) {
+                zdb.entries[kept++] = zdb.entries[i];
+            } else {
+                free(zdb.entries[i].path);
+            }
+        }
+        zdb.count = kept;
+    }
+    zdb_save();
+}
+
+// Does the entry contain all the 'words' in order? Without capitals in
+// the query the match ignores case. The last word must also match inside
+// the last path component, so "z foo" finds .../foo but not .../foo/bar.
+// That is the most selective test, so it goes first.
+int zdb_match(const struct zdb_entry *e, char **words, int ignore_case) {
+    const char *path = ignore_case ? e->lower : e->path;
+    int n = 0;
+
+    while (words[n] != NULL) {
+        n++;
+    }
+    if (n == 0) {
+        return 1;
+    }
+    if (strstr(path + e->base, words[n - 1]) == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        const char *hit = strstr(path, words[i]);
+        if (hit == NULL) {
+            return 0;
+        }
+        path = hit + strlen(words[i]);
+    }
+    return 1;
+}
+
+// Set the logical working directory after a successful chdir (takes
+// ownership of 'pwd')
+void dirs_set_pwd(char *pwd) {
+    free(dirs.oldpwd);
+    dirs.oldpwd = dirs.pwd;
+    dirs.pwd = pwd;
+    setenv("PWD", dirs.pwd, 1);
+    if (dirs.oldpwd != NULL) {
+        setenv("OLDPWD", dirs.oldpwd, 1);
+    }
+    glob_cache_clear(); // Cached listings are keyed by relative path
+    prompt_cwd_changed();
+    if (opt_zdb) {
+        zdb_visit(dirs.pwd);
+    }
+}
+
+// Change directory. The logical path is tried first; if that fails
+// (e.g. a ".." out of a directory that was since removed) fall back
+// to the kernel's view. With 'physical' symlinks are resolved.
+int dirs_chdir(const char *dir, int physical, const char *who) {
+    char *target = path_canonical(dirs.pwd, dir);
+
+    if (physical || chdir(target) != 0) {
+        free(target);
+        if (chdir(dir) != 0) {
+            fprintf(stderr, "%s: %s: %s\n", who, dir, strerror(errno));
+            return 1;
+        }
+        char buf[4096];
+        target = strdup(getcwd(buf, sizeof(buf)) != NULL ? buf : dir);
+    }
+    dirs_set_pwd(target);
+    return 0;
+}
+
+// Take $PWD from the environment if it really names the current
+// directory, otherwise ask the kernel
+void dirs_init(void) {
+    const char *pwd = getenv("PWD");
+    struct stat a, b;
+    char buf[4096];
+
+    if (pwd != NULL && pwd[0] == '/' && stat(pwd, &a) == 0 && stat(".", &b) == 0 &&
+        a.st_dev == b.st_dev && a.st_ino == b.st_ino) {
+        dirs.pwd = path_canonical("/", pwd);
+    } else {
+        dirs.pwd = strdup(getcwd(buf, sizeof(buf)) != NULL ? buf : "/");
+    }
+    setenv("PWD", dirs.pwd, 1);
+}
+
+// Print the directory stack, current directory first
+void dirs_print(FILE *out, int verbose, int long_form) {
+    struct strbuf line = {0};
+
+    for (int i = 0; i <= dirs.stack.argc; i++) {
+        const char *dir = i == 0 ? dirs.pwd : dirs.stack.argv[dirs.stack.argc - i];
+        line.len = 0;
+        if (long_form) {
+            strbuf_append(&line, dir, strlen(dir));
+        } else {
+            append_tilde_path(&line, dir);
+        }
+        if (verbose) {
+            fprintf(out, "%2d  %s\n", i, line.data);
+        } else {
+            fprintf(out, "%s%s", i > 0 ? " " : "", line.data);
+        }
+    }
+    if (!verbose) {
+        fprintf(out, "\n");
+    }
+    strbuf_free(&line);
+}
+
+// Remove stack entry 'i' (0 is the bottom)
+void dirs_stack_remove(int i) {
+    free(dirs.stack.argv[i]);
+    memmove(dirs.stack.argv + i, dirs.stack.argv + i + 1, (dirs.stack.argc - i) * sizeof(char *));
+    dirs.stack.argc--;
+}
+
+// Parse a "+N" stack index; returns -1 if 'arg' isn't one
+int dirs_index(const char *arg) {
+    char *end;
+
+    if (arg[0] != '+' || arg[1] == '\0') {
+        return -1;
+    }
+    long n = strtol(arg + 1, &end, 10);
+    return *end == '\0' && n >= 0 && n <= INT32_MAX ? (int)n : -1;
+}
+
+// The working directory changed: look for a git tree again
+void prompt_cwd_changed(void) {
+    prompt.git_searched = 0;
+    prompt_cancel_dirty_check();
+    prompt.dirty = -1;
+}
+
+// Find the git directory for the working directory by looking for .git
+// in it and its parents. A .git file (worktrees, submodules) names the
+// real directory with a "gitdir:" line.
+void prompt_find_git(void) {
+    struct strbuf dir = {0};
+    struct stat st;
+
+    free(prompt.git_dir);
+    prompt.git_dir = NULL;
+    prompt.branch[0] = '\0';
+    memset(&prompt.head_st, 0, sizeof(prompt.head_st));
+    prompt.git_searched = 1;
+    if (stat(".", &st) == 0) {
+        prompt.cwd_mtime = st.st_mtim;
+    }
+
+    strbuf_append(&dir, dirs.pwd, strlen(dirs.pwd));
+    for (;;) {
+        size_t base = dir.len;
+        strbuf_append(&dir, "/.git", 5);
+        if (stat(dir.data, &st) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                prompt.git_dir = strdup(dir.data);
+            } else {
+                char line[4096];
+                FILE *f = fopen(dir.data, "r");
+                if (f != NULL && fgets(line, sizeof(line), f) != NULL && strncmp(line, "gitdir: ", 8) == 0) {
+                    line[strcspn(line, "\n")] = '\0';
+                    if (line[8] == '/') {
+                        prompt.git_dir = strdup(line + 8);
+                    } else {
+                        dir.len = base + 1;
+                        strbuf_append(&dir, line + 8, strlen(line + 8));
+                        prompt.git_dir = strdup(dir.data);
+                    }
+                }
+                if (f != NULL) {
+                    fclose(f);
+                }
+            }
+            break;
+        }
+        // Up one level
+        dir.len = base;
+        while (dir.len > 0 && dir.data[dir.len - 1] != '/') {
+            dir.len--;
+        }
+        if (dir.len <= 1) {
+            break;
+        }
+        dir.len--;
+        dir.data[dir.len] = '\0';
+    }
+    strbuf_free(&dir);
+}
+
+// Current branch (or short commit for a detached HEAD), re-read only
+// when HEAD's inode, size or mtime changes
+const char *prompt_git_branch(void) {
+    struct stat st;
+
+    // Creating or removing .git changes the directory's mtime
+    if (!prompt.git_searched || (stat(".", &st) == 0 &&
+        (st.st_mtim.tv_sec != prompt.cwd_mtime.tv_sec || st.st_mtim.tv_nsec != prompt.cwd_mtime.tv_nsec))) {
+        prompt_find_git();
+    }
+    if (prompt.git_dir == NULL) {
+        return NULL;
+    }
+
+    char head[4096];
+    snprintf(head, sizeof(head), "%s/HEAD", prompt.git_dir);
+    if (stat(head, &st) != 0) {
+        prompt.branch[0] = '\0';
+        return NULL;
+    }
+    if (st.st_ino == prompt.head_st.st_ino && st.st_size == prompt.head_st.st_size &&
+        st.st_mtim.tv_sec == prompt.head_st.st_mtim.tv_sec &&
+        st.st_mtim.tv_nsec == prompt.head_st.st_mtim.tv_nsec) {
+        return prompt.branch[0] ? prompt.branch : NULL;
+    }
+    prompt.head_st = st;
+    prompt.branch[0] = '\0';
+
+    int fd = open(head, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    ssize_t n = read(fd, head, sizeof(head) - 1);
+    close(fd);
+    if (n <= 0) {
+        return NULL;
+    }
+    head[n] = '\0';
+    head[strcspn(head, "\n")] = '\0';
+    // Ref names longer than the buffer are cut short
+    int max = sizeof(prompt.branch) - 1;
+    if (strncmp(head, "ref: refs/heads/", 16) == 0) {
+        snprintf(prompt.branch, sizeof(prompt.branch), "%.*s", max, head + 16);
+    } else if (strncmp(head, "ref: ", 5) == 0) {
+        snprintf(prompt.branch, sizeof(prompt.branch), "%.*s", max, head + 5);
+    } else {
+        snprintf(prompt.branch, sizeof(prompt.branch), "%.7s", head);
+    }
+    return prompt.branch[0] ? prompt.branch : NULL;
+}
+
+// Start 'git status' in the background to find out whether the work
+// tree is dirty. Its output is read by prompt_async_poll.
+void prompt_start_dirty_check(void) {
+    int pipefd[2];
+
+    if (prompt.dirty_fd >= 0 || pipe2(pipefd, O_CLOEXEC) < 0) {
+        return;
+    }
+    char *args[] = {"git", "status", "--porcelain", "--untracked-files=no", NULL};
+    char *env[] = {"GIT_OPTIONAL_LOCKS=0", NULL}; // Don't contend for index.lock
+    struct spawn_options opts;
+    int exec_error;
+    spawn_options_init(&opts);
+    opts.fds[1] = pipefd[1];
+    opts.fds[2] = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    opts.env = env;
+    pid_t pid = spawn_command(args, &opts, &exec_error);
+    close(pipefd[1]);
+    if (opts.fds[2] >= 0) {
+        close(opts.fds[2]);
+    }
+    if (pid < 0 || exec_error != 0) {
+        close(pipefd[0]);
+        prompt.dirty = 0; // No git; don't try again until the next command
+        return;
+    }
+    fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+    prompt.dirty_pid = pid;
+    prompt.dirty_fd = pipefd[0];
+}
+
+// Descriptor the editor should watch for a background prompt segment,
+// or -1. The check is started here, once the prompt is on screen, so
+// that it doesn't delay drawing it.
+int prompt_async_fd(void) {
+    if (prompt.dirty_wanted) {
+        prompt.dirty_wanted = 0;
+        prompt_start_dirty_check();
+    }
+    return prompt.dirty_fd;
+}
+
+// Abandon a background check whose answer would be out of date
+void prompt_cancel_dirty_check(void) {
+    prompt.dirty_wanted = 0;
+    if (prompt.dirty_fd < 0) {
+        return;
+    }
+    close(prompt.dirty_fd);
+    prompt.dirty_fd = -1;
+    kill(prompt.dirty_pid, SIGTERM);
+    while (waitpid(prompt.dirty_pid, NULL, 0) < 0 && errno == EINTR) {
+        // Retry
+    }
+}
+
+// Collect the background check's result. Returns 1 if the prompt needs
+// to be rendered again.
+int prompt_async_poll(void) {
+    char buf[512];
+    ssize_t n;
+
+    if (prompt.dirty_fd < 0) {
+        return 0;
+    }
+    do {
+        n = read(prompt.dirty_fd, buf, sizeof(buf));
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && errno == EAGAIN) {
+        return 0;
+    }
+
+    // Any output at all means there are changes; no need to hear the rest
+    int dirty = n > 0;
+    close(prompt.dirty_fd);
+    prompt.dirty_fd = -1;
+    if (dirty) {
+        kill(prompt.dirty_pid, SIGTERM);
+    }
+    while (waitpid(prompt.dirty_pid, NULL, 0) < 0 && errno == EINTR) {
+        // git exits once the pipe is gone
+    }
+    int changed = dirty != prompt.dirty;
+    prompt.dirty = dirty;
+    return changed;
+}
+
+// Something may have changed the work tree: check it again at the next
+// prompt
+void prompt_command_done(int status, uint64_t duration_ns) {
+    prompt.last_status = status;
+    prompt.last_duration_ns = duration_ns;
+    prompt.has_run = 1;
+    prompt_cancel_dirty_check();
+    prompt.dirty = -1;
+}
+
+void format_duration(struct strbuf *out, uint64_t ns) {
+    char buf[32];
+    uint64_t ms = ns / 1000000;
+
+    if (ms < 1000) {
+        snprintf(buf, sizeof(buf), "%llums", (unsigned long long)ms);
+    } else if (ms < 60000) {
+        snprintf(buf, sizeof(buf), "%.1fs", ms / 1000.0);
+    } else {
+        snprintf(buf, sizeof(buf), "%llum%02llus", (unsigned long long)(ms / 60000),
+                 (unsigned long long)(ms / 1000 % 60));
+    }
+    strbuf_append(out, buf, strlen(buf));
+}
+
+// Expand the prompt format. Slow segments are started in the background
+// when 'async' is set and filled in by a later render.
+const char *prompt_render(int async) {
+    uint64_t start = monotonic_ns();
+    struct strbuf *out = &prompt.rendered;
+    char num[32];
+
+    out->len = 0;
+    strbuf_reserve(out, 64);
+    for (const char *p = prompt.format; *p != '\0'; p++) {
+        if (*p != '%' || p[1] == '\0') {
+            strbuf_putc(out, *p);
+            continue;
+        }
+        p++;
+        switch (*p) {
+        case '~':
+            append_tilde_path(out, dirs.pwd);
+            break;
+        case '/':
+            strbuf_append(out, dirs.pwd, strlen(dirs.pwd));
+            break;
+        case '.': {
+            const char *base = strrchr(dirs.pwd, '/');
+            base = base != NULL && base[1] != '\0' ? base + 1 : dirs.pwd;
+            strbuf_append(out, base, strlen(base));
+            break;
+        }
+        case '?':
+            strbuf_append(out, num, snprintf(num, sizeof(num), "%d", prompt.last_status));
+            break;
+        case 'D':
+            if (prompt.has_run) {
+                format_duration(out, prompt.last_duration_ns);
+            }
+            break;
+        case 'j': {
+            int jobs = 0;
+            for (struct job *job = job_table.head; job != NULL; job = job->next) {
+                jobs++;
+            }
+            strbuf_append(out, num, snprintf(num, sizeof(num), "%d", jobs));
+            break;
+        }
+        case 'g': {
+            const char *branch = prompt_git_branch();
+            if (branch == NULL) {
+                break;
+            }
+            if (prompt.dirty < 0 && async) {
+                prompt.dirty_wanted = 1;
+            }
+            strbuf_putc(out, '(');
+            strbuf_append(out, branch, strlen(branch));
+            if (prompt.dirty > 0) {
+                strbuf_putc(out, '*');
+            }
+            strbuf_putc(out, ')');
+            break;
+        }
+        case '%':
+            strbuf_putc(out, '%');
+            break;
+        default:
+            strbuf_putc(out, '%');
+            strbuf_putc(out, *p);
+            break;
+        }
+    }
+    latency_record(LAT_PROMPT_RENDER, start);
+    return out->data;
+}
+
+// Terminal columns occupied by 'n' bytes of UTF-8 text (one per
+// character; wide characters are not accounted for)
+size_t utf8_cells(const char *s, size_t n) {
+    size_t cells = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        if (((unsigned char)s[i] & 0xC0) != 0x80) {
+            cells++;
+        }
+    }
+    return cells;
+}
+
+// Emit the relative cursor motion between two cell offsets of the
+// edited area, which wraps every 'cols' cells
+void term_move(struct strbuf *out, size_t from, size_t to, int cols) {
+    size_t from_row = from / cols, from_col = from % cols;
+    size_t to_row = to / cols, to_col = to % cols;
+    char seq[32];
+
+    if (to_row < from_row) {
+        strbuf_append(out, seq, snprintf(seq, sizeof(seq), "\x1b[%zuA", from_row - to_row));
+    } else if (to_row > from_row) {
+        strbuf_append(out, seq, snprintf(seq, sizeof(seq), "\x1b[%zuB", to_row - from_row));
+    }
+    if (to_col < from_col) {
+        strbuf_append(out, seq, snprintf(seq, sizeof(seq), "\x1b[%zuD", from_col - to_col));
+    } else if (to_col > from_col) {
+        strbuf_append(out, seq, snprintf(seq, sizeof(seq), "\x1b[%zuC", to_col - from_col));
+    }
+}
+
+// Bring the screen from what was last drawn to the current state. Only
+// the text after the first difference is rewritten, and everything
+// goes out in a single write.
+void editor_refresh(struct line_editor *ed) {
+    struct strbuf want = scratch_get();
+    struct strbuf out = scratch_get();
+    size_t want_cursor;
+
+    if (ed->searching) {
+        const char *match = "";
+        uint32_t match_len = 0;
+        if (ed->search_match >= 0) {
+            const struct history_entry *e = history_get(ed->search_match);
+            match = e->text;
+            match_len = e->len;
+        }
+        strbuf_append(&want, "(reverse-i-search)`", 19);
+        strbuf_append(&want, ed->search.data ? ed->search.data : "", ed->search.len);
+        strbuf_append(&want, "': ", 3);
+        strbuf_append(&want, match, match_len);
+        want_cursor = utf8_cells(want.data, want.len);
+    } else {
+        strbuf_append(&want, ed->prompt, strlen(ed->prompt));
+        want_cursor = utf8_cells(want.data, want.len) + utf8_cells(ed->line.data, ed->cursor);
+        strbuf_append(&want, ed->line.data ? ed->line.data : "", ed->line.len);
+    }
+
+    size_t common = 0;
+    size_t max = want.len < ed->shown.len ? want.len : ed->shown.len;
+    while (common < max && want.data[common] == ed->shown.data[common]) {
+        common++;
+    }
+    while (common > 0 && common < want.len && (want.data[common] & 0xC0) == 0x80) {
+        common--;
+    }
+
+    size_t pos = ed->shown_cursor;
+    if (common < want.len || common < ed->shown.len) {
+        size_t shown_cells = utf8_cells(ed->shown.data, ed->shown.len);
+        term_move(&out, pos, utf8_cells(want.data, common), ed->cols);
+        strbuf_append(&out, want.data + common, want.len - common);
+        pos = utf8_cells(want.data, want.len);
+        // A full last row leaves the cursor pending at the right margin;
+        // move it to the next row so relative motion stays accurate
+        if (want.len > common && pos > 0 && pos % ed->cols == 0) {
+            strbuf_append(&out, "\n", 1);
+        }
+        if (shown_cells > pos) {
+            strbuf_append(&out, "\x1b[J", 3);
+        }
+    }
+    term_move(&out, pos, want_cursor, ed->cols);
+
+    if (out.len > 0 || shell_out.pending.len > 0) {
+        output_write(out.data, out.len);
+    }
+
+    scratch_put(&ed->shown);
+    ed->shown = want;
+    ed->shown_cursor = want_cursor;
+    scratch_put(&out);
+}
+
+// Forget what is on screen after the terminal was resized or cleared.
+// 'rows_up' moves back to the start of the edited area first.
+void editor_reset_screen(struct line_editor *ed, int rows_up) {
+    char seq[32];
+    struct strbuf out = scratch_get();
+
+    strbuf_append(&out, "\r", 1);
+    if (rows_up > 0) {
+        strbuf_append(&out, seq, snprintf(seq, sizeof(seq), "\x1b[%dA", rows_up));
+    }
+    strbuf_append(&out, "\x1b[J", 3);
+    output_queue(out.data, out.len);
+    scratch_put(&out);
+    ed->shown.len = 0;
+    ed->shown_cursor = 0;
+}
+
+// Next input byte, or -1 on EOF/error. With a timeout, -2 means no
+// byte arrived in time. Input is read in blocks so pastes are handled
+// without a refresh per character.
+int editor_getc(int timeout_ms) {
+    while (editor_in.pos == editor_in.len) {
+        // Also wake up when a background prompt segment is ready, and
+        // keep the event loop (job output) serviced while waiting
+        int async_fd = prompt_async_fd();
+        if (timeout_ms >= 0 || async_fd >= 0 || evloop.fd >= 0) {
+            struct pollfd pfd[3] = {{async_fd, POLLIN, 0}, {evloop.fd, POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+            int ready = poll(pfd, 3, timeout_ms);
+            if (ready > 0 && pfd[1].revents != 0) {
+                evloop_run_once(0);
+            }
+            if (ready == 0 || (ready > 0 && (pfd[0].revents != 0 || pfd[2].revents == 0))) {
+                return -2;
+            }
+            if (ready < 0 && errno != EINTR) {
+                return -1;
+            }
+            if (ready < 0) {
+                return -2;
+            }
+        }
+        ssize_t n = read(STDIN_FILENO, editor_in.buf, sizeof(editor_in.buf));
+        if (n < 0 && errno == EINTR) {
+            return -2;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        editor_in.len = n;
+        editor_in.pos = 0;
+    }
+    return editor_in.buf[editor_in.pos++];
+}
+
+void editor_set_line(struct line_editor *ed, const char *text, size_t len) {
+    ed->line.len = 0;
+    strbuf_append(&ed->line, text, len);
+    ed->cursor = ed->line.len;
+}
+
+void editor_insert(struct line_editor *ed, const char *s, size_t n) {
+    strbuf_reserve(&ed->line, n);
+    memmove(ed->line.data + ed->cursor + n, ed->line.data + ed->cursor, ed->line.len - ed->cursor + 1);
+    memcpy(ed->line.data + ed->cursor, s, n);
+    ed->line.len += n;
+    ed->cursor += n;
+}
+
+void editor_delete(struct line_editor *ed, size_t from, size_t to) {
+    if (from >= to) {
+        return;
+    }
+    memmove(ed->line.data + from, ed->line.data + to, ed->line.len - to + 1);
+    ed->line.len -= to - from;
+    ed->cursor = from;
+}
+
+size_t editor_prev_char(struct line_editor *ed, size_t pos) {
+    if (pos > 0) {
+        pos--;
+        while (pos > 0 && (ed->line.data[pos] & 0xC0) == 0x80) {
+            pos--;
+        }
+    }
+    return pos;
+}
+
+size_t editor_next_char(struct line_editor *ed, size_t pos) {
+    if (pos < ed->line.len) {
+        pos++;
+        while (pos < ed->line.len && (ed->line.data[pos] & 0xC0) == 0x80) {
+            pos++;
+        }
+    }
+    return pos;
+}
+
+void editor_history_move(struct line_editor *ed, int delta) {
+    size_t count = history_count();
+
+    if (delta < 0 && ed->history_pos == 0) {
+        return;
+    }
+    if (delta > 0 && ed->history_pos >= count) {
+        return;
+    }
+    if (ed->history_pos == count) {
+        // Keep the line being typed so Down can bring it back
+        ed->saved_line.len = 0;
+        strbuf_append(&ed->saved_line, ed->line.data ? ed->line.data : "", ed->line.len);
+    }
+    ed->history_pos += delta;
+    if (ed->history_pos == count) {
+        editor_set_line(ed, ed->saved_line.data ? ed->saved_line.data : "", ed->saved_line.len);
+    } else {
+        const struct history_entry *e = history_get(ed->history_pos);
+        editor_set_line(ed, e->text, e->len);
+    }
+}
+
+// Leave Ctrl+R mode, keeping the match as the line unless cancelled
+void editor_end_search(struct line_editor *ed, int accept) {
+    if (accept && ed->search_match >= 0) {
+        const struct history_entry *e = history_get(ed->search_match);
+        editor_set_line(ed, e->text, e->len);
+        ed->history_pos = ed->search_match;
+    }
+    ed->searching = 0;
+}
+
+// Handle one byte in Ctrl+R mode. Returns 1 if the byte should then be
+// processed as a normal key.
+int editor_search_key(struct line_editor *ed, int c) {
+    size_t count = history_count();
+
+    if (c == 18) { // Ctrl+R: next older match
+        if (ed->search_match > 0) {
+            long found = history_search(ed->search.data ? ed->search.data : "", ed->search_match);
+            if (found >= 0) {
+                ed->search_match = found;
+            }
+        }
+        return 0;
+    }
+    if (c == 7 || c == 3) { // Ctrl+G / Ctrl+C cancel
+        editor_end_search(ed, 0);
+        return 0;
+    }
+    if (c == 127 || c == 8) {
+        if (ed->search.len > 0) {
+            ed->search.data[--ed->search.len] = '\0';
+        }
+        ed->search_match = ed->search.len > 0 ? history_search(ed->search.data, count) : -1;
+        return 0;
+    }
+    if (c >= 32 || c == '\t') {
+        strbuf_putc(&ed->search, c);
+        // Stay on the current match while it still matches
+        size_t before = ed->search_match >= 0 ? (size_t)ed->search_match + 1 : count;
+        ed->search_match = history_search(ed->search.data, before);
+        return 0;
+    }
+    editor_end_search(ed, 1);
+    return 1;
+}
+
+// Read the rest of an escape sequence and turn it into a key code
+int editor_escape(void) {
+    int c = editor_getc(50);
+    if (c != '[' && c != 'O') {
+        return KEY_NONE;
+    }
+    int d = editor_getc(50);
+    if (d >= '0' && d <= '9') {
+        int e = editor_getc(50);
+        if (e != '~') {
+            return KEY_NONE;
+        }
+        switch (d) {
+        case '1': case '7': return KEY_HOME;
+        case '4': case '8': return KEY_END;
+        case '3': return KEY_DELETE;
+        default: return KEY_NONE;
+        }
+    }
+    switch (d) {
+    case 'A': return KEY_UP;
+    case 'B': return KEY_DOWN;
+    case 'C': return KEY_RIGHT;
+    case 'D': return KEY_LEFT;
+    case 'H': return KEY_HOME;
+    case 'F': return KEY_END;
+    default: return KEY_NONE;
+    }
+}
+
+// Modification time of a file in nanoseconds, or -1
+int64_t file_mtime_ns(const char *path) {
+    struct stat st;
+
+    if (stat(path, &st) != 0) {
+        return -1;
+    }
+    return st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+// Start (or restart) indexing the current $PATH. Directories are
+// scanned one per idle step, so nothing blocks the prompt.
+void path_index_reset(void) {
+    const char *path = getenv("PATH");
+
+    if (path_index.snapshot_map != NULL) {
+        free(path_index.names.argv);
+        path_index.names = (struct arglist){0};
+        path_index.nodes = NULL;
+        munmap(path_index.snapshot_map, path_index.snapshot_len);
+        path_index.snapshot_map = NULL;
+    }
+    arglist_free(&path_index.names);
+    arglist_free(&path_index.dirs);
+    free(path_index.nodes);
+    path_index.nodes = NULL;
+    path_index.n_nodes = 0;
+    path_index.next_dir = 0;
+    path_index.ready = 0;
+    free(path_index.path_env);
+    path_index.path_env = strdup(path ? path : "");
+
+    // Split on ':' (an empty element means the current directory,
+    // which isn't worth indexing)
+    for (const char *p = path_index.path_env; *p != '\0';) {
+        const char *end = strchr(p, ':');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len > 0) {
+            arglist_push(&path_index.dirs, p, len);
+        }
+        p += len;
+        if (*p == ':') {
+            p++;
+        }
+    }
+
+    if (path_index.inotify_fd >= 0) {
+        close(path_index.inotify_fd); // Also drops the old watches
+    }
+    path_index.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    path_index.next_watch = path_index.dirs.argc;
+    path_index.started = 1;
+}
+
+// Have path_index_check rebuild the index when 'dir' changes
+void path_index_watch(const char *dir) {
+    if (path_index.inotify_fd >= 0) {
+        inotify_add_watch(path_index.inotify_fd, dir,
+                          IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                          IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    }
+}
+
+// Scan the next $PATH directory with the glob scanner, keeping
+// executables, and watch it for changes
+void path_index_scan_next(void) {
+    const char *dir = path_index.dirs.argv[path_index.next_dir++];
+    struct dir_listing *dl = dir_listing_read(dir);
+    if (dl == NULL) {
+        return;
+    }
+
+    path_index_watch(dir);
+
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for (size_t i = 0; i < dl->count; i++) {
+        const char *name = dl->names + dl->offsets[i];
+        unsigned char type = dl->types[i];
+        if (type != DT_REG && type != DT_LNK) {
+            continue;
+        }
+        if (dfd >= 0 && faccessat(dfd, name, X_OK, 0) != 0) {
+            continue;
+        }
+        arglist_push(&path_index.names, name, strlen(name));
+    }
+    if (dfd >= 0) {
+        close(dfd);
+    }
+    dir_listing_free(dl);
+}
+
+// Sort and dedupe the names, then build a trie over them. Each node
+// covers the contiguous range of sorted names sharing its prefix, and
+// a node's children are stored contiguously in character order.
+void path_index_finish(void) {
+    struct arglist *names = &path_index.names;
+
+    for (int i = 0; builtins[i].name != NULL; i++) {
+        arglist_push(names, builtins[i].name, strlen(builtins[i].name));
+    }
+    if (names->argc > 1) {
+        qsort(names->argv, names->argc, sizeof(char *), compare_strings);
+    }
+    int n = 0;
+    for (int i = 0; i < names->argc; i++) {
+        if (n > 0 && strcmp(names->argv[n - 1], names->argv[i]) == 0) {
+            free(names->argv[i]);
+        } else {
+            names->argv[n++] = names->argv[i];
+        }
+    }
+    names->argc = n;
+    if (names->argv != NULL) {
+        names->argv[n] = NULL;
+    }
+
+    size_t cap = 1024;
+    path_index.nodes = malloc(cap * sizeof(struct trie_node));
+    if (path_index.nodes == NULL) {
+        perror("malloc failed");
+        exit(1);
+    }
+    path_index.nodes[0] = (struct trie_node){0, n, 0, 0, 0, 0};
+    path_index.n_nodes = 1;
+
+    // Breadth-first: expanding node i appends all of its children
+    for (size_t i = 0; i < path_index.n_nodes; i++) {
+        struct trie_node *node = &path_index.nodes[i];
+        uint32_t depth = node->depth;
+        uint32_t lo = node->first;
+        uint32_t hi = node->first + node->count;
+
+        // Names equal to the prefix sort first and end here
+        while (lo < hi && names->argv[lo][depth] == '\0') {
+            lo++;
+        }
+        path_index.nodes[i].child = path_index.n_nodes;
+        while (lo < hi) {
+            unsigned char ch = names->argv[lo][depth];
+            uint32_t end = lo;
+            while (end < hi && (unsigned char)names->argv[end][depth] == ch) {
+                end++;
+            }
+            if (path_index.n_nodes == cap) {
+                cap *= 2;
+                path_index.nodes = realloc(path_index.nodes, cap * sizeof(struct trie_node));
+                if (path_index.nodes == NULL) {
+                    perror("realloc failed");
+                    exit(1);
+                }
+            }
+            path_index.nodes[path_index.n_nodes++] = (struct trie_node){lo, end - lo, 0, depth + 1, 0, ch};
+            path_index.nodes[i].n_children++;
+            lo = end;
+        }
+    }
+    path_index.ready = 1;
+}
+
+// Rebuild from scratch if $PATH changed or a watched directory did
+void path_index_check(void) {
+    const char *path = getenv("PATH");
+
+    if (!path_index.started || strcmp(path ? path : "", path_index.path_env) != 0) {
+        path_index_reset();
+        return;
+    }
+
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    while (path_index.inotify_fd >= 0 && read(path_index.inotify_fd, buf, sizeof(buf)) > 0) {
+        changed = 1;
+    }
+    if (changed) {
+        path_index_reset();
+    }
+}
+
+int path_index_idle_work_pending(void) {
+    return !path_index.started || !path_index.ready || path_index.next_watch < path_index.dirs.argc;
+}
+
+void path_index_idle_work(void) {
+    if (!path_index.started) {
+        path_index_reset();
+    } else if (path_index.next_watch < path_index.dirs.argc) {
+        // A restored directory: watch it, then make sure it didn't
+        // change before the watch was there
+        int i = path_index.next_watch++;
+        path_index_watch(path_index.dirs.argv[i]);
+        if (file_mtime_ns(path_index.dirs.argv[i]) != path_index.snapshot_dirs[i].mtime_ns) {
+            path_index_reset();
+        }
+    } else if (path_index.next_dir < path_index.dirs.argc) {
+        path_index_scan_next();
+    } else if (!path_index.ready) {
+        path_index_finish();
+    }
+}
+
+// Range of indexed names starting with 'prefix', found by walking one
+// trie level per prefix byte. Finishes any pending build first.
+void path_index_lookup(const char *prefix, size_t len, uint32_t *first, uint32_t *count) {
+    path_index_check();
+    while (!path_index.ready) {
+        path_index_idle_work();
+    }
+
+    const struct trie_node *node = &path_index.nodes[0];
+    for (size_t i = 0; i < len; i++) {
+        const struct trie_node *child = &path_index.nodes[node->child];
+        const struct trie_node *end = child + node->n_children;
+        while (child < end && child->ch != (unsigned char)prefix[i]) {
+            child++;
+        }
+        if (child == end) {
+            *first = *count = 0;
+            return;
+        }
+        node = child;
+    }
+    *first = node->first;
+    *count = node->count;
+}
+
+// Size and mtime of the running binary, which a snapshot must match
+void snapshot_exe_identity(uint64_t *size, int64_t *mtime_ns) {
+    struct stat st;
+
+    *size = 0;
+    *mtime_ns = -1;
+    if (stat("/proc/self/exe", &st) == 0) {
+        *size = st.st_size;
+        *mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    }
+}
+
+// Add a string to the snapshot's string area, returning its offset
+uint32_t snapshot_string(struct snapshot_writer *w, const char *s) {
+    if (s == NULL) {
+        return SNAPSHOT_NONE;
+    }
+    uint32_t off = w->strings.len;
+    strbuf_append(&w->strings, s, strlen(s) + 1);
+    return off;
+}
+
+// Start a section of records, aligned for any of them. Returns its
+// offset in the file.
+uint32_t snapshot_section(struct snapshot_writer *w) {
+    while (w->records.len % sizeof(uint64_t) != 0) {
+        strbuf_putc(&w->records, '\0');
+    }
+    return sizeof(struct snapshot_header) + w->records.len;
+}
+
+void snapshot_record(struct snapshot_writer *w, const void *rec, size_t size) {
+    strbuf_append(&w->records, rec, size);
+}
+
+// Write the shell's state to 'file': options, prompt, directories, the
+// remembered command paths and the completion index of $PATH (built
+// first if it isn't yet), together with the mtimes of the $PATH
+// directories those were read from. Like zdb_save, a temporary file is
+// renamed into place.
+int snapshot_save(const char *file) {
+    struct snapshot_writer w = {0};
+    struct snapshot_header hdr = {.magic = SNAPSHOT_MAGIC, .version = SNAPSHOT_VERSION};
+    const char *path = getenv("PATH");
+    char tmp[4096];
+
+    snapshot_exe_identity(&hdr.exe_size, &hdr.exe_mtime_ns);
+    hdr.prompt = snapshot_string(&w, prompt.format);
+    hdr.pwd = snapshot_string(&w, dirs.pwd);
+    hdr.oldpwd = snapshot_string(&w, dirs.oldpwd);
+
+    hdr.options = snapshot_section(&w);
+    for (int i = 0; shell_options[i].name != NULL; i++) {
+        struct snapshot_option rec = {snapshot_string(&w, shell_options[i].name), *shell_options[i].value};
+        snapshot_record(&w, &rec, sizeof(rec));
+        hdr.n_options++;
+    }
+    hdr.stack = snapshot_section(&w);
+    for (int i = 0; i < dirs.stack.argc; i++) {
+        uint32_t rec = snapshot_string(&w, dirs.stack.argv[i]);
+        snapshot_record(&w, &rec, sizeof(rec));
+        hdr.n_stack++;
+    }
+
+    if (path != NULL) {
+        path_index_check();
+        while (!path_index.ready) {
+            path_index_idle_work();
+        }
+        hdr.path_env = snapshot_string(&w, path);
+        hdr.path_dirs = snapshot_section(&w);
+        for (int i = 0; i < path_index.dirs.argc; i++) {
+            struct snapshot_dir rec = {file_mtime_ns(path_index.dirs.argv[i]),
+                                       snapshot_string(&w, path_index.dirs.argv[i])};
+            snapshot_record(&w, &rec, sizeof(rec));
+            hdr.n_path_dirs++;
+        }
+        hdr.hashed = snapshot_section(&w);
+        for (int i = 0; i < PATH_CACHE_BUCKETS && path_cache.path_env != NULL &&
+                        strcmp(path_cache.path_env, path) == 0; i++) {
+            for (struct path_cache_entry *e = path_cache.buckets[i]; e != NULL; e = e->next) {
+                struct snapshot_hashed rec = {e->hits, snapshot_string(&w, e->name), snapshot_string(&w, e->path)};
+                snapshot_record(&w, &rec, sizeof(rec));
+                hdr.n_hashed++;
+            }
+        }
+        hdr.names = snapshot_section(&w);
+        for (int i = 0; i < path_index.names.argc; i++) {
+            uint32_t rec = snapshot_string(&w, path_index.names.argv[i]);
+            snapshot_record(&w, &rec, sizeof(rec));
+        }
+        hdr.n_names = path_index.names.argc;
+        hdr.nodes = snapshot_section(&w);
+        snapshot_record(&w, path_index.nodes, path_index.n_nodes * sizeof(struct trie_node));
+        hdr.n_nodes = path_index.n_nodes;
+    }
+
+    hdr.strings = snapshot_section(&w);
+    hdr.size = hdr.strings + w.strings.len;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", file, getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    int ok = fd >= 0 &&
+             write_all(fd, (const char *)&hdr, sizeof(hdr)) == 0 &&
+             write_all(fd, w.records.data ? w.records.data : "", w.records.len) == 0 &&
+             write_all(fd, w.strings.data, w.strings.len) == 0;
+    if (fd >= 0) {
+        ok = close(fd) == 0 && ok;
+    }
+    if (!ok || rename(tmp, file) != 0) {
+        fprintf(stderr, "snapshot: %s: %s\n", file, strerror(errno));
+        unlink(tmp);
+    }
+    strbuf_free(&w.records);
+    strbuf_free(&w.strings);
+    return ok ? 0 : 1;
+}
+
+// Does a section of 'n' records of 'size' bytes lie within the
+// records area of a mapped snapshot?
+int snapshot_section_ok(const struct snapshot_header *hdr, uint32_t off, uint32_t n, size_t size) {
+    return n == 0 || (off >= sizeof(*hdr) && off % sizeof(uint64_t) == 0 &&
+                      off + (uint64_t)n * size <= hdr->strings);
+}
+
+// Check that every offset in a mapped snapshot stays inside it, so the
+// restored state can point straight into the mapping
+int snapshot_valid(const char *map, size_t len) {
+    const struct snapshot_header *hdr = (const struct snapshot_header *)map;
+
+    if (len < sizeof(*hdr) || hdr->size != len || hdr->strings >= len || map[len - 1] != '\0' ||
+        !snapshot_section_ok(hdr, hdr->options, hdr->n_options, sizeof(struct snapshot_option)) ||
+        !snapshot_section_ok(hdr, hdr->stack, hdr->n_stack, sizeof(uint32_t)) ||
+        !snapshot_section_ok(hdr, hdr->path_dirs, hdr->n_path_dirs, sizeof(struct snapshot_dir)) ||
+        !snapshot_section_ok(hdr, hdr->hashed, hdr->n_hashed, sizeof(struct snapshot_hashed)) ||
+        !snapshot_section_ok(hdr, hdr->names, hdr->n_names, sizeof(uint32_t)) ||
+        !snapshot_section_ok(hdr, hdr->nodes, hdr->n_nodes, sizeof(struct trie_node))) {
+        return 0;
+    }
+
+    // Every string offset, wherever it is stored
+    size_t strings_len = len - hdr->strings;
+    const uint32_t *offs[] = {&hdr->prompt, &hdr->pwd, &hdr->oldpwd, &hdr->path_env};
+    for (size_t i = 0; i < sizeof(offs) / sizeof(offs[0]); i++) {
+        if (*offs[i] != SNAPSHOT_NONE && *offs[i] >= strings_len) {
+            return 0;
+        }
+    }
+    const struct snapshot_option *opts = (const void *)(map + hdr->options);
+    for (uint32_t i = 0; i < hdr->n_options; i++) {
+        if (opts[i].name >= strings_len) {
+            return 0;
+        }
+    }
+    const struct snapshot_dir *path_dirs = (const void *)(map + hdr->path_dirs);
+    for (uint32_t i = 0; i < hdr->n_path_dirs; i++) {
+        if (path_dirs[i].name >= strings_len) {
+            return 0;
+        }
+    }
+    const struct snapshot_hashed *hashed = (const void *)(map + hdr->hashed);
+    for (uint32_t i = 0; i < hdr->n_hashed; i++) {
+        if (hashed[i].name >= strings_len || hashed[i].path >= strings_len) {
+            return 0;
+        }
+    }
+    const uint32_t *stack = (const void *)(map + hdr->stack);
+    for (uint32_t i = 0; i < hdr->n_stack; i++) {
+        if (stack[i] >= strings_len) {
+            return 0;
+        }
+    }
+    const uint32_t *names = (const void *)(map + hdr->names);
+    for (uint32_t i = 0; i < hdr->n_names; i++) {
+        if (names[i] >= strings_len) {
+            return 0;
+        }
+    }
+
+    // The trie's ranges and child links
+    const struct trie_node *nodes = (const void *)(map + hdr->nodes);
+    if (hdr->n_names > 0 && hdr->n_nodes == 0) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < hdr->n_nodes; i++) {
+        if ((uint64_t)nodes[i].first + nodes[i].count > hdr->n_names ||
+            (uint64_t)nodes[i].child + nodes[i].n_children > hdr->n_nodes) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Take up the $PATH state of a mapped snapshot if $PATH is the same and
+// none of its directories changed since. Adding the inotify watches
+// costs more than the rest of the restore, so that is left to idle
+// time (path_index_idle_work), which compares each mtime again once
+// its watch is in place. The index keeps pointing into the mapping.
+// Returns 1 if the mapping is now in use.
+int snapshot_restore_path(const char *map, size_t len) {
+    const struct snapshot_header *hdr = (const struct snapshot_header *)map;
+    const char *strings = map + hdr->strings;
+    const char *path = getenv("PATH");
+
+    if (hdr->path_env == SNAPSHOT_NONE || path == NULL || strcmp(strings + hdr->path_env, path) != 0) {
+        return 0;
+    }
+    path_index_reset();
+    const struct snapshot_dir *path_dirs = (const void *)(map + hdr->path_dirs);
+    if ((int)hdr->n_path_dirs != path_index.dirs.argc) {
+        return 0;
+    }
+    for (int i = 0; i < path_index.dirs.argc; i++) {
+        const char *dir = path_index.dirs.argv[i];
+        if (strcmp(strings + path_dirs[i].name, dir) != 0 || file_mtime_ns(dir) != path_dirs[i].mtime_ns) {
+            return 0;
+        }
+    }
+
+    path_cache_clear();
+    free(path_cache.path_env);
+    path_cache.path_env = strdup(path);
+    const struct snapshot_hashed *hashed = (const void *)(map + hdr->hashed);
+    for (uint32_t i = 0; i < hdr->n_hashed; i++) {
+        path_cache_add(strings + hashed[i].name, strdup(strings + hashed[i].path), hashed[i].hits);
+    }
+
+    const uint32_t *names = (const void *)(map + hdr->names);
+    path_index.names.argv = malloc((hdr->n_names + 1) * sizeof(char *));
+    if (path_index.names.argv == NULL) {
+        perror("malloc failed");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < hdr->n_names; i++) {
+        path_index.names.argv[i] = (char *)strings + names[i];
+    }
+    path_index.names.argv[hdr->n_names] = NULL;
+    path_index.names.argc = hdr->n_names;
+    path_index.names.cap = hdr->n_names + 1;
+    path_index.nodes = (struct trie_node *)(map + hdr->nodes);
+    path_index.n_nodes = hdr->n_nodes;
+    path_index.next_dir = path_index.dirs.argc;
+    path_index.ready = hdr->n_nodes > 0;
+    path_index.snapshot_map = (void *)map;
+    path_index.snapshot_len = len;
+    path_index.snapshot_dirs = path_dirs;
+    path_index.next_watch = 0;
+    return 1;
+}
+
+// Resume from a snapshot written by 'snapshot': map it, check it was
+// written by this very binary and is intact, then restore options,
+// prompt and directories, and the $PATH state if still current.
+// Returns 0, or 1 (reported) if it couldn't be used.
+int snapshot_restore(const char *file) {
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "sigshell: %s: %s\n", file, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+    char *map = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "sigshell: %s: not a snapshot\n", file);
+        return 1;
+    }
+
+    const struct snapshot_header *hdr = (const struct snapshot_header *)map;
+    uint64_t exe_size;
+    int64_t exe_mtime_ns;
+    snapshot_exe_identity(&exe_size, &exe_mtime_ns);
+    if ((size_t)st.st_size < sizeof(*hdr) || hdr->magic != SNAPSHOT_MAGIC) {
+        fprintf(stderr, "sigshell: %s: not a snapshot\n", file);
+    } else if (hdr->version != SNAPSHOT_VERSION || hdr->exe_size != exe_size || hdr->exe_mtime_ns != exe_mtime_ns) {
+        fprintf(stderr, "sigshell: %s: written by a different sigshell binary; not restored\n", file);
+    } else if (!snapshot_valid(map, st.st_size)) {
+        fprintf(stderr, "sigshell: %s: snapshot is damaged; not restored\n", file);
+    } else {
+        const char *strings = map + hdr->strings;
+        const struct snapshot_option *opts = (const void *)(map + hdr->options);
+        for (uint32_t i = 0; i < hdr->n_options; i++) {
+            for (int j = 0; shell_options[j].name != NULL; j++) {
+                if (strcmp(strings + opts[i].name, shell_options[j].name) == 0) {
+                    *shell_options[j].value = opts[i].value;
+                }
+            }
+        }
+        if (hdr->prompt != SNAPSHOT_NONE) {
+            free(prompt.format);
+            prompt.format = strdup(strings + hdr->prompt);
+        }
+        if (hdr->pwd != SNAPSHOT_NONE && strcmp(strings + hdr->pwd, dirs.pwd) != 0) {
+            dirs_chdir(strings + hdr->pwd, 0, "sigshell: --restore");
+        }
+        if (hdr->oldpwd != SNAPSHOT_NONE) {
+            free(dirs.oldpwd);
+            dirs.oldpwd = strdup(strings + hdr->oldpwd);
+            setenv("OLDPWD", dirs.oldpwd, 1);
+        }
+        const uint32_t *stack = (const void *)(map + hdr->stack);
+        arglist_free(&dirs.stack);
+        for (uint32_t i = 0; i < hdr->n_stack; i++) {
+            arglist_push(&dirs.stack, strings + stack[i], strlen(strings + stack[i]));
+        }
+        if (!snapshot_restore_path(map, st.st_size)) {
+            munmap(map, st.st_size);
+        }
+        return 0;
+    }
+    munmap(map, st.st_size);
+    return 1;
+}
+
+// Work the editor does while waiting for input
+int idle_work_pending(void) {
+    return history_idle_work_pending() || path_index_idle_work_pending();
+}
+
+void idle_work(void) {
+    if (path_index_idle_work_pending()) {
+        path_index_idle_work();
+    } else if (history_idle_work_pending()) {
+        history_idle_work();
+    }
+}
+
+// Print candidates below the line in columns, then redraw the prompt
+void editor_list_candidates(struct line_editor *ed, struct arglist *cands) {
+    struct strbuf out = {0};
+    size_t width = 0;
+    int shown = cands->argc < COMPLETION_MAX_LIST ? cands->argc : COMPLETION_MAX_LIST;
+
+    for (int i = 0; i < shown; i++) {
+        size_t w = utf8_cells(cands->argv[i], strlen(cands->argv[i]));
+        if (w > width) {
+            width = w;
+        }
+    }
+    width += 2;
+    int per_row = ed->cols / width > 0 ? ed->cols / width : 1;
+
+    term_move(&out, ed->shown_cursor, utf8_cells(ed->shown.data, ed->shown.len), ed->cols);
+    strbuf_append(&out, "\n", 1);
+    for (int i = 0; i < shown; i++) {
+        size_t len = strlen(cands->argv[i]);
+        strbuf_append(&out, cands->argv[i], len);
+        if ((i + 1) % per_row == 0 || i + 1 == shown) {
+            strbuf_append(&out, "\n", 1);
+        } else {
+            for (size_t pad = utf8_cells(cands->argv[i], len); pad < width; pad++) {
+                strbuf_putc(&out, ' ');
+            }
+        }
+    }
+    if (shown < cands->argc) {
+        char more[64];
+        strbuf_append(&out, more, snprintf(more, sizeof(more), "... and %d more\n", cands->argc - shown));
+    }
+    output_queue(out.data, out.len);
+    strbuf_free(&out);
+    ed->shown.len = 0;
+    ed->shown_cursor = 0;
+}
+
+// Complete the word before the cursor: command names from the PATH
+// index for the first word, otherwise file names from a directory
+// listing. Extends to the longest common prefix; a second Tab with
+// nothing to add lists the candidates.
+void editor_complete(struct line_editor *ed) {
+    struct arglist cands = {0};
+    size_t start = ed->cursor;
+    int is_command = 1;
+
+    while (start > 0 && ed->line.data[start - 1] != ' ') {
+        start--;
+    }
+    for (size_t i = 0; i < start; i++) {
+        if (ed->line.data[i] != ' ') {
+            is_command = 0;
+        }
+    }
+
+    const char *word = ed->line.data + start;
+    size_t word_len = ed->cursor - start;
+    const char *slash = memrchr(word, '/', word_len);
+    size_t base_off = slash ? (size_t)(slash - word) + 1 : 0;
+    struct strbuf suffixes = {0}; // Per candidate: '/' for directories, ' ' otherwise
+
+    if (is_command && slash == NULL) {
+        uint32_t first, count;
+        path_index_lookup(word, word_len, &first, &count);
+        for (uint32_t i = first; i < first + count; i++) {
+            arglist_push(&cands, path_index.names.argv[i], strlen(path_index.names.argv[i]));
+            strbuf_putc(&suffixes, ' ');
+        }
+    } else {
+        struct strbuf dir = {0};
+        if (slash == NULL) {
+            strbuf_append(&dir, ".", 1);
+        } else if (word[0] == '~' && (word + 1 == slash) && getenv("HOME") != NULL) {
+            strbuf_append(&dir, getenv("HOME"), strlen(getenv("HOME")));
+        } else {
+            strbuf_append(&dir, word, base_off);
+        }
+
+        const char *base = word + base_off;
+        size_t base_len = word_len - base_off;
+        struct dir_listing *dl = dir_listing_get(dir.data);
+        for (size_t i = 0; dl != NULL && i < dl->count; i++) {
+            const char *name = dl->names + dl->offsets[i];
+            if (strncmp(name, base, base_len) != 0 || (name[0] == '.' && base[0] != '.')) {
+                continue;
+            }
+            int is_dir = dl->types[i] == DT_DIR;
+            if (dl->types[i] == DT_LNK) {
+                struct strbuf full = {0};
+                strbuf_append(&full, dir.data, dir.len);
+                strbuf_putc(&full, '/');
+                strbuf_append(&full, name, strlen(name));
+                is_dir = path_is_dir(full.data);
+                strbuf_free(&full);
+            }
+            arglist_push(&cands, name, strlen(name));
+            strbuf_putc(&suffixes, is_dir ? '/' : ' ');
+        }
+        dir_listing_release(dl);
+        strbuf_free(&dir);
+        if (cands.argc > 1) {
+            // Sort names and suffixes together by tagging each name
+            for (int i = 0; i < cands.argc; i++) {
+                size_t len = strlen(cands.argv[i]);
+                cands.argv[i] = realloc(cands.argv[i], len + 2);
+                cands.argv[i][len] = suffixes.data[i];
+                cands.argv[i][len + 1] = '\0';
+            }
+            qsort(cands.argv, cands.argc, sizeof(char *), compare_strings);
+            for (int i = 0; i < cands.argc; i++) {
+                size_t len = strlen(cands.argv[i]);
+                suffixes.data[i] = cands.argv[i][len - 1];
+                cands.argv[i][len - 1] = '\0';
+            }
+        }
+    }
+
+    size_t have = word_len - base_off;
+    if (cands.argc == 1) {
+        editor_insert(ed, cands.argv[0] + have, strlen(cands.argv[0]) - have);
+        editor_insert(ed, &suffixes.data[0], 1);
+    } else if (cands.argc > 1) {
+        size_t common = strlen(cands.argv[0]);
+        for (int i = 1; i < cands.argc; i++) {
+            size_t j = 0;
+            while (j < common && cands.argv[i][j] == cands.argv[0][j]) {
+                j++;
+            }
+            common = j;
+        }
+        if (common > have) {
+            editor_insert(ed, cands.argv[0] + have, common - have);
+        } else if (ed->last_key == '\t') {
+            for (int i = 0; i < cands.argc; i++) {
+                if (suffixes.data[i] == '/') {
+                    size_t len = strlen(cands.argv[i]);
+                    cands.argv[i] = realloc(cands.argv[i], len + 2);
+                    strcpy(cands.argv[i] + len, "/");
+                }
+            }
+            editor_list_candidates(ed, &cands);
+        }
+    }
+
+    strbuf_free(&suffixes);
+    arglist_free(&cands);
+}
+
+// Interactive line editor. Returns the line in line_arena, or NULL at
+// EOF (Ctrl+D on an empty line).
+char *editor_readline(const char *prompt) {
+    struct line_editor ed = {0};
+    char *result = NULL;
+
+    ed.line = scratch_get();
+    ed.shown = scratch_get();
+    ed.saved_line = scratch_get();
+    ed.search = scratch_get();
+    ed.prompt = prompt;
+    ed.cols = terminal_columns();
+    ed.history_pos = history_count();
+    ed.search_match = -1;
+    strbuf_reserve(&ed.line, 64);
+    ed.line.data[0] = '\0';
+
+    terminal_raw();
+    editor_refresh(&ed);
+    latency_record(LAT_EXIT_PROMPT, child_exit_ns);
+    child_exit_ns = 0;
+
+    for (;;) {
+        // Only redraw once pending input (e.g. a paste) is consumed
+        int c = editor_getc(editor_in.pos < editor_in.len ? 0 : (idle_work_pending() ? 0 : -1));
+        if (c == -2) {
+            if (winch_received) {
+                winch_received = 0;
+                int rows_up = ed.shown_cursor / ed.cols;
+                ed.cols = terminal_columns();
+                editor_reset_screen(&ed, rows_up);
+                editor_refresh(&ed);
+            } else if (job_table.changed && opt_notify) {
+                // Print the report where the line was, then draw the
+                // prompt and line again below it
+                editor_reset_screen(&ed, ed.shown_cursor / ed.cols);
+                jobs_report();
+                editor_refresh(&ed);
+            } else if (prompt_async_poll()) {
+                ed.prompt = prompt_render(1);
+                editor_refresh(&ed);
+            } else if (idle_work_pending()) {
+                idle_work();
+            }
+            continue;
+        }
+        if (c == -1) {
+            break;
+        }
+        if (ed.searching && !editor_search_key(&ed, c)) {
+            goto refresh;
+        }
+
+        if (c == '\r' || c == '\n') {
+            if (ed.searching) {
+                editor_end_search(&ed, 1);
+            }
+            ed.cursor = ed.line.len;
+            editor_refresh(&ed);
+            if (ed.shown_cursor == 0 || ed.shown_cursor % ed.cols != 0) {
+                if (write(STDOUT_FILENO, "\n", 1) < 0) {
+                    perror("write failed");
+                }
+            }
+            result = arena_strndup(&line_arena, ed.line.data, ed.line.len);
+            break;
+        }
+
+        int key = c;
+        if (c == 27) {
+            key = editor_escape();
+        }
+
+        switch (key) {
+        case 1: case KEY_HOME: // Ctrl+A
+            ed.cursor = 0;
+            break;
+        case 5: case KEY_END: // Ctrl+E
+            ed.cursor = ed.line.len;
+            break;
+        case 2: case KEY_LEFT: // Ctrl+B
+            ed.cursor = editor_prev_char(&ed, ed.cursor);
+            break;
+        case 6: case KEY_RIGHT: // Ctrl+F
+            ed.cursor = editor_next_char(&ed, ed.cursor);
+            break;
+        case 16: case KEY_UP: // Ctrl+P
+            editor_history_move(&ed, -1);
+            break;
+        case 14: case KEY_DOWN: // Ctrl+N
+            editor_history_move(&ed, 1);
+            break;
+        case 127: case 8: // Backspace
+            editor_delete(&ed, editor_prev_char(&ed, ed.cursor), ed.cursor);
+            break;
+        case 4: // Ctrl+D: EOF on an empty line, otherwise delete
+            if (ed.line.len == 0) {
+                goto done;
+            }
+            /* fall through */
+        case KEY_DELETE:
+            editor_delete(&ed, ed.cursor, editor_next_char(&ed, ed.cursor));
+            break;
+        case 11: // Ctrl+K
+            editor_delete(&ed, ed.cursor, ed.line.len);
+            break;
+        case 21: // Ctrl+U
+            editor_delete(&ed, 0, ed.cursor);
+            break;
+        case 23: { // Ctrl+W: delete the previous word
+            size_t from = ed.cursor;
+            while (from > 0 && ed.line.data[from - 1] == ' ') {
+                from--;
+            }
+            while (from > 0 && ed.line.data[from - 1] != ' ') {
+                from--;
+            }
+            editor_delete(&ed, from, ed.cursor);
+            break;
+        }
+        case '\t':
+            editor_complete(&ed);
+            break;
+        case 12: // Ctrl+L
+            output_queue("\x1b[H\x1b[2J", 7);
+            ed.shown.len = 0;
+            ed.shown_cursor = 0;
+            break;
+        case 18: // Ctrl+R
+            ed.searching = 1;
+            ed.search.len = 0;
+            ed.search_match = -1;
+            break;
+        case 3: { // Ctrl+C: abandon the line
+            static const char msg[] = "\n[Shell] Use 'exit' command to quit the shell.\n";
+            ed.cursor = ed.line.len;
+            editor_refresh(&ed);
+            output_queue(msg, sizeof(msg) - 1);
+            ed.shown.len = 0;
+            ed.shown_cursor = 0;
+            editor_set_line(&ed, "", 0);
+            ed.history_pos = history_count();
+            break;
+        }
+        default:
+            // Printable ASCII and UTF-8 bytes are inserted as typed
+            if (key >= 32 && key < 256 && key != 127) {
+                char ch = key;
+                editor_insert(&ed, &ch, 1);
+            }
+            break;
+        }
+
+        ed.last_key = key;
+
+    refresh:
+        if (editor_in.pos == editor_in.len) {
+            editor_refresh(&ed);
+        }
+    }
+
+done:
+    terminal_restore();
+    scratch_put(&ed.line);
+    scratch_put(&ed.shown);
+    scratch_put(&ed.saved_line);
+    scratch_put(&ed.search);
+    return result;
+}
+
+// Read the next command line: through the editor on a terminal,
+// otherwise as a plain line of any length from stdin. Returns the line
+// without its newline in line_arena, or NULL at EOF.
+char *read_command_line(const char *prompt) {
+    if (isatty(STDIN_FILENO)) {
+        return editor_readline(prompt);
+    }
+
+    static char *line = NULL; // getline's buffer, reused
+    static size_t cap = 0;
+    output_write(prompt, strlen(prompt));
+    latency_record(LAT_EXIT_PROMPT, child_exit_ns);
+    child_exit_ns = 0;
+    for (;;) {
+        ssize_t n = getline(&line, &cap, stdin);
+        if (n < 0) {
+            if (errno == EINTR && !feof(stdin)) {
+                clearerr(stdin);
+                continue;
+            }
+            return NULL;
+        }
+        return arena_strndup(&line_arena, line, strcspn(line, "\n"));
+    }
+}
+
+// Set up an io_uring instance for the event loop. Returns -1 if the
+// kernel doesn't offer one (or multishot poll), so epoll is used.
+int uring_setup(struct uring_queue *q) {
+    struct io_uring_params p = {0};
+
+    int fd = syscall(SYS_io_uring_setup, EVLOOP_URING_ENTRIES, &p);
+    if (fd < 0) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP) ||
+        !(p.features & IORING_FEAT_FAST_POLL)) {
+        close(fd); // Older than multishot poll (5.13) too
+        return -1;
+    }
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t len = sq_len > cq_len ? sq_len : cq_len;
+    char *rings = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    q->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (rings == MAP_FAILED || q->sqes == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    q->sq_head = (unsigned *)(rings + p.sq_off.head);
+    q->sq_tail = (unsigned *)(rings + p.sq_off.tail);
+    q->sq_mask = *(unsigned *)(rings + p.sq_off.ring_mask);
+    q->sq_entries = p.sq_entries;
+    q->sq_array = (unsigned *)(rings + p.sq_off.array);
+    q->cq_head = (unsigned *)(rings + p.cq_off.head);
+    q->cq_tail = (unsigned *)(rings + p.cq_off.tail);
+    q->cq_mask = *(unsigned *)(rings + p.cq_off.ring_mask);
+    q->cqes = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+    q->to_submit = 0;
+    return fd;
+}
+
+// Hand queued requests to the kernel, waiting for 'wait_nr' completions
+void uring_enter(struct uring_queue *q, unsigned wait_nr) {
+    while (q->to_submit > 0 || wait_nr > 0) {
+        int n = syscall(SYS_io_uring_enter, evloop.fd, q->to_submit, wait_nr,
+                        wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                perror("io_uring_enter failed");
+            }
+            return;
+        }
+        q->to_submit -= n;
+        wait_nr = 0;
+    }
+}
+
+// Next free submission slot, making room if the queue is full
+struct io_uring_sqe *uring_get_sqe(struct uring_queue *q) {
+    unsigned tail = *q->sq_tail;
+
+    if (tail - __atomic_load_n(q->sq_head, __ATOMIC_ACQUIRE) == q->sq_entries) {
+        uring_enter(q, 0);
+    }
+    struct io_uring_sqe *sqe = &q->sqes[tail & q->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    q->sq_array[tail & q->sq_mask] = tail & q->sq_mask;
+    __atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    q->to_submit++;
+    return sqe;
+}
+
+// Ask for a completion when 'fd' is ready. Sources whose handlers read
+// until EAGAIN (EPOLLET) get a multishot request; the rest are armed
+// again after each dispatch, which is what level triggering means here.
+void uring_poll_add(int fd) {
+    struct event_source *src = &evloop.sources[fd];
+    struct io_uring_sqe *sqe = uring_get_sqe(&evloop.ring);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = src->events & ~EPOLLET;
+    sqe->len = (src->events & EPOLLET) ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = (uint64_t)src->gen << 32 | (uint32_t)fd;
+}
+
+// Register 'fd' with the event loop; 'fn' runs when it is ready. With
+// EPOLLET in 'events', 'fn' must read until EAGAIN.
+void evloop_add(int fd, uint32_t events, event_handler fn, void *data) {
+    if (evloop.fd < 0) {
+        evloop.fd = evloop.want_uring ? uring_setup(&evloop.ring) : -1;
+        evloop.uring = evloop.fd >= 0;
+        if (evloop.want_uring && !evloop.uring) {
+            fprintf(stderr, "sigshell: io_uring unavailable, using epoll\n");
+        }
+        if (!evloop.uring) {
+            evloop.fd = epoll_create1(EPOLL_CLOEXEC);
+        }
+        if (evloop.fd < 0) {
+            perror("epoll_create1 failed");
+            exit(1);
+        }
+    }
+    if (fd >= evloop.n_sources) {
+        int n = evloop.n_sources ? evloop.n_sources : 64;
+        while (n <= fd) {
+            n *= 2;
+        }
+        evloop.sources = realloc(evloop.sources, n * sizeof(struct event_source));
+        if (evloop.sources == NULL) {
+            perror("realloc failed");
+            exit(1);
+        }
+        memset(evloop.sources + evloop.n_sources, 0, (n - evloop.n_sources) * sizeof(struct event_source));
+        evloop.n_sources = n;
+    }
+    evloop.sources[fd].fn = fn;
+    evloop.sources[fd].data = data;
+    evloop.sources[fd].events = events;
+    evloop.sources[fd].gen++;
+    evloop.sources[fd].rearm = 0;
+
+    if (evloop.uring) {
+        uring_poll_add(fd);
+        uring_enter(&evloop.ring, 0); // So the ring's fd reports readiness
+        return;
+    }
+    struct epoll_event ev = {.events = events, .data.fd = fd};
+    if (epoll_ctl(evloop.fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl failed");
+    }
+}
+
+void evloop_del(int fd) {
+    if (fd < 0 || fd >= evloop.n_sources) {
+        return; // Never registered
+    }
+    evloop.sources[fd].fn = NULL;
+    if (evloop.uring) {
+        // The poll holds its own reference to the file, so closing the
+        // fd alone wouldn't end it
+        struct io_uring_sqe *sqe = uring_get_sqe(&evloop.ring);
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = (uint64_t)evloop.sources[fd].gen << 32 | (uint32_t)fd;
+        sqe->user_data = EVLOOP_UD_INTERNAL;
+        uring_enter(&evloop.ring, 0);
+        return;
+    }
+    epoll_ctl(evloop.fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+// Reap up to 'max' poll completions into 'events', re-arming one-shot
+// polls once their source has been dispatched
+int uring_wait(struct epoll_event *events, int max, int timeout_ms) {
+    struct uring_queue *q = &evloop.ring;
+    struct __kernel_timespec ts;
+
+    if (__atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE) == *q->cq_head && timeout_ms != 0) {
+        if (timeout_ms > 0) {
+            struct io_uring_sqe *sqe = uring_get_sqe(q);
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = timeout_ms % 1000 * 1000000L;
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->addr = (uint64_t)(uintptr_t)&ts;
+            sqe->len = 1;
+            sqe->user_data = EVLOOP_UD_INTERNAL;
+        }
+        uring_enter(q, 1);
+    } else {
+        uring_enter(q, 0);
+    }
+
+    int n = 0;
+    unsigned head = *q->cq_head;
+    unsigned tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail && n < max; head++) {
+        const struct io_uring_cqe *cqe = &q->cqes[head & q->cq_mask];
+        if (cqe->user_data == EVLOOP_UD_INTERNAL) {
+            continue;
+        }
+        int fd = (uint32_t)cqe->user_data;
+        uint32_t gen = cqe->user_data >> 32;
+        if (fd >= evloop.n_sources || evloop.sources[fd].gen != gen || evloop.sources[fd].fn == NULL) {
+            continue; // Completion for a source since removed
+        }
+        if (cqe->res <= 0) {
+            continue; // The poll failed; the source stays quiet
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            evloop.sources[fd].rearm = 1; // One-shot, or a multishot the kernel ended
+        }
+        events[n].events = cqe->res;
+        events[n].data.fd = fd;
+        n++;
+    }
+    __atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+// Wait up to 'timeout_ms' (-1: forever) and dispatch ready sources
+void evloop_run_once(int timeout_ms) {
+    struct epoll_event events[64];
+
+    int n = evloop.uring ? uring_wait(events, 64, timeout_ms) : epoll_wait(evloop.fd, events, 64, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        // A handler earlier in this batch may have removed it
+        if (fd < evloop.n_sources && evloop.sources[fd].fn != NULL) {
+            evloop.sources[fd].fn(fd, events[i].events, evloop.sources[fd].data);
+        }
+    }
+    if (evloop.uring) {
+        for (int i = 0; i < n; i++) {
+            struct event_source *src = &evloop.sources[events[i].data.fd];
+            if (src->rearm && src->fn != NULL) {
+                src->rearm = 0;
+                uring_poll_add(events[i].data.fd);
+            }
+        }
+        uring_enter(&evloop.ring, 0);
+    }
+}
+
+// Move the oldest 'count' bytes of the ring to the memfd, or count them
+// as dropped once it is full (so what is kept stays in order)
+void job_log_spill(struct job_log *log, size_t count) {
+    size_t start = log->tail & (JOBLOG_RING_SIZE - 1);
+    struct iovec iov[2];
+
+    iov[0].iov_base = log->ring + start;
+    iov[0].iov_len = count < JOBLOG_RING_SIZE - start ? count : JOBLOG_RING_SIZE - start;
+    iov[1].iov_base = log->ring;
+    iov[1].iov_len = count - iov[0].iov_len;
+
+    if (log->dropped == 0 && log->spilled + count <= JOBLOG_SPILL_MAX) {
+        if (log->spill_fd < 0) {
+            log->spill_fd = memfd_create("sigshell-joblog", MFD_CLOEXEC);
+        }
+        if (log->spill_fd >= 0 && writev(log->spill_fd, iov, iov[1].iov_len > 0 ? 2 : 1) == (ssize_t)count) {
+            log->spilled += count;
+        } else {
+            log->dropped += count;
+        }
+    } else {
+        log->dropped += count;
+    }
+    log->tail += count;
+}
+
+void job_log_close(struct job_log *log) {
+    evloop_del(log->fd);
+    close(log->fd);
+    log->fd = -1;
+    job_table.open_logs--;
+}
+
+// Read what a job has written, straight into the ring's free space.
+// Half the ring is kept free so every read can be large.
+void job_log_drain(int fd, uint32_t events, void *data) {
+    struct job_log *log = data;
+    (void)events;
+
+    for (int i = 0; i < JOBLOG_READS_PER_WAKEUP; i++) {
+        uint64_t used = log->head - log->tail;
+        if (used > JOBLOG_RING_SIZE / 2) {
+            job_log_spill(log, used - JOBLOG_RING_SIZE / 2);
+        }
+        size_t start = log->head & (JOBLOG_RING_SIZE - 1);
+        size_t space = JOBLOG_RING_SIZE - (log->head - log->tail);
+        struct iovec iov[2];
+        iov[0].iov_base = log->ring + start;
+        iov[0].iov_len = space < JOBLOG_RING_SIZE - start ? space : JOBLOG_RING_SIZE - start;
+        iov[1].iov_base = log->ring;
+        iov[1].iov_len = space - iov[0].iov_len;
+
+        ssize_t n = readv(fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (n <= 0) {
+            job_log_close(log);
+            return;
+        }
+        log->head += n;
+    }
+}
+
+// Collect the state changes of background jobs. Each process of a job
+// is waited for by PID, so statuses of foreground children (which are
+// waited for by their own group) are never taken here, nor the other
+// way round. All of a pipeline's stages are collected on the same
+// wakeup, in whatever order they exit.
+void job_sigchld(int fd, uint32_t events, void *data) {
+    struct signalfd_siginfo info;
+    (void)events;
+    (void)data;
+
+    while (read(fd, &info, sizeof(info)) > 0) {
+        // Drain; one wakeup can stand for several children
+    }
+    for (struct job *job = job_table.head; job != NULL; job = job->next) {
+        int reaped = 0;
+        for (int i = 0; i < job->n_procs && job->state != JOB_DONE; i++) {
+            struct job_proc *proc = &job->procs[i];
+            int status;
+            struct rusage ru;
+            while (proc->state != JOB_DONE &&
+                   wait4(proc->pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru) == proc->pid) {
+                job_proc_update(proc, status, &ru);
+                reaped = 1;
+            }
+        }
+        int state = job_procs_state(job->procs, job->n_procs);
+        if (!reaped || state == job->state) {
+            continue;
+        }
+        job->state = state;
+        if (state == JOB_STOPPED) {
+            job->notified = 0;
+        } else if (state == JOB_DONE) {
+            job->status = pipeline_status(job->procs, job->n_procs);
+            job->duration_ns = monotonic_ns() - job->started_ns;
+            for (int i = 0; i < job->n_procs; i++) {
+                timeradd(&job->ru.ru_utime, &job->procs[i].ru.ru_utime, &job->ru.ru_utime);
+                timeradd(&job->ru.ru_stime, &job->procs[i].ru.ru_stime, &job->ru.ru_stime);
+            }
+            job->notified = 0;
+        }
+        job_table.changed |= !job->notified;
+    }
+
+    int kept = 0;
+    for (int i = 0; i < job_table.n_strays; i++) {
+        if (waitpid(job_table.strays[i], NULL, WNOHANG) == 0) {
+            job_table.strays[kept++] = job_table.strays[i];
+        }
+    }
+    job_table.n_strays = kept;
+}
+
+// Route SIGCHLD through a signalfd in the event loop. It is blocked
+// before the first job is forked so that job's exit can't be missed;
+// children get an empty mask again in spawn_command.
+void jobs_watch_sigchld(void) {
+    sigset_t mask;
+
+    if (job_table.sigchld_fd >= 0) {
+        return;
+    }
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    job_table.sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (job_table.sigchld_fd < 0) {
+        perror("signalfd failed");
+        return;
+    }
+    evloop_add(job_table.sigchld_fd, EPOLLIN | EPOLLET, job_sigchld, NULL);
+}
+
+// Start draining a job's output pipe into a log allocated from the
+// job's arena
+struct job_log *job_log_open(int fd, struct arena *arena) {
+    struct job_log *log = arena_alloc(arena, sizeof(*log));
+
+    memset(log, 0, sizeof(*log));
+    log->ring = arena_alloc(arena, JOBLOG_RING_SIZE);
+    log->fd = fd;
+    log->spill_fd = -1;
+    fcntl(fd, F_SETFL, O_NONBLOCK); // Only our end; the job's stays blocking
+    fcntl(fd, F_SETPIPE_SZ, JOBLOG_PIPE_SIZE); // Fewer wakeups; best effort
+    evloop_add(fd, EPOLLIN, job_log_drain, log);
+    job_table.open_logs++;
+    return log;
+}
+
+// Close a log's descriptors; its memory goes with the job's arena
+void job_log_free(struct job_log *log) {
+    if (log->fd >= 0) {
+        job_log_close(log);
+    }
+    if (log->spill_fd >= 0) {
+        close(log->spill_fd);
+    }
+}
+
+// Write out everything kept: the spilled output, a marker for any gap,
+// then the ring
+void job_log_print(struct job_log *log, FILE *out) {
+    char buf[CAPTURE_READ_SIZE];
+
+    if (log->fd >= 0) {
+        job_log_drain(log->fd, 0, log); // Pick up what hasn't been read yet
+    }
+    for (size_t off = 0; off < log->spilled;) {
+        ssize_t n = pread(log->spill_fd, buf, sizeof(buf), off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        fwrite(buf, 1, n, out);
+        off += n;
+    }
+    if (log->dropped > 0) {
+        fprintf(out, "\n[... %llu bytes not kept ...]\n", (unsigned long long)log->dropped);
+    }
+    size_t start = log->tail & (JOBLOG_RING_SIZE - 1);
+    size_t used = log->head - log->tail;
+    size_t first = used < JOBLOG_RING_SIZE - start ? used : JOBLOG_RING_SIZE - start;
+    fwrite(log->ring + start, 1, first, out);
+    fwrite(log->ring, 1, used - first, out);
+}
+
+// Record what wait4 reported about one of a job's processes
+void job_proc_update(struct job_proc *proc, int status, const struct rusage *ru) {
+    trace_wait_status(proc->pid, status, ru);
+    proc->status = status;
+    if (WIFSTOPPED(status)) {
+        proc->state = JOB_STOPPED;
+    } else if (WIFCONTINUED(status)) {
+        proc->state = JOB_RUNNING;
+    } else {
+        proc->state = JOB_DONE;
+        proc->ru = *ru;
+    }
+}
+
+// The state of a job as a whole: running while any process runs,
+// stopped once the rest have stopped (or exited), done when all exited
+int job_procs_state(const struct job_proc *procs, int n) {
+    int state = JOB_DONE;
+
+    for (int i = 0; i < n; i++) {
+        if (procs[i].state == JOB_RUNNING) {
+            return JOB_RUNNING;
+        }
+        if (procs[i].state == JOB_STOPPED) {
+            state = JOB_STOPPED;
+        }
+    }
+    return state;
+}
+
+// The wait status of a finished pipeline: its last command's, or with
+// 'set -o pipefail' that of the last command that failed
+int pipeline_status(const struct job_proc *procs, int n) {
+    if (opt_pipefail) {
+        for (int i = n - 1; i >= 0; i--) {
+            if (status_to_exit_code(procs[i].status) != 0) {
+                return procs[i].status;
+            }
+        }
+    }
+    return procs[n - 1].status;
+}
+
+// The terminal signals a guarded job's Ctrl+C, Ctrl+\ and Ctrl+Z
+// arrive as
+void signal_guard_mask(sigset_t *mask) {
+    sigemptyset(mask);
+    sigaddset(mask, SIGINT);
+    sigaddset(mask, SIGQUIT);
+    sigaddset(mask, SIGTSTP);
+}
+
+// One of those signals while a guarded job runs: Ctrl+C is translated
+// per the job's policy, the others go on to its process group
+void signal_guard_signal(int fd, uint32_t events, void *data) {
+    struct signal_guard *guard = data;
+    struct signalfd_siginfo si;
+    (void)events;
+
+    while (read(fd, &si, sizeof(si)) == sizeof(si)) {
+        if (guard->policy == NULL) {
+            continue; // Arrived as the job finished
+        }
+        if (si.ssi_signo != SIGINT) {
+            kill(-guard->pgid, si.ssi_signo);
+            continue;
+        }
+        guard->presses++;
+        if (guard->policy->action == SIGPOLICY_IGNORE) {
+            output_printf("\n[Shell] Ctrl+C ignored: process %d is protected\n", guard->leader);
+        } else if (guard->policy->action == SIGPOLICY_LEADER) {
+            kill(guard->leader, SIGINT);
+        } else if (guard->presses > 1) {
+            timerfd_settime(guard->timer_fd, 0, &(struct itimerspec){{0, 0}, {0, 0}}, NULL);
+            kill(-guard->pgid, SIGINT);
+        } else if (guard->policy->delay_ms == 0) {
+            kill(-guard->pgid, SIGTERM);
+        } else {
+            int ms = guard->policy->delay_ms;
+            struct itimerspec its = {{0, 0}, {ms / 1000, ms % 1000 * 1000000L}};
+            timerfd_settime(guard->timer_fd, 0, &its, NULL);
+            output_printf("\n[Shell] Sending SIGTERM to process group %d in %d ms (Ctrl+C again to interrupt it now)\n",
+                          guard->pgid, ms);
+        }
+        output_flush();
+    }
+}
+
+// SIGPOLICY_TERM's delay is up
+void signal_guard_timer(int fd, uint32_t events, void *data) {
+    struct signal_guard *guard = data;
+    uint64_t expirations;
+    (void)events;
+
+    if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations) && guard->policy != NULL) {
+        kill(-guard->pgid, SIGTERM);
+    }
+}
+
+// The signal policy 'cmd' runs under in the foreground, or NULL if
+// Ctrl+C should reach it straight from the terminal. Policies only
+// apply with a terminal, whose signals the shell can take over.
+const struct signal_policy *signal_guard_policy(const char *cmd) {
+    const struct signal_policy *policy = signal_policy_find(cmd);
+    struct signal_guard *guard = &signal_guard;
+
+    if (policy == NULL || !isatty(STDIN_FILENO)) {
+        return NULL;
+    }
+    if (guard->sig_fd < 0) {
+        sigset_t mask;
+        signal_guard_mask(&mask);
+        guard->sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (guard->sig_fd < 0) {
+            perror("signalfd failed");
+            return NULL;
+        }
+        guard->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (guard->timer_fd < 0) {
+            perror("timerfd_create failed");
+            close(guard->sig_fd);
+            guard->sig_fd = -1;
+            return NULL;
+        }
+        evloop_add(guard->sig_fd, EPOLLIN | EPOLLET, signal_guard_signal, guard);
+        evloop_add(guard->timer_fd, EPOLLIN, signal_guard_timer, guard);
+    }
+    return policy;
+}
+
+// Act on the terminal's signals for the foreground job 'pgid' (first
+// process 'leader') under 'policy', which signal_guard_policy returned.
+// The job must not have been given the terminal.
+void signal_guard_start(const struct signal_policy *policy, pid_t pgid, pid_t leader) {
+    struct signal_guard *guard = &signal_guard;
+    sigset_t mask;
+
+    signal_guard_mask(&mask);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    jobs_watch_sigchld(); // fg_wait waits in the event loop
+    guard->policy = policy;
+    guard->pgid = pgid;
+    guard->leader = leader;
+    guard->presses = 0;
+
+    if (policy->action == SIGPOLICY_IGNORE) {
+        output_printf("[Shell] Process %d is protected from SIGINT (Ctrl+C won't work)\n", leader);
+    } else if (policy->action == SIGPOLICY_LEADER) {
+        output_printf("[Shell] Ctrl+C interrupts only process %d of process group %d\n", leader, pgid);
+    } else {
+        output_printf("[Shell] Ctrl+C stops process group %d with SIGTERM after %d ms, twice with SIGINT\n",
+                      pgid, policy->delay_ms);
+    }
+    output_flush();
+}
+
+// The guarded job has exited or stopped: give the terminal's signals
+// back to the shell's handlers, dropping any not acted on
+void signal_guard_end(void) {
+    struct signal_guard *guard = &signal_guard;
+    struct signalfd_siginfo si;
+    sigset_t mask;
+
+    if (guard->policy == NULL) {
+        return;
+    }
+    guard->policy = NULL;
+    timerfd_settime(guard->timer_fd, 0, &(struct itimerspec){{0, 0}, {0, 0}}, NULL);
+    while (read(guard->sig_fd, &si, sizeof(si)) == sizeof(si)) {
+        // Pressed as the job finished
+    }
+    signal_guard_mask(&mask);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+}
+
+// Wait until 'fd' is readable, acting on the terminal's signals for the
+// guarded job meanwhile (its output is being captured)
+void signal_guard_wait_fd(int fd) {
+    struct pollfd pfd[2] = {{.fd = fd, .events = POLLIN}, {.fd = evloop.fd, .events = POLLIN}};
+
+    while (poll(pfd, 2, -1) >= 0 || errno == EINTR) {
+        if (pfd[1].revents != 0) {
+            evloop_run_once(0);
+        }
+        if (pfd[0].revents != 0) {
+            return;
+        }
+    }
+}
+
+// Wait for the processes of the foreground job (process group 'pgid')
+// until each has exited or stopped, or with 'any', until one exits.
+// The shell only takes the terminal back in those states: a job with
+// one member stopped and others still running (Ctrl+Z reaches them one
+// by one) is waited for until the rest stop too, and one continued
+// behind the shell's back (WCONTINUED) is running again. Signals
+// arriving meanwhile (e.g. SIGWINCH) only restart the wait. While job
+// logs are open the wait goes through the event loop, so their pipes
+// keep draining and a chatty background job can't fill its pipe and
+// block; so does a guarded job's, whose Ctrl+C the loop acts on.
+// Returns 0, or -1 if there was nothing left to wait for although some
+// were running.
+int fg_wait(struct job_proc *procs, int n, pid_t pgid, int any) {
+    for (;;) {
+        int running = 0;
+        int stopped = 0;
+        for (int i = 0; i < n; i++) {
+            running += procs[i].state == JOB_RUNNING;
+            stopped += procs[i].state == JOB_STOPPED;
+        }
+        if (running == 0) {
+            return 0;
+        }
+
+        int status;
+        struct rusage ru;
+        int in_loop = job_table.open_logs > 0 || signal_guard.policy != NULL;
+        int flags = WUNTRACED | WCONTINUED | (in_loop ? WNOHANG : 0);
+        pid_t pid = wait4(-pgid, &status, flags, &ru);
+        if (pid < 0 && errno == EINTR) {
+            continue;
+        }
+        if (pid < 0) {
+            return -1;
+        }
+        if (pid == 0) {
+            evloop_run_once(-1); // SIGCHLD arrives through job_sigchld
+            continue;
+        }
+
+        struct job_proc *proc = NULL;
+        for (int i = 0; i < n; i++) {
+            if (procs[i].pid == pid) {
+                proc = &procs[i];
+            }
+        }
+        if (proc == NULL) {
+            continue; // A member started earlier (batch runs share a group)
+        }
+        job_proc_update(proc, status, &ru);
+        if (any && stopped == 0 && proc->state == JOB_DONE) {
+            return 0;
+        }
+    }
+}
+
+// Add a job for the processes in 'procs' (process group 'pgid'),
+// numbered one above the highest job number in use. 'command' is the
+// line shown by 'jobs'.
+struct job *job_new(const char *command, pid_t pgid, const struct job_proc *procs, int n) {
+    struct job *job = pool_get(&job_pool);
+    struct job **link = &job_table.head;
+
+    job->id = 1;
+    for (; *link != NULL; link = &(*link)->next) {
+        if ((*link)->id >= job->id) {
+            job->id = (*link)->id + 1;
+        }
+    }
+    *link = job;
+    job->pgid = pgid;
+    job->procs = arena_alloc(&job->arena, n * sizeof(*procs));
+    memcpy(job->procs, procs, n * sizeof(*procs));
+    job->n_procs = n;
+    job->command = arena_strndup(&job->arena, command, strlen(command));
+    job->state = JOB_RUNNING;
+    job->started_ns = monotonic_ns();
+    jobs_watch_sigchld();
+    return job;
+}
+
+// Start a pipeline in the background as a new job. 'command' is the
+// line shown by 'jobs'.
+int job_start(struct pipeline_stage *stages, int n, const char *command) {
+    struct job_proc procs[MAX_PIPELINE_STAGES];
+    int pipefd[2] = {-1, -1};
+
+    jobs_watch_sigchld();
+    if (opt_joblog && pipe2(pipefd, O_CLOEXEC) < 0) {
+        perror("pipe failed");
+        return 1;
+    }
+
+    const int fds[3] = {-1, pipefd[1], pipefd[1]};
+    pid_t pgid = pipeline_spawn(stages, n, 0, fds, procs);
+    if (pipefd[1] >= 0) {
+        close(pipefd[1]);
+    }
+    if (pgid == 0) {
+        if (pipefd[0] >= 0) {
+            close(pipefd[0]);
+        }
+        return status_to_exit_code(pipeline_status(procs, n));
+    }
+
+    struct job *job = job_new(command, pgid, procs, n);
+    if (pipefd[0] >= 0) {
+        job->log = job_log_open(pipefd[0], &job->arena);
+    }
+    output_printf("[%d] %d\n", job->id, pgid);
+    return 0;
+}
+
+void job_free(struct job *job) {
+    if (job->log != NULL) {
+        job_log_free(job->log);
+    }
+    arena_release(&job->arena);
+    pool_put(&job_pool, job);
+}
+
+// Look up a job by "%N" or "N"
+struct job *job_find(const char *spec) {
+    char *end;
+
+    if (spec[0] == '%') {
+        spec++;
+    }
+    long id = strtol(spec, &end, 10);
+    if (*spec == '\0' || *end != '\0') {
+        return NULL;
+    }
+    for (struct job *job = job_table.head; job != NULL; job = job->next) {
+        if (job->id == id) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+void job_state_text(const struct job *job, char *buf, size_t len) {
+    if (job->state == JOB_RUNNING) {
+        snprintf(buf, len, "Running");
+    } else if (job->state == JOB_STOPPED) {
+        snprintf(buf, len, "Stopped");
+    } else if (WIFSIGNALED(job->status)) {
+        snprintf(buf, len, "Signal %d", WTERMSIG(job->status));
+    } else if (status_to_exit_code(job->status) != 0) {
+        snprintf(buf, len, "Exit %d", status_to_exit_code(job->status));
+    } else {
+        snprintf(buf, len, "Done");
+    }
+}
+
+// Queue a line for each job whose state changed since it was last
+// reported; finished jobs also show their run time and CPU times.
+// Finished jobs are forgotten once reported, except that the newest
+// MAX_FINISHED_JOBLOGS with captured output stay around for 'joblog'.
+void jobs_report(void) {
+    int kept_logs = 0;
+    char state[32];
+
+    job_table.changed = 0;
+    for (struct job *job = job_table.head; job != NULL; job = job->next) {
+        if (!job->notified) {
+            job_state_text(job, state, sizeof(state));
+            if (job->state == JOB_DONE) {
+                struct strbuf took = scratch_get();
+                format_duration(&took, job->duration_ns);
+                output_printf("[%d]  %-10s %s  (%s, user %.2fs, sys %.2fs)\n", job->id, state, job->command,
+                              took.data, job->ru.ru_utime.tv_sec + job->ru.ru_utime.tv_usec / 1e6,
+                              job->ru.ru_stime.tv_sec + job->ru.ru_stime.tv_usec / 1e6);
+                scratch_put(&took);
+            } else {
+                output_printf("[%d]  %-10s %s\n", job->id, state, job->command);
+            }
+            job->notified = 1;
+        }
+        if (job->state == JOB_DONE && job->log != NULL) {
+            kept_logs++;
+        }
+    }
+
+    for (struct job **link = &job_table.head; *link != NULL;) {
+        struct job *job = *link;
+        if (job->state == JOB_DONE && (job->log == NULL || kept_logs > MAX_FINISHED_JOBLOGS)) {
+            if (job->log != NULL) {
+                kept_logs--;
+            }
+            *link = job->next;
+            job_free(job);
+        } else {
+            link = &job->next;
+        }
+    }
+}
+
+void serve_send(struct serve_client *client, const void *msg, size_t len) {
+    if (client->fd >= 0 && send(client->fd, msg, len, MSG_NOSIGNAL) < 0) {
+        perror("serve: send failed");
+    }
+}
+
+void serve_client_release(struct serve_client *client) {
+    if (--client->refs == 0) {
+        free(client);
+    }
+}
+
+void serve_request_free(struct serve_request *req) {
+    for (int i = 0; i < 3; i++) {
+        if (req->fds[i] >= 0) {
+            close(req->fds[i]);
+        }
+    }
+    arglist_free(&req->argv);
+    arglist_free(&req->env);
+    free(req->cwd);
+    serve_client_release(req->client);
+    free(req);
+}
+
+// Start a queued request through the normal spawn path and report its
+// PID; the descriptors it was sent are only needed by the child
+void serve_start(struct serve_request *req) {
+    struct spawn_options opts;
+
+    spawn_options_init(&opts);
+    memcpy(opts.fds, req->fds, sizeof(opts.fds));
+    opts.cwd = req->cwd;
+    opts.env = req->env.argv;
+
+    clock_gettime(CLOCK_MONOTONIC, &req->started);
+    int exec_error;
+    int fork_errno;
+    req->pid = spawn_command(req->argv.argv, &opts, &exec_error);
+    fork_errno = errno;
+
+    struct serve_reply reply = {.magic = SERVE_MAGIC, .type = SERVE_STARTED, .id = req->id, .pid = req->pid};
+    if (req->pid < 0 || exec_error != 0) {
+        reply.type = SERVE_FAILED;
+        reply.error = exec_error != 0 ? exec_error : fork_errno;
+        reply.status = exec_error != 0 ? exec_failure_status(exec_error) : 1;
+        serve_send(req->client, &reply, sizeof(reply));
+        serve_request_free(req);
+        return;
+    }
+    serve_send(req->client, &reply, sizeof(reply));
+
+    for (int i = 0; i < 3; i++) {
+        if (req->fds[i] >= 0) {
+            close(req->fds[i]);
+            req->fds[i] = -1;
+        }
+    }
+    req->next = server.running;
+    server.running = req;
+    server.n_running++;
+}
+
+// Fill free slots from the queue, oldest request first
+void serve_dispatch(void) {
+    while (server.queue_head != NULL && server.n_running < server.max_running) {
+        struct serve_request *req = server.queue_head;
+        server.queue_head = req->next;
+        if (server.queue_head == NULL) {
+            server.queue_tail = NULL;
+        }
+        req->next = NULL;
+        serve_start(req);
+    }
+}
+
+// Decode one request datagram: a header, then argv, env and cwd as
+// NUL-terminated strings, with up to three fds in SCM_RIGHTS
+struct serve_request *serve_parse(struct serve_client *client, const char *buf, size_t len,
+                                  int *fds, int n_fds) {
+    struct serve_request_header hdr;
+    struct serve_request *req = calloc(1, sizeof(*req));
+    int fd_i = 0;
+
+    if (req == NULL) {
+        perror("calloc failed");
+        exit(1);
+    }
+    req->fds[0] = req->fds[1] = req->fds[2] = -1;
+    req->client = client;
+    client->refs++;
+
+    if (len < sizeof(hdr)) {
+        return req;
+    }
+    memcpy(&hdr, buf, sizeof(hdr));
+    req->id = hdr.id;
+    for (int i = 0; i < 3; i++) {
+        if ((hdr.fd_mask & (1u << i)) && fd_i < n_fds) {
+            req->fds[i] = fds[fd_i++];
+        }
+    }
+    while (fd_i < n_fds) {
+        close(fds[fd_i++]);
+    }
+    if (hdr.magic != SERVE_MAGIC || hdr.argc == 0) {
+        return req;
+    }
+
+    const char *p = buf + sizeof(hdr);
+    const char *end = buf + len;
+    uint32_t n_strings = hdr.argc + hdr.envc + (hdr.has_cwd ? 1 : 0);
+    for (uint32_t i = 0; i < n_strings; i++) {
+        const char *nul = memchr(p, '\0', end - p);
+        if (nul == NULL) {
+            arglist_free(&req->argv);
+            return req;
+        }
+        if (i < hdr.argc) {
+            arglist_push(&req->argv, p, nul - p);
+        } else if (i < hdr.argc + hdr.envc) {
+            arglist_push(&req->env, p, nul - p);
+        } else {
+            req->cwd = strdup(p);
+        }
+        p = nul + 1;
+    }
+    return req;
+}
+
+void serve_client_close(struct serve_client *client) {
+    evloop_del(client->fd);
+    close(client->fd);
+    client->fd = -1; // Replies to its running requests are dropped
+    serve_client_release(client);
+}
+
+void serve_client_ready(int fd, uint32_t events, void *data) {
+    struct serve_client *client = data;
+    (void)events;
+
+    for (;;) {
+        struct iovec iov = {server.buf, SERVE_MAX_REQUEST};
+        union {
+            char buf[CMSG_SPACE(3 * sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        ssize_t n = recvmsg(fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        if (n <= 0) {
+            serve_client_close(client);
+            return;
+        }
+
+        int fds[3];
+        int n_fds = 0;
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+                int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                for (int i = 0; i < count; i++) {
+                    int received;
+                    memcpy(&received, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+                    if (n_fds < 3) {
+                        fds[n_fds++] = received;
+                    } else {
+                        close(received);
+                    }
+                }
+            }
+        }
+
+        struct serve_request *req = serve_parse(client, server.buf, n, fds, n_fds);
+        if (req->argv.argc == 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+            struct serve_reply reply = {.magic = SERVE_MAGIC, .type = SERVE_FAILED, .id = req->id, .pid = -1};
+            reply.error = EINVAL;
+            serve_send(client, &reply, sizeof(reply));
+            serve_request_free(req);
+            continue;
+        }
+        if (server.queue_tail != NULL) {
+            server.queue_tail->next = req;
+        } else {
+            server.queue_head = req;
+        }
+        server.queue_tail = req;
+        serve_dispatch();
+    }
+}
+
+void serve_accept(int fd, uint32_t events, void *data) {
+    (void)events;
+    (void)data;
+
+    for (;;) {
+        int cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cfd < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                perror("serve: accept failed");
+            }
+            return;
+        }
+        struct serve_client *client = calloc(1, sizeof(*client));
+        if (client == NULL) {
+            perror("calloc failed");
+            exit(1);
+        }
+        client->fd = cfd;
+        client->refs = 1; // Dropped when the connection closes
+        evloop_add(cfd, EPOLLIN, serve_client_ready, client);
+    }
+}
+
+// Reap finished children and send each one's status and rusage
+void serve_sigchld(int fd, uint32_t events, void *data) {
+    struct signalfd_siginfo info;
+    (void)events;
+    (void)data;
+
+    while (read(fd, &info, sizeof(info)) > 0) {
+        // Drain; one wakeup can stand for several exits
+    }
+
+    for (;;) {
+        int status;
+        struct rusage ru;
+        pid_t pid = wait4(-1, &status, WNOHANG, &ru);
+        if (pid <= 0) {
+            break;
+        }
+
+        struct serve_request **link = &server.running;
+        while (*link != NULL && (*link)->pid != pid) {
+            link = &(*link)->next;
+        }
+        struct serve_request *req = *link;
+        if (req == NULL) {
+            continue;
+        }
+        *link = req->next;
+        server.n_running--;
+        trace_wait_status(pid, status, &ru);
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        struct serve_reply reply = {.magic = SERVE_MAGIC, .type = SERVE_EXITED, .id = req->id, .pid = pid};
+        reply.status = status_to_exit_code(status);
+        reply.wall_us = (now.tv_sec - req->started.tv_sec) * 1000000LL +
+                        (now.tv_nsec - req->started.tv_nsec) / 1000;
+        reply.user_us = ru.ru_utime.tv_sec * 1000000LL + ru.ru_utime.tv_usec;
+        reply.sys_us = ru.ru_stime.tv_sec * 1000000LL + ru.ru_stime.tv_usec;
+        reply.maxrss_kb = ru.ru_maxrss;
+        serve_send(req->client, &reply, sizeof(reply));
+        serve_request_free(req);
+    }
+    serve_dispatch();
+}
+
+// Run as a command server on a Unix socket until killed
+int serve_main(const char *path, int max_running) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    sigset_t mask;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "sigshell: socket path too long: %s\n", path);
+        return 2;
+    }
+    strcpy(addr.sun_path, path);
+
+    server.max_running = max_running;
+    server.buf = malloc(SERVE_MAX_REQUEST);
+    if (server.buf == NULL) {
+        perror("malloc failed");
+        return 1;
+    }
+
+    // Children are reaped through a signalfd, and a client vanishing
+    // mid-reply must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    int lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sfd < 0 || lfd < 0) {
+        perror("serve: socket failed");
+        return 1;
+    }
+    unlink(path);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, SOMAXCONN) < 0) {
+        perror("serve: bind failed");
+        return 1;
+    }
+    chmod(path, 0600);
+
+    evloop_add(lfd, EPOLLIN, serve_accept, NULL);
+    evloop_add(sfd, EPOLLIN | EPOLLET, serve_sigchld, NULL);
+    printf("[Shell] Serving on %s (up to %d concurrent commands)\n", path, max_running);
+    fflush(stdout);
+
+    for (;;) {
+        evloop_run_once(-1);
+    }
+}
+
+int builtin_exit(char **args, FILE *out) {
+    (void)args;
+    fprintf(out, "Goodbye!\n");
+    exit_requested = 1;
+    return 0;
+}
+
+int builtin_help(char **args, FILE *out) {
+    (void)args;
+    fprintf(out, "\n=== Custom Signal Handling Shell ===\n");
+    fprintf(out, "Features:\n");
+    fprintf(out, "  - Ctrl+C in shell shows message instead of exiting\n");
+    fprintf(out, "  - 'sleep' commands ignore Ctrl+C (SIGINT protected; see 'sigpolicy')\n");
+    fprintf(out, "  - Ctrl+Z suspends process directly (proper job control set up)\n");
+    fprintf(out, "  - $(cmd) and `cmd` substitution (builtins run without forking)\n");
+    fprintf(out, "  - Pathname expansion with *, ?, [...] and **\n");
+    fprintf(out, "  - <<WORD here-documents and <(cmd) / >(cmd) process substitution\n");
+    fprintf(out, "  - Pipelines (cmd | cmd ...), run as one process group\n");
+    fprintf(out, "  - Line editing: arrows, Ctrl+A/E/K/U/W/L, Up/Down history, Ctrl+R search\n");
+    fprintf(out, "  - Tab completion of commands (indexed from $PATH) and file names\n");
+    fprintf(out, "\nBuilt-in commands:\n");
+    fprintf(out, "  help     - Show this help message\n");
+    fprintf(out, "  exit     - Exit the shell\n");
+    fprintf(out, "  cd [dir] - Change directory (- for the previous one, $CDPATH searched)\n");
+    fprintf(out, "  pwd      - Print the current directory (-P resolves symlinks)\n");
+    fprintf(out, "  pushd    - Change directory, saving the current one (+N rotates)\n");
+    fprintf(out, "  popd     - Return to the directory saved by pushd (+N drops one)\n");
+    fprintf(out, "  dirs     - Show the directory stack (-v numbered, -c clears)\n");
+    fprintf(out, "  z        - Jump to a frequently used directory (-l lists, -x forgets)\n");
+    fprintf(out, "  echo     - Print arguments (-n: no newline)\n");
+    fprintf(out, "  stats    - Show command substitution and allocator statistics\n");
+    fprintf(out, "  set      - List options, or toggle with -o/+o NAME\n");
+    fprintf(out, "  history  - Show history ([N] last entries, -s TEXT to search)\n");
+    fprintf(out, "  trace    - Record execution events (start FILE, stop, export FILE JSON)\n");
+    fprintf(out, "  perf     - Show shell latency percentiles ('perf reset' clears them)\n");
+    fprintf(out, "  hash     - Show remembered command paths (-r forgets them)\n");
+    fprintf(out, "  prompt   - Show or set the prompt (%%~ %%/ %%. cwd, %%? status, %%D time, %%j jobs, %%g git)\n");
+    fprintf(out, "  jobs     - List background jobs (started with a trailing &)\n");
+    fprintf(out, "  joblog   - Show a job's captured output (%%N; needs 'set -o joblog')\n");
+    fprintf(out, "  pipestatus - Show the exit status of each command of the last pipeline\n");
+    fprintf(out, "  sigpolicy [NAME ignore|leader|term [MS]|default] - What Ctrl+C does to a command\n");
+    fprintf(out, "  snapshot FILE - Save options, prompt, directories and $PATH lookups for --restore\n");
+    fprintf(out, "  batch    - Run a command over many arguments in ARG_MAX-sized runs (-P N parallel)\n");
+    fprintf(out, "  cat, head, tee, cp - Copy data in the kernel (splice, sendfile, copy_file_range)\n");
+    fprintf(out, "\nTry these:\n");
+    fprintf(out, "  sleep 10     - Try pressing Ctrl+C (won't work!)\n");
+    fprintf(out, "  ls -la       - Try pressing Ctrl+C (will work)\n");
+    fprintf(out, "  cat          - Try pressing Ctrl+Z (will suspend)\n");
+    fprintf(out, "\n");
+    return 0;
+}
+
+int builtin_cd(char **args, FILE *out) {
+    int physical = 0;
+    int i = 1;
+
+    for (; args[i] != NULL && (strcmp(args[i], "-P") == 0 || strcmp(args[i], "-L") == 0); i++) {
+        physical = args[i][1] == 'P';
+    }
+    const char *dir = args[i];
+    if (dir != NULL && args[i + 1] != NULL) {
+        fprintf(stderr, "cd: too many arguments\n");
+        return 1;
+    }
+
+    if (dir == NULL) {
+        dir = getenv("HOME");
+        if (dir == NULL) {
+            fprintf(stderr, "cd: HOME not set\n");
+            return 1;
+        }
+    } else if (strcmp(dir, "-") == 0) {
+        if (dirs.oldpwd == NULL) {
+            fprintf(stderr, "cd: OLDPWD not set\n");
+            return 1;
+        }
+        char *oldpwd = strdup(dirs.oldpwd);
+        int status = dirs_chdir(oldpwd, physical, "cd");
+        free(oldpwd);
+        if (status == 0) {
+            fprintf(out, "%s\n", dirs.pwd);
+        }
+        return status;
+    } else if (dir[0] != '/' && strcmp(dir, ".") != 0 && strcmp(dir, "..") != 0 &&
+               strncmp(dir, "./", 2) != 0 && strncmp(dir, "../", 3) != 0) {
+        // Relative names are looked up along $CDPATH first
+        const char *cdpath = getenv("CDPATH");
+        for (const char *p = cdpath; p != NULL && *p != '\0';) {
+            size_t len = strcspn(p, ":");
+            struct strbuf candidate = {0};
+            struct stat st;
+            strbuf_append(&candidate, len ? p : ".", len ? len : 1);
+            strbuf_putc(&candidate, '/');
+            strbuf_append(&candidate, dir, strlen(dir));
+            if (stat(candidate.data, &st) == 0 && S_ISDIR(st.st_mode)) {
+                int status = dirs_chdir(candidate.data, physical, "cd");
+                strbuf_free(&candidate);
+                if (status == 0 && len > 0) {
+                    fprintf(out, "%s\n", dirs.pwd);
+                }
+                return status;
+            }
+            strbuf_free(&candidate);
+            p += len;
+            if (*p == ':') {
+                p++;
+            }
+        }
+    }
+    return dirs_chdir(dir, physical, "cd");
+}
+
+// The logical directory is tracked by cd, so this never asks the kernel
+// unless -P wants symlinks resolved
+int builtin_pwd(char **args, FILE *out) {
+    if (args[1] != NULL && strcmp(args[1], "-P") == 0) {
+        char cwd[4096];
+        if (getcwd(cwd, sizeof(cwd)) == NULL) {
+            perror("pwd failed");
+            return 1;
+        }
+        fprintf(out, "%s\n", cwd);
+        return 0;
+    }
+    fprintf(out, "%s\n", dirs.pwd);
+    return 0;
+}
+
+int builtin_echo(char **args, FILE *out) {
+    int i = 1;
+    int newline = 1;
+
+    if (args[1] != NULL && strcmp(args[1], "-n") == 0) {
+        newline = 0;
+        i++;
+    }
+    for (; args[i] != NULL; i++) {
+        fprintf(out, "%s%s", args[i], args[i + 1] != NULL ? " " : "");
+    }
+    if (newline) {
+        fputc('\n', out);
+    }
+    return 0;
+}
+
+int builtin_stats(char **args, FILE *out) {
+    (void)args;
+    fprintf(out, "Command substitutions: %lu (in-process: %lu, forked: %lu)\n",
+            subst_stats.total, subst_stats.in_process, subst_stats.forked);
+    if (subst_stats.n_forked_cmds > 0) {
+        fprintf(out, "Forked substitutions:\n");
+        for (int i = 0; i < subst_stats.n_forked_cmds; i++) {
+            fprintf(out, "  %6lu  %s\n", subst_stats.forked_cmds[i].count,
+                    subst_stats.forked_cmds[i].body);
+        }
+    }
+    fprintf(out, "Terminal writes: %lu (carrying %lu status messages)\n", shell_out.writes, shell_out.messages);
+    fprintf(out, "Arena chunks: %lu allocated (%zu KiB), %lu reused; job records: %lu of %lu in use\n",
+            alloc_stats.chunk_mallocs, alloc_stats.chunk_bytes / 1024, alloc_stats.chunk_reuses,
+            job_pool.in_use, job_pool.capacity);
+    return 0;
+}
+
+int builtin_set(char **args, FILE *out) {
+    if (args[1] == NULL) {
+        for (int i = 0; shell_options[i].name != NULL; i++) {
+            fprintf(out, "%-12s %-3s  %s\n", shell_options[i].name,
+                    *shell_options[i].value ? "on" : "off", shell_options[i].description);
+        }
+        return 0;
+    }
+
+    for (int i = 1; args[i] != NULL; i++) {
+        int enable;
+        if (strcmp(args[i], "-b") == 0 || strcmp(args[i], "+b") == 0) {
+            opt_notify = args[i][0] == '-'; // Short for -o notify
+            continue;
+        }
+        if (strcmp(args[i], "-o") == 0) {
+            enable = 1;
+        } else if (strcmp(args[i], "+o") == 0) {
+            enable = 0;
+        } else {
+            fprintf(stderr, "set: usage: set [-b|+b] [-o|+o option]...\n");
+            return 2;
+        }
+        if (args[++i] == NULL) {
+            fprintf(stderr, "set: option name required\n");
+            return 2;
+        }
+        int found = 0;
+        for (int j = 0; shell_options[j].name != NULL; j++) {
+            if (strcmp(args[i], shell_options[j].name) == 0) {
+                *shell_options[j].value = enable;
+                found = 1;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "set: %s: invalid option name\n", args[i]);
+            return 2;
+        }
+    }
+    glob_cache_clear();
+    return 0;
+}
+
+int builtin_history(char **args, FILE *out) {
+    size_t n = history_count();
+
+    if (args[1] != NULL && strcmp(args[1], "-s") == 0) {
+        if (args[2] == NULL) {
+            fprintf(stderr, "history: -s requires a search string\n");
+            return 2;
+        }
+        // Newest match first
+        for (long id = history_search(args[2], n); id >= 0; id = history_search(args[2], id)) {
+            const struct history_entry *e = history_get(id);
+            fprintf(out, "%6ld  %.*s\n", id + 1, (int)e->len, e->text);
+        }
+        return 0;
+    }
+
+    size_t first = 0;
+    if (args[1] != NULL) {
+        char *end;
+        long count = strtol(args[1], &end, 10);
+        if (*end != '\0' || count < 0) {
+            fprintf(stderr, "history: usage: history [N] | history -s TEXT\n");
+            return 2;
+        }
+        if ((size_t)count < n) {
+            first = n - count;
+        }
+    }
+    for (size_t id = first; id < n; id++) {
+        const struct history_entry *e = history_get(id);
+        fprintf(out, "%6zu  %.*s\n", id + 1, (int)e->len, e->text);
+    }
+    return 0;
+}
+
+int builtin_trace(char **args, FILE *out) {
+    if (args[1] == NULL) {
+        fprintf(out, "Tracing is %s\n", trace_enabled ? "on" : "off");
+        return 0;
+    }
+    if (strcmp(args[1], "start") == 0 && args[2] != NULL) {
+        return trace_start(args[2]);
+    }
+    if (strcmp(args[1], "stop") == 0) {
+        trace_stop();
+        return 0;
+    }
+    if (strcmp(args[1], "export") == 0 && args[2] != NULL && args[3] != NULL) {
+        return trace_export(args[2], args[3]);
+    }
+    fprintf(stderr, "trace: usage: trace [start FILE | stop | export FILE JSON]\n");
+    return 2;
+}
+
+int builtin_perf(char **args, FILE *out) {
+    if (args[1] != NULL && strcmp(args[1], "reset") == 0) {
+        for (int i = 0; i < LAT_COUNT; i++) {
+            const char *name = latency[i].name;
+            memset(&latency[i], 0, sizeof(latency[i]));
+            latency[i].name = name;
+        }
+        return 0;
+    }
+    if (args[1] != NULL) {
+        fprintf(stderr, "perf: usage: perf [reset]\n");
+        return 2;
+    }
+
+    fprintf(out, "%-16s %8s %9s %9s %9s %9s %9s %9s\n", "latency (us)", "count",
+            "min", "p50", "p90", "p99", "p99.9", "max");
+    for (int i = 0; i < LAT_COUNT; i++) {
+        const struct latency_histogram *h = &latency[i];
+        fprintf(out, "%-16s %8llu", h->name, (unsigned long long)h->total);
+        if (h->total == 0) {
+            fprintf(out, "\n");
+            continue;
+        }
+        fprintf(out, " %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", h->min / 1000.0,
+                histogram_percentile(h, 50) / 1000.0, histogram_percentile(h, 90) / 1000.0,
+                histogram_percentile(h, 99) / 1000.0, histogram_percentile(h, 99.9) / 1000.0,
+                h->max / 1000.0);
+    }
+    return 0;
+}
+
+int builtin_hash(char **args, FILE *out) {
+    if (args[1] != NULL && strcmp(args[1], "-r") == 0) {
+        path_cache_clear();
+        return 0;
+    }
+    if (args[1] != NULL) {
+        // Resolve (and remember) the given names
+        int status = 0;
+        for (int i = 1; args[i] != NULL; i++) {
+            int cached;
+            if (resolve_command(args[i], NULL, &cached) == NULL) {
+                fprintf(stderr, "hash: %s: not found\n", args[i]);
+                status = 1;
+            }
+        }
+        return status;
+    }
+
+    fprintf(out, "%6s  %s\n", "hits", "command");
+    for (int i = 0; i < PATH_CACHE_BUCKETS; i++) {
+        for (struct path_cache_entry *e = path_cache.buckets[i]; e != NULL; e = e->next) {
+            fprintf(out, "%6lu  %s\n", e->hits, e->path);
+        }
+    }
+    return 0;
+}
+
+// Show or set the prompt format. Escapes:
+//   %~  working directory, with $HOME shown as ~    %/  full directory
+//   %.  last component of the directory             %?  last exit status
+//   %D  duration of the last command                %j  number of jobs
+//   %%  a literal %
+//   %g  "(branch)" inside a git work tree, "(branch*)" once a background
+//       'git status' has found uncommitted changes
+int builtin_prompt(char **args, FILE *out) {
+    if (args[1] == NULL) {
+        fprintf(out, "%s\n", prompt.format);
+        return 0;
+    }
+    if (args[2] != NULL) {
+        fprintf(stderr, "prompt: usage: prompt [FORMAT]\n");
+        return 2;
+    }
+    free(prompt.format);
+    prompt.format = strdup(args[1]);
+    return 0;
+}
+
+// pushd DIR: change to DIR, remembering the current directory.
+// pushd: swap the top two entries. pushd +N: rotate entry N to the top.
+int builtin_pushd(char **args, FILE *out) {
+    char *prev = strdup(dirs.pwd);
+
+    if (args[1] == NULL || dirs_index(args[1]) >= 0) {
+        int n = args[1] != NULL ? dirs_index(args[1]) : 1;
+        if (dirs.stack.argc == 0) {
+            fprintf(stderr, "pushd: no other directory\n");
+            free(prev);
+            return 1;
+        }
+        if (n > dirs.stack.argc) {
+            fprintf(stderr, "pushd: %s: directory stack index out of range\n", args[1]);
+            free(prev);
+            return 1;
+        }
+        if (n == 0) {
+            free(prev);
+            dirs_print(out, 0, 0);
+            return 0;
+        }
+        if (args[1] == NULL) {
+            // Swap: the old current directory takes the top's place
+            char *target = dirs.stack.argv[dirs.stack.argc - 1];
+            if (dirs_chdir(target, 0, "pushd") != 0) {
+                free(prev);
+                return 1;
+            }
+            dirs.stack.argv[dirs.stack.argc - 1] = prev;
+            free(target);
+            dirs_print(out, 0, 0);
+            return 0;
+        }
+        // The full list is pwd followed by the stack from the top;
+        // rotating left by n makes entry n current
+        char *target = strdup(dirs.stack.argv[dirs.stack.argc - n]);
+        if (dirs_chdir(target, 0, "pushd") != 0) {
+            free(target);
+            free(prev);
+            return 1;
+        }
+        free(target);
+        int total = dirs.stack.argc + 1;
+        char **list = malloc(total * sizeof(char *));
+        if (list == NULL) {
+            perror("malloc failed");
+            exit(1);
+        }
+        list[0] = prev;
+        for (int i = 1; i < total; i++) {
+            list[i] = dirs.stack.argv[dirs.stack.argc - i];
+        }
+        // New stack, top first: entries n+1 .. total-1, then 0 .. n-1
+        int k = dirs.stack.argc;
+        for (int i = 1; i < total; i++) {
+            dirs.stack.argv[--k] = list[(n + i) % total];
+        }
+        free(list[n]);
+        free(list);
+        dirs_print(out, 0, 0);
+        return 0;
+    }
+
+    if (dirs_chdir(args[1], 0, "pushd") != 0) {
+        free(prev);
+        return 1;
+    }
+    arglist_push(&dirs.stack, prev, strlen(prev));
+    free(prev);
+    dirs_print(out, 0, 0);
+    return 0;
+}
+
+// popd: return to the directory on top of the stack. popd +N: drop
+// entry N without changing directory (N=0 is the current one).
+int builtin_popd(char **args, FILE *out) {
+    int n = args[1] != NULL ? dirs_index(args[1]) : 0;
+
+    if (n < 0) {
+        fprintf(stderr, "popd: usage: popd [+N]\n");
+        return 2;
+    }
+    if (dirs.stack.argc == 0) {
+        fprintf(stderr, "popd: directory stack empty\n");
+        return 1;
+    }
+    if (n > dirs.stack.argc) {
+        fprintf(stderr, "popd: %s: directory stack index out of range\n", args[1]);
+        return 1;
+    }
+    if (n > 0) {
+        dirs_stack_remove(dirs.stack.argc - n);
+    } else {
+        char *target = strdup(dirs.stack.argv[dirs.stack.argc - 1]);
+        int status = dirs_chdir(target, 0, "popd");
+        free(target);
+        if (status != 0) {
+            return status;
+        }
+        dirs_stack_remove(dirs.stack.argc - 1);
+    }
+    dirs_print(out, 0, 0);
+    return 0;
+}
+
+int builtin_dirs(char **args, FILE *out) {
+    int verbose = 0, long_form = 0;
+
+    for (int i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-c") == 0) {
+            while (dirs.stack.argc > 0) {
+                dirs_stack_remove(dirs.stack.argc - 1);
+            }
+            return 0;
+        } else if (strcmp(args[i], "-v") == 0) {
+            verbose = 1;
+        } else if (strcmp(args[i], "-l") == 0) {
+            long_form = 1;
+        } else {
+            fprintf(stderr, "dirs: usage: dirs [-c] [-v] [-l]\n");
+            return 2;
+        }
+    }
+    dirs_print(out, verbose, long_form);
+    return 0;
+}
+
+// z WORDS: jump to the most frecent directory matching WORDS.
+// z -l [WORDS]: list the matches with their scores. z -x: forget the
+// current directory.
+int builtin_z(char **args, FILE *out) {
+    int list = 0;
+    char **words = args + 1;
+
+    zdb_load();
+    if (words[0] != NULL && strcmp(words[0], "-x") == 0) {
+        for (int i = 0; i < zdb.count; i++) {
+            if (strcmp(zdb.entries[i].path, dirs.pwd) == 0) {
+                free(zdb.entries[i].path);
+                zdb.entries[i] = zdb.entries[--zdb.count];
+                zdb_save();
+                return 0;
+            }
+        }
+        return 1;
+    }
+    if (words[0] != NULL && strcmp(words[0], "-l") == 0) {
+        list = 1;
+        words++;
+    }
+    if (words[0] == NULL) {
+        list = 1;
+    }
+
+    int ignore_case = 1;
+    for (int i = 0; words[i] != NULL; i++) {
+        for (const char *c = words[i]; *c != '\0'; c++) {
+            if (*c >= 'A' && *c <= 'Z') {
+                ignore_case = 0;
+            }
+        }
+    }
+
+    time_t now = time(NULL);
+    if (list) {
+        // Sorted by score, lowest first so the best ends up nearest the prompt
+        int n = 0;
+        int *order = malloc((zdb.count + 1) * sizeof(int));
+        if (order == NULL) {
+            perror("malloc failed");
+            exit(1);
+        }
+        for (int i = 0; i < zdb.count; i++) {
+            if (zdb_match(&zdb.entries[i], words, ignore_case)) {
+                int j = n++;
+                double score = zdb_score(&zdb.entries[i], now);
+                while (j > 0 && zdb_score(&zdb.entries[order[j - 1]], now) > score) {
+                    order[j] = order[j - 1];
+                    j--;
+                }
+                order[j] = i;
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            fprintf(out, "%-10.1f %s\n", zdb_score(&zdb.entries[order[i]], now), zdb.entries[order[i]].path);
+        }
+        free(order);
+        return n > 0 ? 0 : 1;
+    }
+
+    // Best match that still exists; vanished directories are dropped
+    for (;;) {
+        int best = -1;
+        double best_score = 0;
+        for (int i = 0; i < zdb.count; i++) {
+            const struct zdb_entry *e = &zdb.entries[i];
+            if (strcmp(e->path, dirs.pwd) == 0 || !zdb_match(e, words, ignore_case)) {
+                continue;
+            }
+            double score = zdb_score(e, now);
+            if (best < 0 || score > best_score) {
+                best = i;
+                best_score = score;
+            }
+        }
+        if (best < 0) {
+            fprintf(stderr, "z: no match\n");
+            return 1;
+        }
+        struct stat st;
+        if (stat(zdb.entries[best].path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            char *target = strdup(zdb.entries[best].path);
+            int status = dirs_chdir(target, 0, "z");
+            free(target);
+            return status;
+        }
+        free(zdb.entries[best].path);
+        zdb.entries[best] = zdb.entries[--zdb.count];
+        zdb_save();
+    }
+}
+
+int builtin_jobs(char **args, FILE *out) {
+    char state[32];
+    (void)args;
+
+    for (struct job *job = job_table.head; job != NULL; job = job->next) {
+        job_state_text(job, state, sizeof(state));
+        fprintf(out, "[%d]  %-7d %-10s %s%s\n", job->id, job->pgid, state, job->command,
+                job->log != NULL ? "  (logged)" : "");
+    }
+    return 0;
+}
+
+// snapshot FILE: save the shell's state for 'sigshell --restore FILE'
+int builtin_snapshot(char **args, FILE *out) {
+    (void)out;
+
+    if (args[1] == NULL || args[2] != NULL) {
+        fprintf(stderr, "snapshot: usage: snapshot FILE\n");
+        return 2;
+    }
+    return snapshot_save(args[1]);
 }
 
-// Parse command line into arguments
-int parse_command(char *cmd, char **args) {
-    int i = 0;
-    // Use strsep for safer tokenization if required, but strtok is fine for this example.
-    char *token = strtok(cmd, " \t\n");
-    
-    while (token != NULL && i < MAX_ARGS - 1) {
-        args[i++] = token;
-        token = strtok(NULL, " \t\n");
+// pipestatus: the exit status of each command of the last foreground
+// pipeline (just one for a simple command), like bash's $PIPESTATUS
+int builtin_pipestatus(char **args, FILE *out) {
+    (void)args;
+
+    for (int i = 0; i < n_pipe_status; i++) {
+        fprintf(out, i > 0 ? " %d" : "%d", pipe_status[i]);
     }
-    args[i] = NULL;
-    return i;
+    fputc('\n', out);
+    return 0;
 }
 
-// Check if command should have SIGINT protection
-int should_protect_sigint(char *cmd) {
-    const char *protected[] = {"sleep", "critical", NULL};
-    
-    for (int i = 0; protected[i] != NULL; i++) {
-        if (strcmp(cmd, protected[i]) == 0) {
+// sigpolicy: list the signal translation table. sigpolicy NAME
+// ignore|leader|term [MS]|default: set what Ctrl+C does to a
+// foreground NAME ('default' lets the terminal's SIGINT through).
+int builtin_sigpolicy(char **args, FILE *out) {
+    static const char *const actions[] = {NULL, "ignore", "leader", "term"};
+
+    if (args[1] == NULL) {
+        for (int i = 0; i < n_signal_policies; i++) {
+            const struct signal_policy *policy = &signal_policies[i];
+            fprintf(out, "%s\t%s", policy->name, actions[policy->action]);
+            if (policy->action == SIGPOLICY_TERM) {
+                fprintf(out, " %d", policy->delay_ms);
+            }
+            fputc('\n', out);
+        }
+        return 0;
+    }
+
+    int action = 0;
+    int delay_ms = SIGPOLICY_TERM_DELAY_MS;
+    int usage = args[2] == NULL || strlen(args[1]) >= sizeof(signal_policies[0].name);
+    for (int i = 1; i < 4 && !usage; i++) {
+        if (strcmp(args[2], actions[i]) == 0) {
+            action = i;
+        }
+    }
+    if (!usage && action == 0) {
+        usage = strcmp(args[2], "default") != 0;
+    }
+    if (!usage && args[3] != NULL) {
+        char *end;
+        delay_ms = strtol(args[3], &end, 10);
+        usage = action != SIGPOLICY_TERM || end == args[3] || *end != '\0' || delay_ms < 0 ||
+                args[4] != NULL;
+    }
+    if (usage) {
+        fprintf(stderr, "sigpolicy: usage: sigpolicy [NAME ignore|leader|term [MS]|default]\n");
+        return 2;
+    }
+
+    struct signal_policy *policy = signal_policy_find(args[1]);
+    if (action == 0) {
+        if (policy != NULL) {
+            *policy = signal_policies[--n_signal_policies];
+        }
+        return 0;
+    }
+    if (policy == NULL) {
+        if (n_signal_policies == MAX_SIGNAL_POLICIES) {
+            fprintf(stderr, "sigpolicy: table full (%d commands)\n", MAX_SIGNAL_POLICIES);
             return 1;
         }
+        policy = &signal_policies[n_signal_policies++];
+        strcpy(policy->name, args[1]);
     }
+    policy->action = action;
+    policy->delay_ms = delay_ms;
     return 0;
 }
 
-// Execute a command
-void execute_command(char **args, int protect_sigint) {
-    pid_t pid;
-    
-    // Check if the shell is interactive (has a controlling terminal)
-    if (isatty(STDIN_FILENO)) {
-        // Create a new process group for the child before forking
-        // This is the ideal place to do setpgid(-1, 0)
-        // For simplicity here, we'll set it in the child using setpgid(0, 0)
+// joblog: list the jobs whose output is being captured ('set -o
+// joblog'). joblog %N: print what job N has written so far.
+int builtin_joblog(char **args, FILE *out) {
+    if (args[1] == NULL) {
+        char state[32];
+        for (struct job *job = job_table.head; job != NULL; job = job->next) {
+            if (job->log == NULL) {
+                continue;
+            }
+            struct job_log *log = job->log;
+            job_state_text(job, state, sizeof(state));
+            fprintf(out, "[%d]  %-10s %10llu bytes  %s\n", job->id, state,
+                    (unsigned long long)(log->spilled + log->dropped + (log->head - log->tail)), job->command);
+        }
+        return 0;
+    }
+    if (args[2] != NULL) {
+        fprintf(stderr, "joblog: usage: joblog [%%N]\n");
+        return 2;
+    }
+    struct job *job = job_find(args[1]);
+    if (job == NULL) {
+        fprintf(stderr, "joblog: %s: no such job\n", args[1]);
+        return 1;
+    }
+    if (job->log == NULL) {
+        fprintf(stderr, "joblog: %s: output was not captured (see 'set -o joblog')\n", args[1]);
+        return 1;
     }
+    job_log_print(job->log, out);
+    return 0;
+}
 
-    pid = fork();
-    
-    if (pid < 0) {
-        perror("fork failed");
-        return;
+// batch [-P JOBS] [-n MAX] [-k KEEP] COMMAND [ARG...]: run COMMAND with
+// the ARGs split into as few runs as fit in ARG_MAX, like xargs. The
+// first KEEP ARGs (by default the options, plus chmod's mode and the
+// like) are repeated in every run; -P runs up to JOBS at once and -n
+// passes at most MAX items per run.
+int builtin_batch(char **args, FILE *out) {
+    int parallel = 1, max_items = 0, keep = -1;
+    int i = 1;
+    (void)out;
+
+    for (; args[i] != NULL && args[i][0] == '-' && args[i + 1] != NULL; i += 2) {
+        char *end;
+        long value = strtol(args[i + 1], &end, 10);
+        if (*end != '\0' || value < 0 || strlen(args[i]) != 2 || strchr("Pnk", args[i][1]) == NULL) {
+            break;
+        }
+        if (args[i][1] == 'P') {
+            parallel = value > 0 ? value : sysconf(_SC_NPROCESSORS_ONLN);
+        } else if (args[i][1] == 'n') {
+            max_items = value;
+        } else {
+            keep = value;
+        }
     }
-    
-    if (pid == 0) {
-        // Child process
-        
-        // 1. Give the child process its own process group
-        setpgid(0, 0); 
-        
-        // 2. Setup signal handling for the child
-        struct sigaction sa;
-        
-        // Restore default SIGTSTP behavior for child
-        sa.sa_handler = SIG_DFL;
-        sigemptyset(&sa.sa_mask);
-        sa.sa_flags = 0;
-        sigaction(SIGTSTP, &sa, NULL);
-
-        // Handle SIGINT protection
-        if (protect_sigint) {
-            // Make child ignore SIGINT
-            sa.sa_handler = SIG_IGN;
-            sigaction(SIGINT, &sa, NULL);
-            printf("[Child] This process will ignore Ctrl+C (PID: %d)\n", getpid());
+    if (args[i] == NULL || (args[i][0] == '-' && args[i][1] != '\0')) {
+        fprintf(stderr, "batch: usage: batch [-P JOBS] [-n MAX] [-k KEEP] COMMAND [ARG...]\n");
+        return 2;
+    }
+
+    char **cmd = args + i;
+    int fixed = batch_fixed_args(cmd, 1);
+    if (keep >= 0) {
+        fixed = 1;
+        while (fixed <= keep && cmd[fixed] != NULL) {
+            fixed++;
+        }
+    }
+    if (cmd[fixed] == NULL) {
+        return execute_command(cmd, signal_guard_policy(cmd[0]), NULL);
+    }
+    fflush(stdout);
+    return batch_run(cmd, fixed, parallel, max_items);
+}
+
+int n_args(char **args) {
+    int n = 0;
+
+    while (args[n] != NULL) {
+        n++;
+    }
+    return n;
+}
+
+int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Move up to 'limit' bytes (-1: until EOF) from 'in' to 'out' without
+// passing them through userspace where the kernel allows it:
+// copy_file_range between regular files, splice when either end is a
+// pipe, sendfile from a regular file to anything else. Each falls back
+// to the next (and finally to read/write through a large buffer) if the
+// kernel refuses the pair of files. Stops if Ctrl+C is pressed. Returns
+// 0, or -1 with errno set.
+int copy_fd(int in, int out, long long limit) {
+    enum { COPY_RANGE, COPY_SENDFILE, COPY_SPLICE, COPY_RW };
+    struct stat ist, ost;
+    char *buf = NULL;
+    long long done = 0;
+    int method = COPY_RW;
+    int result = 0;
+
+    if (fstat(in, &ist) == 0 && fstat(out, &ost) == 0) {
+        if (S_ISFIFO(ist.st_mode) || S_ISFIFO(ost.st_mode)) {
+            method = COPY_SPLICE;
+        } else if (S_ISREG(ist.st_mode)) {
+            method = S_ISREG(ost.st_mode) ? COPY_RANGE : COPY_SENDFILE;
+        }
+    }
+    while (limit < 0 || done < limit) {
+        if (sigint_received) {
+            errno = EINTR;
+            result = -1;
+            break;
+        }
+        size_t want = COPY_CHUNK_SIZE;
+        if (limit >= 0 && limit - done < (long long)want) {
+            want = limit - done;
+        }
+        ssize_t n;
+        switch (method) {
+        case COPY_RANGE:
+            n = copy_file_range(in, NULL, out, NULL, want, 0);
+            break;
+        case COPY_SENDFILE:
+            n = sendfile(out, in, NULL, want);
+            break;
+        case COPY_SPLICE:
+            n = splice(in, NULL, out, NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+            break;
+        default:
+            if (buf == NULL && (buf = malloc(COPY_BUFFER_SIZE)) == NULL) {
+                perror("malloc failed");
+                exit(1);
+            }
+            n = read(in, buf, want < COPY_BUFFER_SIZE ? want : COPY_BUFFER_SIZE);
+            if (n > 0 && write_all(out, buf, n) < 0) {
+                n = -1;
+            }
+            break;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && method != COPY_RW && done == 0 &&
+            (errno == EINVAL || errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP || errno == EBADF)) {
+            method = method == COPY_RANGE ? COPY_SENDFILE : COPY_RW;
+            continue;
+        }
+        if (n <= 0) {
+            result = n < 0 ? -1 : 0;
+            break;
+        }
+        done += n;
+    }
+    free(buf);
+    return result;
+}
+
+// copy_fd to a builtin's output stream. Streams without a descriptor
+// (the memory stream of an in-process $(...)) are written through stdio.
+int copy_to_stream(int in, FILE *out, long long limit) {
+    if (fileno(out) >= 0) {
+        fflush(out);
+        return copy_fd(in, fileno(out), limit);
+    }
+
+    char *buf = malloc(COPY_BUFFER_SIZE);
+    long long done = 0;
+    if (buf == NULL) {
+        perror("malloc failed");
+        exit(1);
+    }
+    while ((limit < 0 || done < limit) && !sigint_received) {
+        size_t want = limit >= 0 && limit - done < COPY_BUFFER_SIZE ? (size_t)(limit - done) : COPY_BUFFER_SIZE;
+        ssize_t n = read(in, buf, want);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            free(buf);
+            return n;
+        }
+        fwrite(buf, 1, n, out);
+        done += n;
+    }
+    free(buf);
+    if (sigint_received) {
+        errno = EINTR;
+        return -1;
+    }
+    return 0;
+}
+
+// Run the real program for a form a data builtin doesn't handle (or
+// that would read the terminal, where Ctrl+C must be able to stop it)
+int builtin_fallback(char **args, FILE *out) {
+    struct spawn_options opts;
+    struct strbuf captured = {0};
+
+    fflush(out);
+    if (in_subshell && out == stdout) {
+        // Already a child of the shell, with its pipeline's group and
+        // descriptors: become the program rather than start another
+        execvp(args[0], args);
+        int error = errno;
+        report_exec_failure(args[0], error);
+        return exec_failure_status(error);
+    }
+    spawn_options_init(&opts);
+    opts.no_builtin = 1;
+    int status = execute_spawn(args, &opts, out == stdout ? NULL : &captured);
+    fwrite(captured.data, 1, captured.len, out);
+    strbuf_free(&captured);
+    return status;
+}
+
+// Data builtins run in the shell, whose SIGINT handler restarts system
+// calls. While one runs, Ctrl+C interrupts a blocking open, read or
+// splice instead (a FIFO with no writer, a terminal), so the builtin can
+// stop with 130 rather than hold the shell.
+struct sigaction data_builtin_sigint;
+
+void data_builtin_begin(void) {
+    sigint_received = 0;
+    sigaction(SIGINT, NULL, &data_builtin_sigint);
+    if (data_builtin_sigint.sa_handler == sigint_handler) {
+        struct sigaction sa = data_builtin_sigint;
+        sa.sa_flags &= ~SA_RESTART;
+        sigaction(SIGINT, &sa, NULL);
+    }
+}
+
+void data_builtin_end(void) {
+    if (data_builtin_sigint.sa_handler == sigint_handler) {
+        sigaction(SIGINT, &data_builtin_sigint, NULL);
+    }
+}
+
+// Open a data builtin's input: a file, or stdin for NULL or "-"
+int open_input(const char *who, const char *path) {
+    if (path == NULL || strcmp(path, "-") == 0) {
+        return STDIN_FILENO;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 && !sigint_received) {
+        fprintf(stderr, "%s: %s: %s\n", who, path, strerror(errno));
+    }
+    return fd;
+}
+
+// cat [FILE...]: in-process, so the common case costs no fork
+int builtin_cat(char **args, FILE *out) {
+    int status = 0;
+
+    for (int i = 1; args[i] != NULL; i++) {
+        if (args[i][0] == '-' && args[i][1] != '\0') {
+            return builtin_fallback(args, out); // Options (-n, -A, ...)
+        }
+    }
+    if (isatty(STDIN_FILENO) && (args[1] == NULL || strcmp(args[1], "-") == 0)) {
+        return builtin_fallback(args, out);
+    }
+
+    data_builtin_begin();
+    for (int i = 1; i == 1 || args[i] != NULL; i++) {
+        int fd = open_input("cat", args[i]);
+        if (fd < 0 && sigint_received) {
+            status = 130;
+            break;
+        }
+        if (fd < 0) {
+            status = 1;
+            continue;
+        }
+        if (copy_to_stream(fd, out, -1) < 0) {
+            if (errno == EINTR) {
+                status = 130;
+            } else {
+                fprintf(stderr, "cat: %s: %s\n", args[i] ? args[i] : "-", strerror(errno));
+                status = 1;
+            }
+        }
+        if (fd != STDIN_FILENO) {
+            close(fd);
+        }
+        if (status == 130 || args[i] == NULL) {
+            break;
+        }
+    }
+    data_builtin_end();
+    return status;
+}
+
+// head [-c BYTES | -n LINES | -LINES] [FILE...]. Byte counts are copied
+// inside the kernel; lines are counted in a buffer.
+int builtin_head(char **args, FILE *out) {
+    long long count = 10;
+    int bytes = 0;
+    int i = 1;
+
+    if (args[i] != NULL && (strcmp(args[i], "-c") == 0 || strcmp(args[i], "-n") == 0) && args[i + 1] != NULL) {
+        char *end;
+        bytes = args[i][1] == 'c';
+        count = strtoll(args[i + 1], &end, 10);
+        if (*end != '\0' || count < 0) {
+            return builtin_fallback(args, out); // Suffixes, negative counts
+        }
+        i += 2;
+    } else if (args[i] != NULL && args[i][0] == '-' && args[i][1] >= '0' && args[i][1] <= '9') {
+        char *end;
+        count = strtoll(args[i] + 1, &end, 10);
+        if (*end != '\0') {
+            return builtin_fallback(args, out);
+        }
+        i++;
+    }
+    for (int j = i; args[j] != NULL; j++) {
+        if (args[j][0] == '-' && args[j][1] != '\0') {
+            return builtin_fallback(args, out);
+        }
+    }
+    if (isatty(STDIN_FILENO) && (args[i] == NULL || strcmp(args[i], "-") == 0)) {
+        return builtin_fallback(args, out);
+    }
+
+    int status = 0;
+    int n_files = n_args(args) - i;
+    data_builtin_begin();
+    for (int j = i; j == i || args[j] != NULL; j++) {
+        int fd = open_input("head", args[j]);
+        if (fd < 0 && sigint_received) {
+            break;
+        }
+        if (fd < 0) {
+            status = 1;
+            continue;
+        }
+        if (n_files > 1) {
+            fprintf(out, "%s==> %s <==\n", j > i ? "\n" : "", args[j]);
+        }
+        if (bytes) {
+            if (copy_to_stream(fd, out, count) < 0) {
+                status = errno == EINTR ? 130 : 1;
+            }
         } else {
-            // Restore default SIGINT behavior for child
-            sa.sa_handler = SIG_DFL;
-            sigaction(SIGINT, &sa, NULL);
-        }
-        
-        // Execute the command
-        if (execvp(args[0], args) < 0) {
-            perror("Command execution failed");
-            exit(1);
+            char buf[CAPTURE_READ_SIZE];
+            long long lines = 0;
+            while (lines < count && !sigint_received) {
+                ssize_t n = read(fd, buf, sizeof(buf));
+                if (n < 0 && errno == EINTR && !sigint_received) {
+                    continue;
+                }
+                if (n <= 0) {
+                    break;
+                }
+                ssize_t len = 0;
+                while (len < n && lines < count) {
+                    char *nl = memchr(buf + len, '\n', n - len);
+                    len = nl != NULL ? nl - buf + 1 : n;
+                    lines += nl != NULL;
+                }
+                fwrite(buf, 1, len, out);
+                if (len < n) {
+                    // Leave a seekable input just past the last line
+                    // printed, as head(1) does, for whoever reads on
+                    lseek(fd, len - n, SEEK_CUR);
+                }
+            }
         }
-    } else {
-        // Parent process (Shell)
-        int status;
-        pid_t child_pgid = pid; // Use child PID as its PGID for tcsetpgrp
+        if (fd != STDIN_FILENO) {
+            close(fd);
+        }
+        if (args[j] == NULL || sigint_received) {
+            break;
+        }
+    }
+    data_builtin_end();
+    return sigint_received ? 130 : status;
+}
+
+// tee [-a] [FILE...]: copy stdin to stdout and the files. Between pipes
+// with a single file this is tee(2) then splice(2); otherwise a buffer
+// is read once and written to each.
+int builtin_tee(char **args, FILE *out) {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    int i = 1;
+    int status = 0;
 
-        if (protect_sigint) {
-            printf("[Shell] Process %d is protected from SIGINT (Ctrl+C won't work)\n", pid);
+    if (args[i] != NULL && strcmp(args[i], "-a") == 0) {
+        flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+        i++;
+    }
+    for (int j = i; args[j] != NULL; j++) {
+        if (args[j][0] == '-' && args[j][1] != '\0') {
+            return builtin_fallback(args, out);
         }
+    }
+    if (isatty(STDIN_FILENO)) {
+        return builtin_fallback(args, out);
+    }
 
-        // 1. Give the child's process group control of the terminal
-        if (isatty(STDIN_FILENO)) {
-            tcsetpgrp(STDIN_FILENO, child_pgid);
+    data_builtin_begin();
+    if (args[i] == NULL) {
+        status = copy_to_stream(STDIN_FILENO, out, -1) < 0 ? (errno == EINTR ? 130 : 1) : 0;
+        data_builtin_end();
+        return status;
+    }
+
+    int n_fds = 0;
+    int *fds = malloc(sizeof(int) * (n_args(args) - i));
+    if (fds == NULL) {
+        perror("malloc failed");
+        exit(1);
+    }
+    for (int j = i; args[j] != NULL && !sigint_received; j++) {
+        int fd = open(args[j], flags, 0666);
+        if (fd < 0 && !sigint_received) {
+            fprintf(stderr, "tee: %s: %s\n", args[j], strerror(errno));
+            status = 1;
+            continue;
         }
-        
-        // 2. Wait for child to complete, allowing it to be stopped
-        pid_t result = waitpid(pid, &status, WUNTRACED);
-        
-        if (result > 0) {
-            if (WIFSTOPPED(status)) {
-                // Process was stopped by SIGTSTP
-                printf("\n[Shell] Process %d suspended.\n", pid);
-                printf("[Shell] Use 'kill -CONT %d' to resume it (or a job control command in a real shell).\n", pid);
-            } else if (WIFEXITED(status)) {
-                int exit_status = WEXITSTATUS(status);
-                if (exit_status != 0) {
-                    printf("[Shell] Process exited with status %d\n", exit_status);
-                }
-            } else if (WIFSIGNALED(status)) {
-                printf("[Shell] Process terminated by signal %d\n", WTERMSIG(status));
-            }
-        } else if (result == -1) {
-            perror("waitpid failed");
+        fds[n_fds++] = fd;
+    }
+
+    fflush(out);
+    int out_fd = fileno(out);
+    struct stat ist, ost;
+    int zero_copy = out_fd >= 0 && n_fds == 1 && fstat(STDIN_FILENO, &ist) == 0 && S_ISFIFO(ist.st_mode) &&
+                    fstat(out_fd, &ost) == 0 && S_ISFIFO(ost.st_mode);
+    char *buf = zero_copy ? NULL : malloc(COPY_BUFFER_SIZE);
+    if (!zero_copy && buf == NULL) {
+        perror("malloc failed");
+        exit(1);
+    }
+    while (!sigint_received) {
+        ssize_t n;
+        if (zero_copy) {
+            n = tee(STDIN_FILENO, out_fd, COPY_CHUNK_SIZE, 0);
+            if (n > 0) {
+                // tee left the data in stdin's pipe; move it to the file
+                for (ssize_t left = n; left > 0;) {
+                    ssize_t m = splice(STDIN_FILENO, NULL, fds[0], NULL, left, SPLICE_F_MOVE);
+                    if (m < 0 && errno == EINTR && !sigint_received) {
+                        continue;
+                    }
+                    if (m <= 0) {
+                        status = 1;
+                        break;
+                    }
+                    left -= m;
+                }
+            }
+        } else {
+            n = read(STDIN_FILENO, buf, COPY_BUFFER_SIZE);
+            if (n > 0) {
+                if (out_fd >= 0) {
+                    write_all(out_fd, buf, n);
+                } else {
+                    fwrite(buf, 1, n, out);
+                }
+                for (int j = 0; j < n_fds; j++) {
+                    if (write_all(fds[j], buf, n) < 0) {
+                        status = 1;
+                    }
+                }
+            }
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
         }
-        
-        // 3. Reclaim terminal control
-        if (isatty(STDIN_FILENO)) {
-            tcsetpgrp(STDIN_FILENO, shell_pgid);
+        if (n <= 0) {
+            break;
         }
     }
+    free(buf);
+    for (int j = 0; j < n_fds; j++) {
+        close(fds[j]);
+    }
+    free(fds);
+    data_builtin_end();
+    return sigint_received ? 130 : status;
 }
 
-// Built-in commands
-int handle_builtin(char **args) {
-    if (args[0] == NULL) {
-        return 1;
+// cp SRC DST, cp SRC... DIR: regular files only, copied with
+// copy_file_range (a reflink or server-side copy where the filesystem
+// offers one). Options and directories go to the real cp.
+int builtin_cp(char **args, FILE *out) {
+    int n = n_args(args) - 1;
+
+    for (int i = 1; args[i] != NULL; i++) {
+        if (args[i][0] == '-') {
+            return builtin_fallback(args, out);
+        }
     }
-    
-    if (strcmp(args[0], "exit") == 0) {
-        printf("Goodbye!\n");
-        return 2; // Special return value to exit shell
+    if (n < 2) {
+        return builtin_fallback(args, out);
     }
-    
-    if (strcmp(args[0], "help") == 0) {
-        printf("\n=== Custom Signal Handling Shell ===\n");
-        printf("Features:\n");
-        printf("  - Ctrl+C in shell shows message instead of exiting\n");
-        printf("  - 'sleep' commands ignore Ctrl+C (SIGINT protected)\n");
-        printf("  - Ctrl+Z suspends process directly (proper job control set up)\n");
-        printf("\nBuilt-in commands:\n");
-        printf("  help     - Show this help message\n");
-        printf("  exit     - Exit the shell\n");
-        printf("  cd <dir> - Change directory\n");
-        printf("\nTry these:\n");
-        printf("  sleep 10     - Try pressing Ctrl+C (won't work!)\n");
-        printf("  ls -la       - Try pressing Ctrl+C (will work)\n");
-        printf("  cat          - Try pressing Ctrl+Z (will suspend)\n");
-        printf("\n");
+    const char *target = args[n];
+    int to_dir = path_is_dir(target);
+    if (n > 2 && !to_dir) {
+        fprintf(stderr, "cp: target '%s' is not a directory\n", target);
         return 1;
     }
-    
-    if (strcmp(args[0], "cd") == 0) {
-        if (args[1] == NULL) {
-            fprintf(stderr, "cd: missing argument\n");
+
+    int status = 0;
+    data_builtin_begin();
+    for (int i = 1; i < n && !sigint_received; i++) {
+        struct stat sst, dst;
+        struct strbuf path = {0};
+        strbuf_append(&path, target, strlen(target));
+        if (to_dir) {
+            const char *base = strrchr(args[i], '/');
+            base = base != NULL ? base + 1 : args[i];
+            strbuf_putc(&path, '/');
+            strbuf_append(&path, base, strlen(base));
+        }
+
+        int in = open(args[i], O_RDONLY | O_CLOEXEC);
+        if (in < 0 || fstat(in, &sst) < 0) {
+            if (!sigint_received) {
+                fprintf(stderr, "cp: %s: %s\n", args[i], strerror(errno));
+            }
+            status = 1;
+        } else if (S_ISDIR(sst.st_mode)) {
+            fprintf(stderr, "cp: -r not specified; omitting directory '%s'\n", args[i]);
+            status = 1;
+        } else if (stat(path.data, &dst) == 0 && dst.st_dev == sst.st_dev && dst.st_ino == sst.st_ino) {
+            fprintf(stderr, "cp: '%s' and '%s' are the same file\n", args[i], path.data);
+            status = 1;
         } else {
-            if (chdir(args[1]) != 0) {
-                perror("cd failed");
+            int outfd = open(path.data, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, sst.st_mode & 0777);
+            if (outfd < 0) {
+                if (!sigint_received) {
+                    fprintf(stderr, "cp: %s: %s\n", path.data, strerror(errno));
+                }
+                status = 1;
+            } else {
+                if (copy_fd(in, outfd, -1) < 0 && !sigint_received) {
+                    fprintf(stderr, "cp: %s: %s\n", path.data, strerror(errno));
+                    status = 1;
+                }
+                close(outfd);
             }
         }
+        if (in >= 0) {
+            close(in);
+        }
+        strbuf_free(&path);
+    }
+    data_builtin_end();
+    return sigint_received ? 130 : status;
+}
+
+const struct builtin builtins[] = {
+    {"exit", builtin_exit, 0},
+    {"help", builtin_help, 1},
+    {"cd", builtin_cd, 0},
+    {"pwd", builtin_pwd, 1},
+    {"echo", builtin_echo, 1},
+    {"stats", builtin_stats, 1},
+    {"set", builtin_set, 0},
+    {"history", builtin_history, 1},
+    {"trace", builtin_trace, 0},
+    {"perf", builtin_perf, 1},
+    {"hash", builtin_hash, 0},
+    {"prompt", builtin_prompt, 0},
+    {"pushd", builtin_pushd, 0},
+    {"popd", builtin_popd, 0},
+    {"dirs", builtin_dirs, 1},
+    {"z", builtin_z, 0},
+    {"jobs", builtin_jobs, 1},
+    {"joblog", builtin_joblog, 1},
+    {"pipestatus", builtin_pipestatus, 1},
+    {"sigpolicy", builtin_sigpolicy, 0},
+    {"snapshot", builtin_snapshot, 0},
+    {"batch", builtin_batch, 0},
+    {"cat", builtin_cat, 1},
+    {"head", builtin_head, 1},
+    {"tee", builtin_tee, 1},
+    {"cp", builtin_cp, 1},
+    {NULL, NULL, 0}
+};
+
+const struct builtin *find_builtin(const char *name) {
+    for (int i = 0; builtins[i].name != NULL; i++) {
+        if (strcmp(name, builtins[i].name) == 0) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+// Built-in commands
+int handle_builtin(char **args, FILE *out) {
+    if (args[0] == NULL) {
         return 1;
     }
-    
-    return 0; // Not a built-in command
+
+    const struct builtin *b = find_builtin(args[0]);
+    if (b == NULL) {
+        return 0; // Not a built-in command
+    }
+
+    last_status = b->fn(args, out);
+    if (exit_requested) {
+        return 2; // Special return value to exit shell
+    }
+    return 1;
 }
 
 // Initialization for job control
@@ -192,7 +8093,13 @@ void init_shell() {
             kill(-shell_pgid, SIGTTIN);
         }
 
-        // Ignore SIGINT and SIGTSTP while in the shell's main loop
+        // Ignore SIGINT and SIGTSTP while in the shell's main loop.
+        // SIGWINCH must interrupt the editor's read, so no SA_RESTART.
+        struct sigaction sa;
+        sa.sa_handler = sigwinch_handler;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = 0;
+        sigaction(SIGWINCH, &sa, NULL);
         signal(SIGINT, sigint_handler);
         signal(SIGQUIT, SIG_IGN); // Ignore Quit signal
         signal(SIGTSTP, SIG_IGN); // Ignore Stop signal (Ctrl+Z)
@@ -201,73 +8108,206 @@ void init_shell() {
 
         // Put ourselves in our own process group
         setpgid(shell_pgid, shell_pgid);
-        
+
         // Grab control of the terminal
         tcsetpgrp(STDIN_FILENO, shell_pgid);
 
         // Save default terminal attributes for later
         tcgetattr(STDIN_FILENO, &shell_tmodes);
+
+        opt_history = 1;
+        opt_zdb = 1;
+        history_open();
     }
+
+    const char *format = getenv("SIGSHELL_PROMPT");
+    prompt.format = strdup(format != NULL ? format : "sigshell> ");
+    dirs_init();
 }
 
-int main() {
-    char cmd[MAX_CMD_LEN];
-    char *args[MAX_ARGS];
-    
+int main(int argc, char **argv) {
+    char *cmd = NULL;
+
+    const char *serve_path = NULL;
+    const char *restore_path = NULL;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_path = argv[++i];
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--evloop") == 0 && i + 1 < argc &&
+                   (strcmp(argv[i + 1], "epoll") == 0 || strcmp(argv[i + 1], "io_uring") == 0)) {
+            evloop.want_uring = strcmp(argv[++i], "io_uring") == 0;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            if (trace_start(argv[++i]) != 0) {
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+            restore_path = argv[++i];
+        } else {
+            fprintf(stderr, "usage: sigshell [--evloop epoll|io_uring] [--trace FILE] [--restore FILE] "
+                            "[--serve SOCKET [--jobs N]]\n");
+            return 2;
+        }
+    }
+    atexit(trace_stop);
+    if (serve_path != NULL) {
+        return serve_main(serve_path, jobs > 0 ? jobs : 1);
+    }
+
     // Setup for Job Control
     init_shell();
-    
+    if (restore_path != NULL) {
+        snapshot_restore(restore_path); // Starts afresh if it can't be used
+    }
+
     // The previous signal setup with sigaction is technically redundant now
     // due to the simple 'signal()' calls in init_shell(), but is fine.
     // We rely on 'init_shell' for the crucial SIG_IGN settings.
 
-    printf("\n=== Custom Signal Handling Shell ===\n");
-    printf("Type 'help' for usage information.\n");
-    printf("Type 'exit' to quit.\n\n");
-    
+    // Status output is queued and written along with the next prompt
+    output_printf("\n=== Custom Signal Handling Shell ===\n");
+    output_printf("Type 'help' for usage information.\n");
+    output_printf("Type 'exit' to quit.\n\n");
+
     while (1) {
-        printf("sigshell> ");
-        fflush(stdout);
-        
-        // Read command
-        if (fgets(cmd, sizeof(cmd), stdin) == NULL) {
-            if (feof(stdin)) {
-                printf("\n");
-                break;
-            }
-            // An interrupted read (e.g., SIGINT) is now handled by SA_RESTART/SIG_DFL, 
-            // but the loop ensures the prompt is printed again.
-            continue;
+        // Directory listings and everything in line_arena only live for
+        // one command line
+        glob_cache_clear();
+        arena_release(&line_arena);
+
+        // Report background jobs that finished or stopped, picking up
+        // any SIGCHLD not yet seen by the event loop
+        if (job_table.sigchld_fd >= 0) {
+            job_sigchld(job_table.sigchld_fd, EPOLLIN, NULL);
+        }
+        if (job_table.changed) {
+            jobs_report();
+        }
+
+        // Read command. In a parallel block the script is read ahead
+        // of the output, so prompts would only get in the way.
+        cmd = read_command_line(parallel.limit > 0 ? "" : prompt_render(isatty(STDIN_FILENO)));
+        if (cmd == NULL) {
+            parallel_wait(1);
+            output_queue("\n", 1);
+            break;
         }
-        
-        // Remove trailing newline
-        cmd[strcspn(cmd, "\n")] = 0;
-        
+        uint64_t read_ns = monotonic_ns();
+
         // Skip empty commands
         if (strlen(cmd) == 0) {
             continue;
         }
-        
+
+        // '#sigshell parallel N' and '#sigshell serial' in scripts; any
+        // other line starting with '#' is a comment
+        if (strncmp(cmd, "#sigshell", 9) == 0 && (cmd[9] == ' ' || cmd[9] == '\t') && !isatty(STDIN_FILENO)) {
+            parallel_directive(cmd + 9);
+            continue;
+        }
+        if (cmd[strspn(cmd, " \t")] == '#') {
+            continue;
+        }
+
+        history_add(cmd);
+
         // Parse command
-        int argc = parse_command(cmd, args);
-        if (argc == 0) {
+        struct pipeline_stage *stages;
+        int background;
+        TRACE(TRACE_PARSE_START, 0, 0, NULL);
+        int n_stages = parse_pipeline(cmd, &stages, &background);
+        TRACE(TRACE_PARSE_END, 0, n_stages, NULL);
+        latency_record(LAT_READ_PARSE, read_ns);
+        parse_done_ns = monotonic_ns();
+        if (n_stages <= 0) {
+            continue;
+        }
+
+        // In a parallel block, external commands and pipelines start
+        // while earlier ones still run; anything else first waits for
+        // the block's commands to finish
+        if (parallel.limit > 0 && !background &&
+            (n_stages > 1 || find_builtin(stages[0].args.argv[0]) == NULL)) {
+            parallel_submit(stages, n_stages);
+            pipeline_done(stages, n_stages, 0);
             continue;
         }
-        
-        // Handle built-in commands
-        int builtin_result = handle_builtin(args);
+        parallel_wait(1);
+
+        // Background commands, builtins included, run in a child
+        if (background) {
+            size_t len = strlen(cmd);
+            while (len > 0 && strchr(" \t&", cmd[len - 1]) != NULL) {
+                len--;
+            }
+            cmd[len] = '\0';
+            last_status = job_start(stages, n_stages, cmd);
+            pipeline_done(stages, n_stages, 0);
+            continue;
+        }
+
+        // Pipelines run every stage in a child, builtins included,
+        // except a pure builtin at the end when there's no terminal
+        if (n_stages > 1) {
+            last_status = execute_pipeline(stages, n_stages, cmd);
+            pipeline_done(stages, n_stages, 1);
+            prompt_command_done(last_status, monotonic_ns() - read_ns);
+            continue;
+        }
+        struct arglist args = stages[0].args;
+        struct command_io io = stages[0].io;
+
+        // Handle built-in commands, after any status output from
+        // command substitutions so the two stay in order. A
+        // here-document is their stdin for the duration.
+        output_flush();
+        int saved_stdin = -1;
+        if (io.stdin_fd >= 0 && find_builtin(args.argv[0]) != NULL) {
+            saved_stdin = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3);
+            dup2(io.stdin_fd, STDIN_FILENO);
+        }
+        int builtin_result = handle_builtin(args.argv, stdout);
+        if (saved_stdin >= 0) {
+            dup2(saved_stdin, STDIN_FILENO);
+            close(saved_stdin);
+        }
+        if (builtin_result != 0) {
+            command_io_done(&io, 1);
+            pipe_status[0] = last_status;
+            n_pipe_status = 1;
+        }
         if (builtin_result == 2) {
+            arglist_free(&args);
             break; // Exit command
         } else if (builtin_result == 1) {
+            prompt_command_done(last_status, monotonic_ns() - read_ns);
+            arglist_free(&args);
             continue; // Other built-in handled
         }
-        
-        // Check if command should be protected from SIGINT
-        int protect = should_protect_sigint(args[0]);
-        
-        // Execute external command
-        execute_command(args, protect);
+
+        // Execute external command. Commands that are safe to split
+        // (rm, chmod, ...) run in batches when their arguments are too
+        // long for a single exec.
+        int fixed = batch_fixed_args(args.argv, 0);
+        if (fixed >= 0 && io.stdin_fd < 0 && io.n_subst == 0 &&
+            !exec_args_fit(args.argv, exec_args_limit(NULL))) {
+            last_status = batch_run(args.argv, fixed, 1, 0);
+        } else {
+            struct spawn_options opts;
+            spawn_options_init(&opts);
+            opts.sigint_policy = signal_guard_policy(args.argv[0]);
+            command_io_apply(&io, &opts);
+            last_status = execute_spawn(args.argv, &opts, NULL);
+        }
+        command_io_done(&io, 1);
+        pipe_status[0] = last_status;
+        n_pipe_status = 1;
+        prompt_command_done(last_status, monotonic_ns() - read_ns);
+        arglist_free(&args);
     }
-    
+
+    output_flush();
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,68 @@
+// LD_PRELOAD shim for tests/check_allocs.sh: counts the malloc family
+// calls made by one process and writes the total to $MALLOC_COUNT_FILE
+// when it exits. It drops itself from LD_PRELOAD at startup, so the
+// commands the shell runs (and their allocations) aren't counted.
+//
+//   gcc -shared -fPIC -O2 -o malloc_count.so malloc_count.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long count;
+static pid_t owner;
+
+void *malloc(size_t size) {
+    __atomic_fetch_add(&count, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    __atomic_fetch_add(&count, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    __atomic_fetch_add(&count, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t align, size_t size) {
+    __atomic_fetch_add(&count, 1, __ATOMIC_RELAXED);
+    *ptr = __libc_memalign(align, size);
+    return *ptr == NULL ? 12 : 0; // ENOMEM
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+    __atomic_fetch_add(&count, 1, __ATOMIC_RELAXED);
+    return __libc_memalign(align, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+__attribute__((constructor)) static void malloc_count_init(void) {
+    owner = getpid();
+    unsetenv("LD_PRELOAD");
+}
+
+// Forked children that exit without exec (builtins in a subshell) run
+// this too; only the original process reports
+__attribute__((destructor)) static void malloc_count_report(void) {
+    const char *path = getenv("MALLOC_COUNT_FILE");
+    if (path == NULL || getpid() != owner) {
+        return;
+    }
+    FILE *f = fopen(path, "w");
+    if (f != NULL) {
+        fprintf(f, "%lu\n", count);
+        fclose(f);
+    }
+}
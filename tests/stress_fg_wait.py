@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+"""Foreground wait stress check: run commands in sigshell on a pty
+while another thread sends the shell SIGCHLD, SIGWINCH and SIGINT, and
+its children SIGCONT, as fast as it can. Every command must take as
+long as it should (an EINTR or WCONTINUED taken for an exit returns
+early), report the right exit statuses and finish without hanging.
+
+SIGINT is only sent while a command runs: at the prompt it clears the
+line being typed, as Ctrl+C does. A run of short commands gets the
+other signals throughout, prompts included.
+
+Usage: tests/stress_fg_wait.py [SIGSHELL]   (default: ./sigshell)
+"""
+import os
+import pty
+import select
+import signal
+import sys
+import threading
+import time
+
+SHELL = sys.argv[1] if len(sys.argv) > 1 else "./sigshell"
+STEP_TIMEOUT = 15.0
+PROMPT = b"sigshell> "
+
+# (command, least seconds it takes, expected 'pipestatus' output)
+STEPS = [
+    ("sleep 1", 1.0, "0"),
+    ("/bin/sleep 1", 1.0, "0"),
+    ("sh -c 'sleep 0.5; exit 3'", 0.5, "3"),
+    ("sleep 0.5 | sh -c 'cat; exit 4'", 0.5, "0 4"),
+    ("batch -P 3 -n 1 sleep 0.5 0.5 0.5", 0.5, "0"),
+    ("sh -c 'trap \"\" INT; sleep 1; exit 5'", 1.0, "5"),
+]
+TRUE_LOOP = 200  # Short commands run one after another
+
+
+class Shell:
+    def __init__(self):
+        self.pid, self.fd = pty.fork()
+        if self.pid == 0:
+            os.execv(SHELL, [SHELL])
+        self.out = b""
+        self.wait_for(PROMPT)
+
+    def read(self, timeout):
+        r, _, _ = select.select([self.fd], [], [], timeout)
+        if r:
+            try:
+                self.out += os.read(self.fd, 65536)
+            except OSError:
+                raise SystemExit("FAIL: the shell went away")
+
+    def wait_for(self, text, what="the shell"):
+        start = time.monotonic()
+        while text not in self.out:
+            if time.monotonic() - start > STEP_TIMEOUT:
+                raise SystemExit(f"FAIL: {what} hung (no prompt after {STEP_TIMEOUT:.0f}s)")
+            self.read(0.05)
+
+    def children(self):
+        try:
+            with open(f"/proc/{self.pid}/task/{self.pid}/children") as f:
+                return [int(p) for p in f.read().split()]
+        except OSError:
+            return []
+
+    # Type 'line' and wait for its result and the next prompt. Returns
+    # the output and the time taken.
+    def run(self, line, sender=None, sigs=None):
+        self.out = b""
+        start = time.monotonic()
+        os.write(self.fd, line.encode() + b"\r")
+        if sender is not None:
+            while not self.children() and time.monotonic() - start < 2:
+                time.sleep(0.001)
+            sender.start_sending(sigs)
+        self.wait_for(b"\n" + PROMPT, f"'{line[:40]}'")
+        took = time.monotonic() - start
+        if sender is not None:
+            sender.stop_sending()
+            time.sleep(0.05)
+            self.read(0.05)
+        return self.out.decode(errors="replace"), took
+
+    def pipestatus(self):
+        out, _ = self.run("pipestatus")
+        lines = [l.strip() for l in out.splitlines()]
+        return [l for l in lines if l[:1].isdigit()]
+
+
+class Sender(threading.Thread):
+    def __init__(self, shell):
+        super().__init__(daemon=True)
+        self.shell = shell
+        self.active = threading.Event()
+        self.idle = threading.Event()
+        self.sigs = []
+        self.sent = 0
+
+    def start_sending(self, sigs):
+        self.sigs = sigs
+        self.idle.clear()
+        self.active.set()
+
+    def stop_sending(self):
+        self.active.clear()
+        self.idle.wait()
+
+    def run(self):
+        i = 0
+        while True:
+            if not self.active.is_set():
+                self.idle.set()
+                self.active.wait()
+                continue
+            try:
+                os.kill(self.shell.pid, self.sigs[i % len(self.sigs)])
+                self.sent += 1
+                if i % 16 == 0:
+                    for child in self.shell.children():
+                        os.kill(child, signal.SIGCONT)
+                        self.sent += 1
+            except ProcessLookupError:
+                pass
+            i += 1
+
+
+def main():
+    shell = Shell()
+    sender = Sender(shell)
+    sender.start()
+    failures = 0
+    all_sigs = [signal.SIGCHLD, signal.SIGWINCH, signal.SIGINT]
+
+    # 'sleep' with and without a signal policy, whose wait goes through
+    # the event loop
+    for policy in ("default", "ignore"):
+        shell.run(f"sigpolicy sleep {policy}")
+        for line, least, expect in STEPS:
+            out, took = shell.run(line, sender, all_sigs)
+            status = shell.pipestatus()
+            problems = []
+            if took < least:
+                problems.append(f"returned after {took:.2f}s, expected at least {least}s")
+            if "waitpid failed" in out:
+                problems.append("'waitpid failed'")
+            if status != [expect]:
+                problems.append(f"pipestatus {status}, expected '{expect}'")
+            if problems:
+                failures += 1
+                print(f"FAIL: [{policy}] {line}: {'; '.join(problems)}")
+            else:
+                print(f"ok: [{policy}] {line} ({took:.2f}s)")
+
+    start = time.monotonic()
+    sender.start_sending([signal.SIGCHLD, signal.SIGWINCH])
+    bad = 0
+    for i in range(TRUE_LOOP):
+        out, _ = shell.run("/bin/true" if i % 2 else "sh -c 'exit 6'")
+        bad += "waitpid failed" in out or ("exited with status 6" in out) == bool(i % 2)
+    sender.stop_sending()
+    if bad:
+        failures += 1
+        print(f"FAIL: {bad} of {TRUE_LOOP} short commands reported the wrong status")
+    else:
+        print(f"ok: {TRUE_LOOP} short commands ({time.monotonic() - start:.2f}s)")
+
+    os.write(shell.fd, b"exit\r")
+    shell.read(0.5)
+    print(f"{sender.sent} signals sent, {failures} failures")
+    sys.exit(1 if failures else 0)
+
+
+if __name__ == "__main__":
+    main()